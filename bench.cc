@@ -0,0 +1,706 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Benchmark suite. Generates a reproducible corpus and measures load,
+ * lazy load, and write throughput, allocations and peak memory usage.
+ */
+#include "cppjson.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <new>
+
+#define FOR_EACH_CONST(type, i, cont)		\
+	for (type::const_iterator i = (cont).begin(); i != (cont).end(); ++i)
+
+/*
+ * Allocation accounting. The library allocates through the global
+ * operator new, which the definitions below replace for the whole process.
+ * The prefetch ops allocate on other threads too, so the counters are
+ * atomic.
+ */
+static size_t num_allocs = 0;
+static size_t alloc_bytes = 0;
+
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(size_t size)
+{
+	__atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+	void *ptr = malloc(size ? size : 1);
+	if (ptr == NULL) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *ptr) throw()
+{
+	free(ptr);
+}
+
+void operator delete[](void *ptr) throw()
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) throw()
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void *ptr, size_t) throw()
+{
+	operator delete(ptr);
+}
+
+/* Deterministic pseudo random generator, so that the corpus is reproducible */
+static uint64_t rand_state;
+
+static uint32_t rnd()
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state >> 16;
+}
+
+static void rnd_word(FILE *f, int len)
+{
+	for (int i = 0; i < len; ++i)
+		fputc('a' + rnd() % 26, f);
+}
+
+static void gen_numbers(FILE *f)
+{
+	fputc('[', f);
+	for (int i = 0; i < 16; ++i) {
+		if (i)
+			fputs(", ", f);
+		switch (rnd() % 4) {
+		case 0:
+			fprintf(f, "%u", rnd() % 1000);
+			break;
+		case 1:
+			fprintf(f, "-%u%05u", rnd(), rnd() % 100000);
+			break;
+		case 2:
+			fprintf(f, "%u.%u", rnd() % 100000, rnd() % 1000);
+			break;
+		default:
+			fprintf(f, "%u.%ue-%u", rnd() % 10, rnd() % 1000000,
+				rnd() % 30);
+		}
+	}
+	fputc(']', f);
+}
+
+static void gen_string(FILE *f)
+{
+	static const char *pieces[] = {
+		"\\n", "\\t", "\\\"", "\\\\", "\\/", "\\u00e9", "\\u2603",
+		"\xC3\xA4", "\xE2\x82\xAC", "\xF0\x9F\x98\x80",
+	};
+	fputc('"', f);
+	int words = 4 + rnd() % 24;
+	for (int i = 0; i < words; ++i) {
+		if (i)
+			fputc(' ', f);
+		rnd_word(f, 1 + rnd() % 10);
+		if (rnd() % 4 == 0)
+			fputs(pieces[rnd() % 10], f);
+	}
+	fputc('"', f);
+}
+
+static void gen_deep(FILE *f)
+{
+	int depth = 32 + rnd() % 96;
+	for (int i = 0; i < depth; ++i) {
+		if (i % 2)
+			fputs("{\"a\": ", f);
+		else
+			fputc('[', f);
+	}
+	fprintf(f, "%u", rnd());
+	for (int i = depth - 1; i >= 0; --i) {
+		if (i % 2)
+			fputc('}', f);
+		else
+			fprintf(f, ", %u]", rnd() % 100);
+	}
+}
+
+static void gen_wide(FILE *f)
+{
+	fputc('{', f);
+	for (int i = 0; i < 512; ++i) {
+		if (i)
+			fputs(", ", f);
+		fprintf(f, "\"key%04d\": %u", i, rnd() % 10000);
+	}
+	fputc('}', f);
+}
+
+static void gen_record(FILE *f, const char *nl, const char *ind)
+{
+	static uint64_t id = 100000000000ULL;
+	fprintf(f, "{%s%s\"created_at\": \"Mon Jan %02u %02u:%02u:%02u +0000 2012\",",
+		nl, ind, 1 + rnd() % 28, rnd() % 24, rnd() % 60, rnd() % 60);
+	fprintf(f, "%s%s\"id\": %llu,", nl, ind, (unsigned long long) id++);
+	fprintf(f, "%s%s\"text\": ", nl, ind);
+	gen_string(f);
+	fprintf(f, ",%s%s\"user\": {%s%s%s\"screen_name\": \"", nl, ind, nl,
+		ind, ind);
+	rnd_word(f, 4 + rnd() % 8);
+	fprintf(f, "\",%s%s%s\"followers_count\": %u,", nl, ind, ind,
+		rnd() % 100000);
+	fprintf(f, "%s%s%s\"verified\": %s%s%s},", nl, ind, ind,
+		rnd() % 2 ? "true" : "false", nl, ind);
+	fprintf(f, "%s%s\"retweet_count\": %u,", nl, ind, rnd() % 1000);
+	fprintf(f, "%s%s\"coordinates\": ", nl, ind);
+	if (rnd() % 4 == 0)
+		fprintf(f, "[%u.%06u, %u.%06u]", rnd() % 180, rnd() % 1000000,
+			rnd() % 90, rnd() % 1000000);
+	else
+		fputs("null", f);
+	fprintf(f, ",%s%s\"favorited\": false%s}", nl, ind, nl);
+}
+
+static void gen_records(FILE *f)
+{
+	gen_record(f, "", "");
+}
+
+static void gen_pretty(FILE *f)
+{
+	gen_record(f, "\n    ", "  ");
+}
+
+struct Corpus {
+	const char *name;
+	void (*gen)(FILE *f);
+	bool huge;
+};
+
+static const Corpus corpora[] = {
+	{"numbers", gen_numbers, false},
+	{"strings", gen_string, false},
+	{"deep", gen_deep, false},
+	{"wide", gen_wide, false},
+	{"records", gen_records, false},
+	{"pretty", gen_pretty, true},
+};
+
+#define NUM_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+/* Settings */
+static const char *data_dir = "bench-data";
+static int corpus_mb = 16;
+static int huge_mb = 0;
+static double min_time = 1.0;
+static const char *only = NULL;
+
+/*
+ * Generates a top-level array of elements until the file is about the
+ * requested size. The size is a part of the filename so that the files
+ * are regenerated when the settings change.
+ */
+static std::string corpus_path(const Corpus &c)
+{
+	int mb = c.huge ? huge_mb : corpus_mb;
+	char buf[256];
+	snprintf(buf, sizeof buf, "%s/%s-%dM.json", data_dir, c.name, mb);
+	std::string path = buf;
+
+	struct stat st;
+	if (stat(path.c_str(), &st) == 0) {
+		return path;
+	}
+	fprintf(stderr, "generating %s\n", path.c_str());
+	std::string tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (f == NULL) {
+		perror(tmp.c_str());
+		exit(1);
+	}
+	rand_state = 0x2545F4914F6CDD1DULL;
+	const char *sep = c.huge ? ",\n  " : ", ";
+	fputs(c.huge ? "[\n  " : "[", f);
+	off_t size = off_t(mb) << 20;
+	for (int i = 0; ftello(f) < size; ++i) {
+		if (i)
+			fputs(sep, f);
+		c.gen(f);
+	}
+	fputs(c.huge ? "\n]\n" : "]\n", f);
+	if (fclose(f)) {
+		perror(tmp.c_str());
+		exit(1);
+	}
+	rename(tmp.c_str(), path.c_str());
+	return path;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Discards everything, but counts the bytes */
+class NullBuf: public std::streambuf {
+public:
+	size_t count;
+
+	NullBuf() : count(0) {}
+
+protected:
+	int overflow(int c)
+	{
+		count++;
+		return c;
+	}
+	std::streamsize xsputn(const char *, std::streamsize n)
+	{
+		count += n;
+		return n;
+	}
+};
+
+/* Runs one operation over the corpus. Returns the number of documents */
+static size_t run_op(const char *op, const std::string &path,
+		     json::Value &doc)
+{
+	if (strcmp(op, "write_cached") == 0) {
+		/* one element of the document changes between the writes */
+		if (doc.type() == json::JSON_ARRAY && !doc.as_array().empty()) {
+			json::Value copy = doc.as_array().back();
+			doc.as_array().back().swap(copy);
+		}
+		NullBuf buf;
+		std::ostream os(&buf);
+		json::WriteOptions options;
+		options.cache = true;
+		doc.write(os, options);
+		return 1;
+	} else if (strncmp(op, "lookup", 6) == 0) {
+		/* fields of every record, as literals or as keys */
+		static const json::Key id("id"), text("text"),
+			retweets("retweet_count");
+		const std::vector<json::Value> &records = doc.as_array();
+		size_t found = 0;
+		for (int round = 0; round < 10; ++round) {
+			for (size_t i = 0; i < records.size(); ++i) {
+				const json::Value &rec = records[i];
+				if (strcmp(op, "lookup_key") == 0) {
+					found += rec.contains(id) + rec.contains(text) +
+						rec.contains(retweets);
+				} else {
+					found += rec.contains("id") +
+						rec.contains("text") +
+						rec.contains("retweet_count");
+				}
+			}
+		}
+		if (found == 0) {
+			throw std::runtime_error("No fields found");
+		}
+		return 1;
+	} else if (strncmp(op, "write", 5) == 0) {
+		NullBuf buf;
+		std::ostream os(&buf);
+		doc.write(os);
+		return 1;
+	}
+	std::ifstream is(path.c_str());
+	if (strcmp(op, "copy") == 0) {
+		/* baseline for the reformatter */
+		NullBuf buf;
+		std::ostream os(&buf);
+		os << is.rdbuf();
+		return 1;
+	} else if (strcmp(op, "minify") == 0) {
+		NullBuf buf;
+		std::ostream os(&buf);
+		json::reformat(is, os);
+		return 1;
+	} else if (strcmp(op, "pretty") == 0) {
+		NullBuf buf;
+		std::ostream os(&buf);
+		json::reformat(is, os, 2);
+		return 1;
+	}
+	json::Value val;
+	if (strcmp(op, "load") == 0) {
+		val.load(is);
+		return 1;
+	} else if (strcmp(op, "load_all") == 0) {
+		val.load_all(is);
+		return 1;
+	} else if (strcmp(op, "load_strict") == 0) {
+		/* shows the overhead of UTF-8 validation */
+		json::LoadOptions options;
+		options.strict_utf8 = true;
+		val.load(is, options);
+		return 1;
+	} else if (strcmp(op, "load_noshape") == 0) {
+		/* shows the gain of the shape cache */
+		json::LoadOptions options;
+		options.cache_shapes = false;
+		val.load(is, options);
+		return 1;
+	} else if (strcmp(op, "load_raw") == 0) {
+		json::LoadOptions options;
+		options.raw_numbers = true;
+		val.load(is, options);
+		return 1;
+	} else if (strcmp(op, "load_shared") == 0) {
+		/* shows the cost of hashing and sharing subtrees */
+		json::LoadOptions options;
+		options.share_subtrees = true;
+		val.load(is, options);
+		return 1;
+	} else if (strcmp(op, "lazy") == 0 || strcmp(op, "forward") == 0) {
+		json::LoadOptions options;
+		options.lazy = true;
+		options.forward_only = strcmp(op, "forward") == 0;
+		val.load(is, options);
+		size_t count = 0;
+		bool end = false;
+		while (1) {
+			json::Value elem = val.load_next(&end);
+			if (end)
+				break;
+			count++;
+		}
+		return count;
+	} else if (strcmp(op, "prefetch") == 0) {
+		/* forward iteration with parsing on a background thread */
+		json::LoadOptions options;
+		options.lazy = true;
+		options.forward_only = true;
+		val.load(is, options);
+		json::Prefetcher elements(val);
+		size_t count = 0;
+		for (json::Prefetcher::iterator i = elements.begin();
+		     i != elements.end(); ++i)
+			count++;
+		return count;
+	} else if (strcmp(op, "shred") == 0) {
+		/* records in to columns, without loading the elements */
+		val.load(is, true);
+		json::Table table;
+		table.add_column("id", json::COLUMN_INT64);
+		table.add_column("text", json::COLUMN_STRING);
+		table.add_column("retweet_count", json::COLUMN_INT64);
+		table.shred(val);
+		return table.rows();
+	} else if (strcmp(op, "load_schema") == 0 ||
+		   strcmp(op, "validate") == 0) {
+		/* checking records while loading, or without loading */
+		std::istringstream parser(
+			"{\"type\": \"array\", \"items\": {\"type\": \"object\","
+			" \"required\": [\"id\", \"text\"], \"properties\": {"
+			"  \"id\": {\"type\": \"integer\", \"minimum\": 0},"
+			"  \"text\": {\"type\": \"string\"},"
+			"  \"retweet_count\": {\"type\": \"integer\"}}}}");
+		json::Value def;
+		def.load_all(parser);
+		json::Schema schema(def);
+		if (strcmp(op, "validate") == 0) {
+			if (!schema.validate(is)) {
+				throw std::runtime_error("Invalid records");
+			}
+		} else {
+			json::LoadOptions options;
+			options.schema = &schema;
+			val.load(is, options);
+		}
+		return 1;
+	} else if (strncmp(op, "interleave", 10) == 0) {
+		/*
+		 * Iterates four cursors over the same array alternately,
+		 * like a document with several lazy arrays would be.
+		 */
+		json::LoadOptions options;
+		options.lazy = true;
+		if (strcmp(op, "interleave_seek") == 0)
+			options.read_ahead = 0;
+		val.load(is, options);
+		std::vector<json::Value> cursors(4, val);
+		size_t count = 0;
+		bool end = false;
+		while (!end) {
+			for (size_t i = 0; i < cursors.size(); ++i) {
+				json::Value elem = cursors[i].load_next(&end);
+				if (!end)
+					count++;
+			}
+		}
+		return count;
+	}
+	abort();
+}
+
+/*
+ * Measures an operation in a child process, so that peak RSS only
+ * accounts for the operation. Prints one JSON record on stdout.
+ */
+static void measure(const Corpus &c, const char *op)
+{
+	std::string path = corpus_path(c);
+	struct stat st;
+	stat(path.c_str(), &st);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid > 0) {
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "%s/%s failed\n", c.name, op);
+			exit(1);
+		}
+		return;
+	}
+
+	json::Value doc;
+	size_t bytes = st.st_size;
+	if (strncmp(op, "interleave", 10) == 0) {
+		bytes *= 4;
+	}
+	if (strncmp(op, "write", 5) == 0 || strncmp(op, "lookup", 6) == 0) {
+		/* write_raw writes numbers that were loaded as text */
+		json::LoadOptions options;
+		options.raw_numbers = strcmp(op, "write_raw") == 0;
+		std::ifstream is(path.c_str());
+		doc.load(is, options);
+	}
+	if (strncmp(op, "write", 5) == 0) {
+		NullBuf buf;
+		std::ostream os(&buf);
+		doc.write(os);
+		bytes = buf.count;
+	}
+
+	/* first round counts the allocations */
+	size_t allocs_before = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED);
+	size_t bytes_before = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+	double start = now();
+	size_t docs = run_op(op, path, doc);
+	double elapsed = now() - start;
+	size_t allocs = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED) -
+		allocs_before;
+	size_t allocated = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) -
+		bytes_before;
+	size_t rounds = 1;
+	while (elapsed < min_time) {
+		docs += run_op(op, path, doc);
+		rounds++;
+		elapsed = now() - start;
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	json::Value res(json::JSON_OBJECT);
+	res.set("corpus", c.name);
+	res.set("op", op);
+	res.set("bytes", double(bytes));
+	res.set("rounds", int(rounds));
+	res.set("mb_per_s", bytes * rounds / elapsed / (1 << 20));
+	res.set("docs_per_s", docs / elapsed);
+	res.set("allocs", double(allocs));
+	res.set("alloc_bytes", double(allocated));
+	res.set("peak_rss_kb", double(usage.ru_maxrss));
+	std::cout.precision(12);
+	res.write(std::cout);
+	std::cout << std::endl;
+
+	fprintf(stderr, "%-8s %-15s %9.1f MB/s %12.1f docs/s %10zu allocs %8ld kB\n",
+		c.name, op, bytes * rounds / elapsed / (1 << 20),
+		docs / elapsed, allocs, usage.ru_maxrss);
+	exit(0);
+}
+
+static json::Value load_results(const char *fname)
+{
+	std::ifstream is(fname);
+	if (!is) {
+		fprintf(stderr, "Can not open %s\n", fname);
+		exit(1);
+	}
+	json::Value results(json::JSON_OBJECT);
+	std::string line;
+	while (std::getline(is, line)) {
+		if (line.empty())
+			continue;
+		std::istringstream parser(line);
+		json::Value val;
+		val.load_all(parser);
+		results.set(val.get("corpus").as_string() + "/" +
+			    val.get("op").as_string(), val);
+	}
+	return results;
+}
+
+/*
+ * Compares two result files. Returns non-zero if throughput drops or
+ * allocations grow more than the given threshold.
+ */
+static int compare(const char *base_fname, const char *new_fname,
+		   double threshold)
+{
+	json::Value base = load_results(base_fname);
+	json::Value cur = load_results(new_fname);
+	int regressions = 0;
+	FOR_EACH_CONST(json::object_map_t, i, cur.as_object()) {
+		const json::Value &old = base.get(i->first);
+		if (old.type() == json::JSON_NULL) {
+			printf("%-20s new\n", i->first.c_str());
+			continue;
+		}
+		double speed = i->second.get("mb_per_s").as_double() /
+			old.get("mb_per_s").as_double();
+		double allocs = (i->second.get("allocs").as_double() + 1) /
+			(old.get("allocs").as_double() + 1);
+		double rss = i->second.get("peak_rss_kb").as_double() /
+			old.get("peak_rss_kb").as_double();
+		bool bad = speed < 1 - threshold || allocs > 1 + threshold ||
+			rss > 1 + threshold;
+		printf("%-20s speed %6.2fx  allocs %6.2fx  rss %6.2fx%s\n",
+			i->first.c_str(), speed, allocs, rss,
+			bad ? "  REGRESSION" : "");
+		if (bad)
+			regressions++;
+	}
+	return regressions ? 1 : 0;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [options]\n"
+	       "       %s -c BASE NEW\n\n"
+	       "  -d DIR     corpus directory (default bench-data)\n"
+	       "  -s MB      size of each corpus file (default 16)\n"
+	       "  -p MB      size of the pretty-printed file, 0 skips it (default 0)\n"
+	       "  -t SEC     minimum time per measurement (default 1.0)\n"
+	       "  -o NAME    only run the given corpus\n"
+	       "  -c BASE NEW  compare two result files\n"
+	       "  -r RATIO   regression threshold for -c (default 0.1)\n\n"
+	       "Results are written to stdout as one JSON object per line.\n",
+	       argv0, argv0);
+}
+
+int main(int argc, char **argv)
+try {
+	const char *base = NULL;
+	double threshold = 0.1;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:s:p:t:o:c:r:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			data_dir = optarg;
+			break;
+		case 's':
+			corpus_mb = atoi(optarg);
+			break;
+		case 'p':
+			huge_mb = atoi(optarg);
+			break;
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'o':
+			only = optarg;
+			break;
+		case 'c':
+			base = optarg;
+			break;
+		case 'r':
+			threshold = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (base != NULL) {
+		if (optind >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		return compare(base, argv[optind], threshold);
+	}
+
+	mkdir(data_dir, 0755);
+	for (size_t i = 0; i < NUM_CORPORA; ++i) {
+		const Corpus &c = corpora[i];
+		if (only != NULL && strcmp(only, c.name) != 0)
+			continue;
+		if (c.huge) {
+			/* too large to be loaded in to memory */
+			if (huge_mb > 0) {
+				measure(c, "lazy");
+				measure(c, "forward");
+				measure(c, "prefetch");
+				measure(c, "minify");
+			}
+			continue;
+		}
+		measure(c, "load");
+		measure(c, "load_all");
+		measure(c, "load_strict");
+		measure(c, "load_noshape");
+		measure(c, "lazy");
+		measure(c, "forward");
+		measure(c, "prefetch");
+		measure(c, "interleave");
+		measure(c, "interleave_seek");
+		measure(c, "load_raw");
+		measure(c, "load_shared");
+		measure(c, "write");
+		measure(c, "write_raw");
+		measure(c, "write_cached");
+		measure(c, "copy");
+		measure(c, "minify");
+		measure(c, "pretty");
+		if (strcmp(c.name, "records") == 0) {
+			measure(c, "shred");
+			measure(c, "load_schema");
+			measure(c, "validate");
+			measure(c, "lookup");
+			measure(c, "lookup_key");
+		}
+	}
+	return 0;
+
+} catch (const std::runtime_error &e) {
+	fprintf(stderr, "Error: %s\n", e.what());
+	return 1;
+}
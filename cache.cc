@@ -0,0 +1,389 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Cache of loaded files shared by threads.
+ */
+#include "internal.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <list>
+#include <deque>
+
+namespace json {
+
+namespace {
+
+/* The version of a file */
+struct FileIdentity {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+
+	FileIdentity() :
+		dev(0), ino(0), size(0), mtime_sec(0), mtime_nsec(0)
+	{}
+	FileIdentity(const struct stat &st) :
+		dev(st.st_dev), ino(st.st_ino), size(st.st_size),
+		mtime_sec(st.st_mtim.tv_sec), mtime_nsec(st.st_mtim.tv_nsec)
+	{}
+
+	bool operator == (const FileIdentity &other) const
+	{
+		return dev == other.dev && ino == other.ino &&
+			size == other.size && mtime_sec == other.mtime_sec &&
+			mtime_nsec == other.mtime_nsec;
+	}
+	bool operator != (const FileIdentity &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+class Lock {
+public:
+	Lock(pthread_mutex_t *mutex) :
+		m_mutex(mutex)
+	{
+		pthread_mutex_lock(m_mutex);
+	}
+	~Lock()
+	{
+		pthread_mutex_unlock(m_mutex);
+	}
+
+private:
+	pthread_mutex_t *m_mutex;
+};
+
+FileIdentity stat_file(const std::string &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0) {
+		throw std::runtime_error(strf("%s: %s", path.c_str(),
+					      strerror(errno)));
+	}
+	return FileIdentity(st);
+}
+
+/* Returns the version that was loaded */
+FileIdentity load_file(const std::string &path, const LoadOptions &options,
+		       Value &val)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(strf("%s: %s", path.c_str(),
+					      strerror(errno)));
+	}
+	struct stat st;
+	try {
+		if (fstat(fd, &st) < 0) {
+			throw std::runtime_error(strf("%s: %s", path.c_str(),
+						      strerror(errno)));
+		}
+		FdSource source(fd);
+		val.load_all(source, options);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return FileIdentity(st);
+}
+
+}
+
+struct CachedDocument {
+	std::string path;
+	uint64_t id;		/* tells apart documents of the same path */
+	FileIdentity version;
+	Value value;
+	size_t memory;
+	bool loading;		/* the first load is not done */
+	bool reloading;		/* queued or being loaded again */
+	/* a changed version that failed to load, and is not retried */
+	bool failed;
+	FileIdentity failed_version;
+	FileIdentity wanted;	/* seen by the get() that queued the reload */
+
+	CachedDocument() :
+		id(0), memory(0), loading(true), reloading(false), failed(false)
+	{}
+};
+
+typedef std::list<CachedDocument>::iterator document_iter;
+
+struct DocumentCacheState {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* signaled when a load is done */
+	pthread_t thread;
+	bool running;
+
+	LoadOptions options;
+	size_t max_memory;
+	size_t memory;
+
+	/* the most recently used first */
+	std::list<CachedDocument> documents;
+	std::map<std::string, document_iter> index;
+
+	/* the path and the id of the document each reload is for */
+	std::deque<std::pair<std::string, uint64_t> > reloads;
+	size_t busy;			/* reloads taken by the thread */
+	uint64_t next_id;
+};
+
+namespace {
+
+/*
+ * Drops the least recently used documents that don't fit in the budget.
+ * They are moved to 'dropped', so they can be freed without the lock.
+ */
+void evict(DocumentCacheState *state, std::vector<Value> &dropped)
+{
+	document_iter i = state->documents.end();
+	while (state->memory > state->max_memory &&
+	       i != state->documents.begin()) {
+		--i;
+		if (i->loading)
+			continue;
+		state->memory -= i->memory;
+		dropped.push_back(Value());
+		dropped.back().swap(i->value);
+		state->index.erase(i->path);
+		i = state->documents.erase(i);
+	}
+}
+
+void *reload_thread(void *arg)
+{
+	DocumentCacheState *state = (DocumentCacheState *) arg;
+	Lock lock(&state->mutex);
+	while (1) {
+		while (state->running && state->reloads.empty())
+			pthread_cond_wait(&state->cond, &state->mutex);
+		if (!state->running)
+			break;
+
+		std::string path = state->reloads.front().first;
+		uint64_t id = state->reloads.front().second;
+		state->reloads.pop_front();
+		state->busy++;
+
+		/* load the new version without holding the lock */
+		pthread_mutex_unlock(&state->mutex);
+		Value val;
+		FileIdentity version;
+		size_t memory = 0;
+		bool ok = true;
+		try {
+			version = load_file(path, state->options, val);
+			memory = val.memory_usage();
+		} catch (const std::exception &e) {
+			ok = false;
+		}
+		pthread_mutex_lock(&state->mutex);
+
+		std::vector<Value> dropped;
+		std::map<std::string, document_iter>::iterator found =
+			state->index.find(path);
+		/*
+		 * The document may have been dropped meanwhile, and get()
+		 * may have added the path again
+		 */
+		if (found != state->index.end() && found->second->id == id) {
+			document_iter doc = found->second;
+			doc->reloading = false;
+			if (ok) {
+				/* readers keep the old version they have */
+				doc->value.swap(val);
+				doc->version = version;
+				doc->failed = false;
+				state->memory += memory - doc->memory;
+				doc->memory = memory;
+				evict(state, dropped);
+			} else {
+				doc->failed = true;
+				doc->failed_version = doc->wanted;
+			}
+		}
+		state->busy--;
+		pthread_cond_broadcast(&state->cond);
+
+		pthread_mutex_unlock(&state->mutex);
+		val = Value();
+		dropped.clear();
+		pthread_mutex_lock(&state->mutex);
+	}
+	return NULL;
+}
+
+}
+
+DocumentCache::DocumentCache(size_t max_memory, const LoadOptions &options) :
+	m_state(new DocumentCacheState)
+{
+	pthread_mutex_init(&m_state->mutex, NULL);
+	pthread_cond_init(&m_state->cond, NULL);
+	m_state->running = true;
+	m_state->options = options;
+	m_state->options.lazy = false;
+	m_state->options.stats = NULL;
+	m_state->max_memory = max_memory;
+	m_state->memory = 0;
+	m_state->busy = 0;
+	m_state->next_id = 0;
+	if (pthread_create(&m_state->thread, NULL, reload_thread, m_state)) {
+		pthread_cond_destroy(&m_state->cond);
+		pthread_mutex_destroy(&m_state->mutex);
+		delete m_state;
+		throw std::runtime_error("Unable to create a thread");
+	}
+}
+
+DocumentCache::~DocumentCache()
+{
+	{
+		Lock lock(&m_state->mutex);
+		m_state->running = false;
+		pthread_cond_broadcast(&m_state->cond);
+	}
+	pthread_join(m_state->thread, NULL);
+	pthread_cond_destroy(&m_state->cond);
+	pthread_mutex_destroy(&m_state->mutex);
+	delete m_state;
+}
+
+DocumentCache &DocumentCache::global()
+{
+	/* the compiler makes the initialization thread-safe */
+	static DocumentCache cache;
+	return cache;
+}
+
+Document DocumentCache::get(const std::string &path)
+{
+	FileIdentity version = stat_file(path);
+	Document result;
+	std::vector<Value> dropped;
+	Lock lock(&m_state->mutex);
+	std::map<std::string, document_iter>::iterator found;
+	while (1) {
+		found = m_state->index.find(path);
+		if (found == m_state->index.end() || !found->second->loading)
+			break;
+		/* another thread is loading it */
+		pthread_cond_wait(&m_state->cond, &m_state->mutex);
+	}
+
+	if (found != m_state->index.end()) {
+		document_iter doc = found->second;
+		m_state->documents.splice(m_state->documents.begin(),
+					  m_state->documents, doc);
+		if (doc->version != version && !doc->reloading &&
+		    !(doc->failed && doc->failed_version == version)) {
+			doc->reloading = true;
+			doc->wanted = version;
+			m_state->reloads.push_back(std::make_pair(path,
+								  doc->id));
+			pthread_cond_broadcast(&m_state->cond);
+		}
+		result.m_value.share(doc->value);
+		return result;
+	}
+
+	/* other threads wait for the first load instead of loading too */
+	m_state->documents.push_front(CachedDocument());
+	document_iter doc = m_state->documents.begin();
+	doc->path = path;
+	doc->id = m_state->next_id++;
+	m_state->index[path] = doc;
+
+	pthread_mutex_unlock(&m_state->mutex);
+	Value val;
+	size_t memory = 0;
+	try {
+		version = load_file(path, m_state->options, val);
+		memory = val.memory_usage();
+	} catch (...) {
+		pthread_mutex_lock(&m_state->mutex);
+		m_state->index.erase(path);
+		m_state->documents.erase(doc);
+		pthread_cond_broadcast(&m_state->cond);
+		throw;
+	}
+	pthread_mutex_lock(&m_state->mutex);
+
+	doc->value.swap(val);
+	doc->version = version;
+	doc->memory = memory;
+	doc->loading = false;
+	m_state->memory += memory;
+	result.m_value.share(doc->value);
+	pthread_cond_broadcast(&m_state->cond);
+	evict(m_state, dropped);
+	return result;
+}
+
+void DocumentCache::remove(const std::string &path)
+{
+	Value dropped;
+	Lock lock(&m_state->mutex);
+	std::map<std::string, document_iter>::iterator found =
+		m_state->index.find(path);
+	if (found == m_state->index.end() || found->second->loading)
+		return;
+	document_iter doc = found->second;
+	m_state->memory -= doc->memory;
+	dropped.swap(doc->value);
+	m_state->documents.erase(doc);
+	m_state->index.erase(found);
+}
+
+void DocumentCache::clear()
+{
+	std::vector<Value> dropped;
+	Lock lock(&m_state->mutex);
+	document_iter i = m_state->documents.begin();
+	while (i != m_state->documents.end()) {
+		if (i->loading) {
+			++i;
+			continue;
+		}
+		m_state->memory -= i->memory;
+		dropped.push_back(Value());
+		dropped.back().swap(i->value);
+		m_state->index.erase(i->path);
+		i = m_state->documents.erase(i);
+	}
+}
+
+void DocumentCache::flush()
+{
+	Lock lock(&m_state->mutex);
+	while (!m_state->reloads.empty() || m_state->busy > 0)
+		pthread_cond_wait(&m_state->cond, &m_state->mutex);
+}
+
+size_t DocumentCache::size() const
+{
+	Lock lock(&m_state->mutex);
+	return m_state->documents.size();
+}
+
+size_t DocumentCache::memory() const
+{
+	Lock lock(&m_state->mutex);
+	return m_state->memory;
+}
+
+}
@@ -0,0 +1,730 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Reading and writing gzip and zstd compressed streams.
+ */
+#include "internal.h"
+#include <pthread.h>
+#include <string.h>
+#ifndef CPPJSON_NO_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CPPJSON_ZSTD
+#include <zstd.h>
+#endif
+
+namespace json {
+
+namespace {
+
+const size_t INPUT_SIZE = 64 * 1024;
+const size_t OUTPUT_SIZE = 64 * 1024;
+
+/* Decompresses one format */
+class Inflater {
+public:
+	virtual ~Inflater() {}
+
+	/* Starts over from the beginning of the input */
+	virtual void reset() = 0;
+
+	/*
+	 * Decompresses from *in to 'out', and advances *in over the consumed
+	 * input. Returns the number of bytes written. 'done' is set when the
+	 * input ends at the end of a stream.
+	 */
+	virtual size_t run(const char **in, const char *in_end, char *out,
+			   size_t len, bool *done) = 0;
+};
+
+/* Compresses in to one format */
+class Deflater {
+public:
+	virtual ~Deflater() {}
+
+	/*
+	 * Compresses from *in to 'out' like Inflater::run(). When 'end' is
+	 * set, 'done' is set after all of the output has been returned.
+	 */
+	virtual size_t run(const char **in, const char *in_end, char *out,
+			   size_t len, bool end, bool *done) = 0;
+};
+
+#ifndef CPPJSON_NO_ZLIB
+
+class GzipInflater: public Inflater {
+public:
+	GzipInflater() :
+		m_end(false)
+	{
+		memset(&m_z, 0, sizeof m_z);
+		/* detects gzip and zlib headers */
+		if (inflateInit2(&m_z, 32 + MAX_WBITS) != Z_OK) {
+			throw std::runtime_error("inflateInit2 failed");
+		}
+	}
+	~GzipInflater()
+	{
+		inflateEnd(&m_z);
+	}
+
+	void reset()
+	{
+		inflateReset(&m_z);
+		m_end = false;
+	}
+
+	size_t run(const char **in, const char *in_end, char *out,
+		   size_t len, bool *done)
+	{
+		if (m_end) {
+			*done = true;
+			if (*in == in_end)
+				return 0;
+			/* concatenated streams, as written by pigz or bgzip */
+			inflateReset(&m_z);
+			m_end = false;
+		}
+		m_z.next_in = (Bytef *) *in;
+		m_z.avail_in = in_end - *in;
+		m_z.next_out = (Bytef *) out;
+		m_z.avail_out = len;
+		int ret = inflate(&m_z, Z_NO_FLUSH);
+		*in = (const char *) m_z.next_in;
+		if (ret == Z_STREAM_END) {
+			m_end = true;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			throw decode_error(strf("Corrupt gzip input: %s",
+						m_z.msg ? m_z.msg : "unknown error"));
+		}
+		*done = m_end;
+		return len - m_z.avail_out;
+	}
+
+private:
+	z_stream m_z;
+	bool m_end;
+};
+
+class GzipDeflater: public Deflater {
+public:
+	GzipDeflater(int level)
+	{
+		memset(&m_z, 0, sizeof m_z);
+		if (deflateInit2(&m_z, level ? level : Z_DEFAULT_COMPRESSION,
+				 Z_DEFLATED, 16 + MAX_WBITS, 8,
+				 Z_DEFAULT_STRATEGY) != Z_OK) {
+			throw std::invalid_argument(strf("Invalid gzip level %d",
+							 level));
+		}
+	}
+	~GzipDeflater()
+	{
+		deflateEnd(&m_z);
+	}
+
+	size_t run(const char **in, const char *in_end, char *out,
+		   size_t len, bool end, bool *done)
+	{
+		m_z.next_in = (Bytef *) *in;
+		m_z.avail_in = in_end - *in;
+		m_z.next_out = (Bytef *) out;
+		m_z.avail_out = len;
+		int ret = deflate(&m_z, end ? Z_FINISH : Z_NO_FLUSH);
+		*in = (const char *) m_z.next_in;
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			throw std::runtime_error("deflate failed");
+		}
+		*done = ret == Z_STREAM_END;
+		return len - m_z.avail_out;
+	}
+
+private:
+	z_stream m_z;
+};
+
+#endif
+
+#ifdef CPPJSON_ZSTD
+
+class ZstdInflater: public Inflater {
+public:
+	ZstdInflater() :
+		m_ctx(ZSTD_createDCtx()), m_end(false)
+	{
+		if (m_ctx == NULL) {
+			throw std::bad_alloc();
+		}
+	}
+	~ZstdInflater()
+	{
+		ZSTD_freeDCtx(m_ctx);
+	}
+
+	void reset()
+	{
+		ZSTD_DCtx_reset(m_ctx, ZSTD_reset_session_only);
+		m_end = false;
+	}
+
+	size_t run(const char **in, const char *in_end, char *out,
+		   size_t len, bool *done)
+	{
+		/* without input, a new frame would be expected */
+		if (m_end && *in == in_end) {
+			*done = true;
+			return 0;
+		}
+		ZSTD_inBuffer input = {*in, size_t(in_end - *in), 0};
+		ZSTD_outBuffer output = {out, len, 0};
+		/* continues with the next frame after one ends */
+		size_t ret = ZSTD_decompressStream(m_ctx, &output, &input);
+		if (ZSTD_isError(ret)) {
+			throw decode_error(strf("Corrupt zstd input: %s",
+						ZSTD_getErrorName(ret)));
+		}
+		*in += input.pos;
+		m_end = ret == 0;
+		*done = m_end;
+		return output.pos;
+	}
+
+private:
+	ZSTD_DCtx *m_ctx;
+	bool m_end;
+};
+
+class ZstdDeflater: public Deflater {
+public:
+	ZstdDeflater(int level) :
+		m_ctx(ZSTD_createCCtx())
+	{
+		if (m_ctx == NULL) {
+			throw std::bad_alloc();
+		}
+		if (level != 0 &&
+		    ZSTD_isError(ZSTD_CCtx_setParameter(m_ctx,
+				ZSTD_c_compressionLevel, level))) {
+			ZSTD_freeCCtx(m_ctx);
+			throw std::invalid_argument(strf("Invalid zstd level %d",
+							 level));
+		}
+	}
+	~ZstdDeflater()
+	{
+		ZSTD_freeCCtx(m_ctx);
+	}
+
+	size_t run(const char **in, const char *in_end, char *out,
+		   size_t len, bool end, bool *done)
+	{
+		ZSTD_inBuffer input = {*in, size_t(in_end - *in), 0};
+		ZSTD_outBuffer output = {out, len, 0};
+		size_t ret = ZSTD_compressStream2(m_ctx, &output, &input,
+					end ? ZSTD_e_end : ZSTD_e_continue);
+		if (ZSTD_isError(ret)) {
+			throw std::runtime_error(strf("ZSTD_compressStream2: %s",
+						      ZSTD_getErrorName(ret)));
+		}
+		*in += input.pos;
+		*done = end && ret == 0;
+		return output.pos;
+	}
+
+private:
+	ZSTD_CCtx *m_ctx;
+};
+
+#endif
+
+Inflater *new_inflater(Compression type)
+{
+	switch (type) {
+	case COMPRESS_GZIP:
+#ifndef CPPJSON_NO_ZLIB
+		return new GzipInflater;
+#else
+		break;
+#endif
+	case COMPRESS_ZSTD:
+#ifdef CPPJSON_ZSTD
+		return new ZstdInflater;
+#else
+		break;
+#endif
+	}
+	throw std::invalid_argument("Compression is not supported by this build");
+}
+
+Deflater *new_deflater(Compression type, int level)
+{
+	(void) level;
+	switch (type) {
+	case COMPRESS_GZIP:
+#ifndef CPPJSON_NO_ZLIB
+		return new GzipDeflater(level);
+#else
+		break;
+#endif
+	case COMPRESS_ZSTD:
+#ifdef CPPJSON_ZSTD
+		return new ZstdDeflater(level);
+#else
+		break;
+#endif
+	}
+	throw std::invalid_argument("Compression is not supported by this build");
+}
+
+/* Reads the compressed input from a std::istream */
+class StreamSource: public Source {
+public:
+	StreamSource(std::streambuf *buf) :
+		m_buf(buf)
+	{}
+
+	size_t read(char *buf, size_t len)
+	{
+		std::streamsize got = m_buf->sgetn(buf, len);
+		return got > 0 ? got : 0;
+	}
+
+private:
+	std::streambuf *m_buf;
+};
+
+}
+
+/*
+ * The decompressed blocks are passed from the thread in a ring. A block
+ * is large, so the ring is simply protected by the mutex. The reader
+ * keeps the block at 'head' until it asks for the next one.
+ */
+struct DecompressState {
+	Inflater *inflater;
+	Source *input;
+	Source *own_input;		/* deleted with the state */
+	std::istream *stream;		/* NULL if the input can't rewind */
+	std::streamoff start;		/* of the input in 'stream' */
+
+	/* used only by the thread that decompresses */
+	std::vector<char> in_buf;
+	const char *in_pos;
+	const char *in_end;
+	bool in_eof;
+	bool at_end;			/* at the end of a compressed stream */
+
+	std::vector<std::vector<char> > ring;
+	std::vector<size_t> lengths;
+	size_t head;
+	size_t tail;
+	bool holding;			/* the reader has the block at 'head' */
+	bool finished;
+	bool stop;
+	std::streamoff offset;		/* of the reader's block */
+
+	/* an error from the thread, set before 'finished' */
+	enum { NO_ERROR, DECODE_ERROR, OTHER_ERROR } error;
+	std::string error_what;
+
+	bool threaded;
+	bool running;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	DecompressState() :
+		inflater(NULL), input(NULL), own_input(NULL), stream(NULL),
+		start(-1), threaded(false), running(false)
+	{
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&cond, NULL);
+	}
+	~DecompressState()
+	{
+		pthread_cond_destroy(&cond);
+		pthread_mutex_destroy(&mutex);
+		delete inflater;
+		delete own_input;
+	}
+
+	void clear()
+	{
+		in_pos = NULL;
+		in_end = NULL;
+		in_eof = false;
+		at_end = false;
+		head = 0;
+		tail = 0;
+		holding = false;
+		finished = false;
+		stop = false;
+		offset = 0;
+		error = NO_ERROR;
+	}
+};
+
+namespace {
+
+/* Decompresses the next block. Returns 0 at the end of the input */
+size_t fill_block(DecompressState *state, char *out, size_t size)
+{
+	size_t len = 0;
+	while (len < size) {
+		if (state->in_pos == state->in_end && !state->in_eof) {
+			size_t got = state->input->read(&state->in_buf[0],
+							state->in_buf.size());
+			state->in_pos = &state->in_buf[0];
+			state->in_end = state->in_pos + got;
+			state->in_eof = got == 0;
+		}
+		size_t got = state->inflater->run(&state->in_pos,
+						  state->in_end, out + len,
+						  size - len, &state->at_end);
+		len += got;
+		if (got == 0 && state->in_pos == state->in_end &&
+		    state->in_eof) {
+			if (!state->at_end) {
+				throw decode_error("Truncated compressed input");
+			}
+			break;
+		}
+	}
+	return len;
+}
+
+void *decompress_thread(void *arg)
+{
+	DecompressState *state = (DecompressState *) arg;
+	size_t size = state->ring.size();
+	try {
+		while (1) {
+			pthread_mutex_lock(&state->mutex);
+			while (state->tail - state->head == size &&
+			       !state->stop)
+				pthread_cond_wait(&state->cond, &state->mutex);
+			bool stop = state->stop;
+			size_t slot = state->tail % size;
+			pthread_mutex_unlock(&state->mutex);
+			if (stop)
+				break;
+
+			std::vector<char> &block = state->ring[slot];
+			size_t len = fill_block(state, &block[0], block.size());
+			if (len == 0)
+				break;
+			pthread_mutex_lock(&state->mutex);
+			state->lengths[slot] = len;
+			state->tail++;
+			pthread_cond_broadcast(&state->cond);
+			pthread_mutex_unlock(&state->mutex);
+		}
+	} catch (const decode_error &e) {
+		state->error = DecompressState::DECODE_ERROR;
+		state->error_what = e.what();
+	} catch (const std::exception &e) {
+		state->error = DecompressState::OTHER_ERROR;
+		state->error_what = e.what();
+	}
+	pthread_mutex_lock(&state->mutex);
+	state->finished = true;
+	pthread_cond_broadcast(&state->cond);
+	pthread_mutex_unlock(&state->mutex);
+	return NULL;
+}
+
+void start_thread(DecompressState *state)
+{
+	if (!state->threaded)
+		return;
+	if (pthread_create(&state->thread, NULL, decompress_thread, state)) {
+		throw std::runtime_error("Unable to create a thread");
+	}
+	state->running = true;
+}
+
+void stop_thread(DecompressState *state)
+{
+	if (!state->running)
+		return;
+	pthread_mutex_lock(&state->mutex);
+	state->stop = true;
+	pthread_cond_broadcast(&state->cond);
+	pthread_mutex_unlock(&state->mutex);
+	pthread_join(state->thread, NULL);
+	state->running = false;
+}
+
+}
+
+DecompressBuf::DecompressBuf(std::istream &input, Compression type,
+			     size_t blocks, size_t block_size) :
+	m_state(new DecompressState)
+{
+	try {
+		m_state->own_input = new StreamSource(input.rdbuf());
+		m_state->input = m_state->own_input;
+		m_state->start = stream_pos(input.rdbuf(), std::ios::in);
+		/* a pipe can't rewind */
+		if (m_state->start >= 0)
+			m_state->stream = &input;
+		init(type, blocks, block_size);
+	} catch (...) {
+		delete m_state;
+		throw;
+	}
+}
+
+DecompressBuf::DecompressBuf(Source &input, Compression type,
+			     size_t blocks, size_t block_size) :
+	m_state(new DecompressState)
+{
+	try {
+		m_state->input = &input;
+		init(type, blocks, block_size);
+	} catch (...) {
+		delete m_state;
+		throw;
+	}
+}
+
+void DecompressBuf::init(Compression type, size_t blocks,
+			 size_t block_size)
+{
+	if (block_size == 0) {
+		throw std::invalid_argument("Block size must not be zero");
+	}
+	m_state->inflater = new_inflater(type);
+	m_state->in_buf.resize(INPUT_SIZE);
+	m_state->ring.resize(blocks > 0 ? blocks : 1,
+			     std::vector<char>(block_size));
+	m_state->lengths.resize(m_state->ring.size());
+	m_state->clear();
+	m_state->threaded = blocks > 0;
+	start_thread(m_state);
+}
+
+DecompressBuf::~DecompressBuf()
+{
+	stop_thread(m_state);
+	delete m_state;
+}
+
+/* Moves to the next block, or to the end of the input */
+void DecompressBuf::next_block()
+{
+	DecompressState *state = m_state;
+	state->offset += egptr() - eback();
+	setg(NULL, NULL, NULL);
+
+	if (!state->threaded) {
+		char *block = &state->ring[0][0];
+		size_t len = fill_block(state, block, state->ring[0].size());
+		setg(block, block, block + len);
+		return;
+	}
+
+	pthread_mutex_lock(&state->mutex);
+	if (state->holding) {
+		state->head++;
+		state->holding = false;
+		pthread_cond_broadcast(&state->cond);
+	}
+	while (state->head == state->tail && !state->finished)
+		pthread_cond_wait(&state->cond, &state->mutex);
+	bool end = state->head == state->tail;
+	size_t slot = state->head % state->ring.size();
+	state->holding = !end;
+	pthread_mutex_unlock(&state->mutex);
+
+	if (end) {
+		/* everything is consumed */
+		switch (state->error) {
+		case DecompressState::NO_ERROR:
+			break;
+		case DecompressState::DECODE_ERROR:
+			throw decode_error(state->error_what);
+		case DecompressState::OTHER_ERROR:
+			throw std::runtime_error(state->error_what);
+		}
+		return;
+	}
+	char *block = &state->ring[slot][0];
+	setg(block, block, block + state->lengths[slot]);
+}
+
+DecompressBuf::int_type DecompressBuf::underflow()
+{
+	if (gptr() == egptr())
+		next_block();
+	if (gptr() == egptr())
+		return traits_type::eof();
+	return traits_type::to_int_type(*gptr());
+}
+
+DecompressBuf::pos_type DecompressBuf::seekoff(off_type off,
+					       std::ios::seekdir dir,
+					       std::ios::openmode mode)
+{
+	if (m_state->stream == NULL || !(mode & std::ios::in))
+		return pos_type(off_type(-1));
+	off_type pos = m_state->offset + (gptr() - eback());
+	if (dir == std::ios::cur) {
+		if (off == 0)
+			return pos;
+		pos += off;
+	} else if (dir == std::ios::beg) {
+		pos = off;
+	} else {
+		/* the size isn't known before everything is decompressed */
+		return pos_type(off_type(-1));
+	}
+	return seekpos(pos, mode);
+}
+
+DecompressBuf::pos_type DecompressBuf::seekpos(pos_type pos,
+					       std::ios::openmode mode)
+{
+	DecompressState *state = m_state;
+	off_type target = pos;
+	if (state->stream == NULL || !(mode & std::ios::in) || target < 0)
+		return pos_type(off_type(-1));
+
+	if (target < state->offset) {
+		/* decompress again from the beginning */
+		stop_thread(state);
+		setg(NULL, NULL, NULL);
+		state->stream->clear();
+		if (state->stream->rdbuf()->pubseekpos(state->start,
+						       std::ios::in) < 0)
+			return pos_type(off_type(-1));
+		state->inflater->reset();
+		state->clear();
+		start_thread(state);
+	}
+	while (target > state->offset + (egptr() - eback())) {
+		next_block();
+		if (gptr() == egptr()) {
+			/* past the end */
+			return pos_type(off_type(-1));
+		}
+	}
+	setg(eback(), eback() + (target - state->offset), egptr());
+	return pos;
+}
+
+struct CompressState {
+	std::ostream *output;
+	Deflater *deflater;
+	std::vector<char> in_buf;
+	std::vector<char> out_buf;
+	std::streamoff written;		/* bytes before the buffer */
+	bool finished;
+
+	CompressState() :
+		deflater(NULL)
+	{}
+	~CompressState()
+	{
+		delete deflater;
+	}
+};
+
+CompressBuf::CompressBuf(std::ostream &output, Compression type, int level) :
+	m_state(new CompressState)
+{
+	try {
+		m_state->output = &output;
+		m_state->deflater = new_deflater(type, level);
+		m_state->in_buf.resize(INPUT_SIZE);
+		m_state->out_buf.resize(OUTPUT_SIZE);
+		m_state->written = 0;
+		m_state->finished = false;
+	} catch (...) {
+		delete m_state;
+		throw;
+	}
+	char *p = &m_state->in_buf[0];
+	setp(p, p + m_state->in_buf.size());
+}
+
+CompressBuf::~CompressBuf()
+{
+	try {
+		finish();
+	} catch (...) {
+	}
+	delete m_state;
+}
+
+/* Compresses the buffered output and writes it out */
+void CompressBuf::compress(bool end)
+{
+	CompressState *state = m_state;
+	const char *in = pbase();
+	const char *in_end = pptr();
+	bool done = false;
+	while (in < in_end || (end && !done)) {
+		size_t len = state->deflater->run(&in, in_end,
+						  &state->out_buf[0],
+						  state->out_buf.size(),
+						  end, &done);
+		if (len > 0 && !state->output->write(&state->out_buf[0], len)) {
+			throw std::runtime_error("Unable to write compressed output");
+		}
+	}
+	state->written += pptr() - pbase();
+	char *p = &state->in_buf[0];
+	setp(p, p + state->in_buf.size());
+}
+
+void CompressBuf::finish()
+{
+	if (m_state->finished)
+		return;
+	m_state->finished = true;
+	compress(true);
+	/* nothing can be written after the end */
+	setp(NULL, NULL);
+	m_state->output->flush();
+}
+
+CompressBuf::int_type CompressBuf::overflow(int_type c)
+{
+	if (m_state->finished)
+		return traits_type::eof();
+	compress(false);
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+	return traits_type::not_eof(c);
+}
+
+int CompressBuf::sync()
+{
+	if (m_state->finished)
+		return 0;
+	try {
+		compress(false);
+	} catch (const std::exception &e) {
+		return -1;
+	}
+	return 0;
+}
+
+CompressBuf::pos_type CompressBuf::seekoff(off_type off,
+					   std::ios::seekdir dir,
+					   std::ios::openmode mode)
+{
+	/* only tells the position, in uncompressed bytes */
+	if (off != 0 || dir != std::ios::cur || !(mode & std::ios::out))
+		return pos_type(off_type(-1));
+	return m_state->written + (pptr() - pbase());
+}
+
+}
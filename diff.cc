@@ -0,0 +1,540 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Diffing values into JSON Patch (RFC 6902) and merge patches (RFC 7396),
+ * and applying them.
+ */
+#include "internal.h"
+#include <algorithm>
+
+namespace json {
+
+namespace {
+
+/* Arrays with more changed elements than this are compared by position */
+const size_t MAX_LCS_CELLS = 1 << 20;
+
+/* RFC 6901 escapes '~' and '/' in the tokens of a JSON Pointer */
+void append_token(std::string &path, const std::string &key)
+{
+	path += '/';
+	for (size_t i = 0; i < key.size(); ++i) {
+		if (key[i] == '~')
+			path += "~0";
+		else if (key[i] == '/')
+			path += "~1";
+		else
+			path += key[i];
+	}
+}
+
+std::vector<std::string> parse_pointer(const std::string &path)
+{
+	std::vector<std::string> tokens;
+	if (path.empty())
+		return tokens;
+	if (path[0] != '/')
+		throw patch_error(strf("Invalid JSON pointer: %s", path.c_str()));
+	for (size_t i = 0; i < path.size(); ++i) {
+		char c = path[i];
+		if (c == '/') {
+			tokens.push_back(std::string());
+		} else if (c == '~') {
+			c = i + 1 < path.size() ? path[++i] : 0;
+			if (c != '0' && c != '1') {
+				throw patch_error(strf("Invalid JSON pointer: %s",
+						       path.c_str()));
+			}
+			tokens.back() += c == '0' ? '~' : '/';
+		} else {
+			tokens.back() += c;
+		}
+	}
+	return tokens;
+}
+
+/* "-" is the end of the array, if 'append' */
+size_t array_index(const std::string &token, size_t size, bool append,
+		   const std::string &path)
+{
+	if (append && token == "-")
+		return size;
+	size_t index = 0;
+	bool valid = !token.empty() && (token[0] != '0' || token.size() == 1);
+	for (size_t i = 0; valid && i < token.size(); ++i) {
+		if (token[i] < '0' || token[i] > '9' || index > size) {
+			valid = false;
+			break;
+		}
+		index = index * 10 + (token[i] - '0');
+	}
+	if (!valid || index > size || (index == size && !append))
+		throw patch_error(strf("Path not found: %s", path.c_str()));
+	return index;
+}
+
+/* Returns the value at the first 'count' tokens */
+const Value &walk(const Value &doc, const std::vector<std::string> &tokens,
+		  size_t count, const std::string &path)
+{
+	const Value *val = &doc;
+	for (size_t i = 0; i < count; ++i) {
+		if (val->type() == JSON_OBJECT) {
+			val = val->find(tokens[i]);
+			if (val == NULL) {
+				throw patch_error(strf("Path not found: %s",
+						       path.c_str()));
+			}
+		} else if (val->type() == JSON_ARRAY) {
+			const std::vector<Value> &items = val->as_array();
+			size_t index = array_index(tokens[i], items.size(),
+						   false, path);
+			val = &items[index];
+		} else {
+			throw patch_error(strf("Path not found: %s",
+					       path.c_str()));
+		}
+	}
+	return *val;
+}
+
+std::string member_string(const Value &op, const char *key)
+{
+	const Value *val = op.find(key);
+	if (val == NULL || val->type() != JSON_STRING) {
+		throw patch_error(strf("Patch operation needs a string '%s'",
+				       key));
+	}
+	return val->as_string();
+}
+
+const Value &member_value(const Value &op)
+{
+	const Value *val = op.find("value");
+	if (val == NULL)
+		throw patch_error("Patch operation needs a 'value'");
+	return *val;
+}
+
+/* Hash of an object or an array, 0 for other values */
+size_t container_hash(const Value &val)
+{
+	if (val.type() != JSON_OBJECT && val.type() != JSON_ARRAY)
+		return 0;
+	return val.hash();
+}
+
+}
+
+/*
+ * Modifies a document in place for a patch. The containers along the path
+ * are modified, which copies them if they are shared and drops their kept
+ * hash and output, but they don't lend references to their items.
+ */
+struct Patcher {
+	static Value &walk(Value &doc, const std::vector<std::string> &tokens,
+			   size_t count, const std::string &path);
+	static void put(Value &doc, const std::vector<std::string> &tokens,
+			const std::string &path, Value &val, bool replace);
+	static void take(Value &doc, const std::vector<std::string> &tokens,
+			 const std::string &path, Value &val);
+};
+
+/* Returns the value at the first 'count' tokens for modification */
+Value &Patcher::walk(Value &doc, const std::vector<std::string> &tokens,
+		     size_t count, const std::string &path)
+{
+	Value *val = &doc;
+	for (size_t i = 0; i < count; ++i) {
+		if (val->m_type == JSON_OBJECT) {
+			object_map_t &items = val->modify_object().items;
+			object_map_t::iterator found = items.find(tokens[i]);
+			if (found == items.end()) {
+				throw patch_error(strf("Path not found: %s",
+						       path.c_str()));
+			}
+			val = &found->second;
+		} else if (val->m_type == JSON_ARRAY) {
+			std::vector<Value> &items = val->modify_array().items;
+			size_t index = array_index(tokens[i], items.size(),
+						   false, path);
+			val = &items[index];
+		} else {
+			throw patch_error(strf("Path not found: %s",
+					       path.c_str()));
+		}
+	}
+	return *val;
+}
+
+/* Moves 'val' to the path, leaving the value that was there in it */
+void Patcher::put(Value &doc, const std::vector<std::string> &tokens,
+		  const std::string &path, Value &val, bool replace)
+{
+	if (tokens.empty()) {
+		doc.swap(val);
+		return;
+	}
+	Value &parent = walk(doc, tokens, tokens.size() - 1, path);
+	const std::string &last = tokens.back();
+	if (parent.m_type == JSON_OBJECT) {
+		object_map_t &items = parent.modify_object().items;
+		if (replace) {
+			object_map_t::iterator i = items.find(last);
+			if (i == items.end()) {
+				throw patch_error(strf("Path not found: %s",
+						       path.c_str()));
+			}
+			i->second.swap(val);
+		} else {
+			items[last].swap(val);
+		}
+	} else if (parent.m_type == JSON_ARRAY) {
+		std::vector<Value> &items = parent.modify_array().items;
+		size_t index = array_index(last, items.size(), !replace, path);
+		if (replace)
+			items[index].swap(val);
+		else
+			items.insert(items.begin() + index, Value())->swap(val);
+	} else {
+		throw patch_error(strf("Path not found: %s", path.c_str()));
+	}
+}
+
+/* Removes the value at the path, and moves it to 'val' */
+void Patcher::take(Value &doc, const std::vector<std::string> &tokens,
+		   const std::string &path, Value &val)
+{
+	if (tokens.empty()) {
+		doc.swap(val);
+		return;
+	}
+	Value &parent = walk(doc, tokens, tokens.size() - 1, path);
+	const std::string &last = tokens.back();
+	if (parent.m_type == JSON_OBJECT) {
+		object_map_t &items = parent.modify_object().items;
+		object_map_t::iterator i = items.find(last);
+		if (i == items.end()) {
+			throw patch_error(strf("Path not found: %s",
+					       path.c_str()));
+		}
+		val.swap(i->second);
+		items.erase(i);
+	} else if (parent.m_type == JSON_ARRAY) {
+		std::vector<Value> &items = parent.modify_array().items;
+		size_t index = array_index(last, items.size(), false, path);
+		val.swap(items[index]);
+		items.erase(items.begin() + index);
+	} else {
+		throw patch_error(strf("Path not found: %s", path.c_str()));
+	}
+}
+
+/* Builds a JSON Patch into 'ops' */
+struct Differ {
+	std::vector<Value> &ops;
+	std::string path;
+
+	Differ(std::vector<Value> &o) :
+		ops(o)
+	{}
+
+	void add_op(const char *op, const Value *val);
+	void diff(const Value &a, const Value &b);
+	void diff_object(const Value &a, const Value &b);
+	void diff_array(const Value &a, const Value &b);
+	void replace_run(const std::vector<Value> &x, size_t x_begin,
+			 size_t x_end, const std::vector<Value> &y,
+			 size_t y_begin, size_t y_end, size_t &pos);
+
+	static bool same(const Value &a, const Value &b);
+	static Value merge_diff(const Value &a, const Value &b);
+};
+
+void Differ::add_op(const char *op, const Value *val)
+{
+	Value item(JSON_OBJECT);
+	object_map_t &fields = item.as_object();
+	fields["op"] = Value(op);
+	fields["path"] = Value(path);
+	if (val != NULL)
+		fields["value"].share(*val, true);
+	ops.push_back(Value());
+	ops.back().swap(item);
+}
+
+/*
+ * Shared containers are the same. Otherwise different hashes rule out
+ * the containers, and equal ones are confirmed, since hashes collide.
+ */
+bool Differ::same(const Value &a, const Value &b)
+{
+	if (a.m_type != b.m_type ||
+	    (a.m_type != JSON_OBJECT && a.m_type != JSON_ARRAY))
+		return a == b;
+	if (a.m_type == JSON_OBJECT ? a.m_value.object == b.m_value.object :
+	    a.m_value.array == b.m_value.array)
+		return true;
+	return a.hash() == b.hash() && a == b;
+}
+
+void Differ::diff(const Value &a, const Value &b)
+{
+	if (a.m_type == b.m_type &&
+	    (a.m_type == JSON_OBJECT || a.m_type == JSON_ARRAY)) {
+		if (same(a, b))
+			return;
+		if (a.m_type == JSON_OBJECT)
+			diff_object(a, b);
+		else
+			diff_array(a, b);
+	} else if (a != b) {
+		add_op("replace", &b);
+	}
+}
+
+/* The keys are in order, so both objects are walked together */
+void Differ::diff_object(const Value &a, const Value &b)
+{
+	const object_map_t &x = a.m_value.object->items;
+	const object_map_t &y = b.m_value.object->items;
+	object_map_t::key_compare less = x.key_comp();
+	object_map_t::const_iterator i = x.begin(), j = y.begin();
+	size_t len = path.size();
+	while (i != x.end() || j != y.end()) {
+		if (j == y.end() ||
+		    (i != x.end() && less(i->first, j->first))) {
+			append_token(path, i->first);
+			add_op("remove", NULL);
+			++i;
+		} else if (i == x.end() || less(j->first, i->first)) {
+			append_token(path, j->first);
+			add_op("add", &j->second);
+			++j;
+		} else {
+			append_token(path, i->first);
+			diff(i->second, j->second);
+			++i;
+			++j;
+		}
+		path.resize(len);
+	}
+}
+
+/*
+ * Turns x[x_begin, x_end) into y[y_begin, y_end) at index 'pos' of the
+ * array being patched. Elements are diffed pairwise, and the rest are
+ * removed or added.
+ */
+void Differ::replace_run(const std::vector<Value> &x, size_t x_begin,
+			 size_t x_end, const std::vector<Value> &y,
+			 size_t y_begin, size_t y_end, size_t &pos)
+{
+	size_t len = path.size();
+	size_t pairs = std::min(x_end - x_begin, y_end - y_begin);
+	for (size_t k = 0; k < pairs; ++k) {
+		path += strf("/%lu", (unsigned long) pos++);
+		diff(x[x_begin + k], y[y_begin + k]);
+		path.resize(len);
+	}
+	for (size_t k = pairs; k < x_end - x_begin; ++k) {
+		path += strf("/%lu", (unsigned long) pos);
+		add_op("remove", NULL);
+		path.resize(len);
+	}
+	for (size_t k = pairs; k < y_end - y_begin; ++k) {
+		path += strf("/%lu", (unsigned long) pos++);
+		add_op("add", &y[y_begin + k]);
+		path.resize(len);
+	}
+}
+
+void Differ::diff_array(const Value &a, const Value &b)
+{
+	const std::vector<Value> &x = a.m_value.array->items;
+	const std::vector<Value> &y = b.m_value.array->items;
+
+	/* skip the common head and tail */
+	size_t begin = 0;
+	while (begin < x.size() && begin < y.size() && same(x[begin], y[begin]))
+		begin++;
+	size_t x_end = x.size(), y_end = y.size();
+	while (x_end > begin && y_end > begin &&
+	       same(x[x_end - 1], y[y_end - 1])) {
+		x_end--;
+		y_end--;
+	}
+	size_t n = x_end - begin, m = y_end - begin;
+	size_t pos = begin;
+	if (n == 0 || m == 0 || n * m > MAX_LCS_CELLS) {
+		replace_run(x, begin, x_end, y, begin, y_end, pos);
+		return;
+	}
+
+	/* the hashes are looked up once here instead of for every pair */
+	std::vector<size_t> x_hashes(n), y_hashes(m);
+	for (size_t i = 0; i < n; ++i)
+		x_hashes[i] = container_hash(x[begin + i]);
+	for (size_t j = 0; j < m; ++j)
+		y_hashes[j] = container_hash(y[begin + j]);
+
+	/* lengths of the common subsequences of the suffixes */
+	size_t width = m + 1;
+	std::vector<uint32_t> lcs((n + 1) * width);
+	for (size_t i = n; i-- > 0;) {
+		for (size_t j = m; j-- > 0;) {
+			if (x_hashes[i] == y_hashes[j] &&
+			    same(x[begin + i], y[begin + j]))
+				lcs[i * width + j] = lcs[(i + 1) * width + j + 1] + 1;
+			else
+				lcs[i * width + j] = std::max(lcs[(i + 1) * width + j],
+							      lcs[i * width + j + 1]);
+		}
+	}
+
+	/* the elements between the common ones are changed */
+	size_t i = 0, j = 0, run_i = 0, run_j = 0;
+	while (i < n && j < m) {
+		if (x_hashes[i] == y_hashes[j] &&
+		    same(x[begin + i], y[begin + j])) {
+			replace_run(x, begin + run_i, begin + i,
+				    y, begin + run_j, begin + j, pos);
+			pos++;
+			run_i = ++i;
+			run_j = ++j;
+		} else if (lcs[(i + 1) * width + j] >= lcs[i * width + j + 1]) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+	replace_run(x, begin + run_i, x_end, y, begin + run_j, y_end, pos);
+}
+
+Value Differ::merge_diff(const Value &a, const Value &b)
+{
+	Value patch;
+	if (a.m_type != JSON_OBJECT || b.m_type != JSON_OBJECT) {
+		patch.share(b, true);
+		return patch;
+	}
+	Value changes(JSON_OBJECT);
+	object_map_t &fields = changes.m_value.object->items;
+	const object_map_t &x = a.m_value.object->items;
+	const object_map_t &y = b.m_value.object->items;
+	object_map_t::key_compare less = x.key_comp();
+	object_map_t::const_iterator i = x.begin(), j = y.begin();
+	while (i != x.end() || j != y.end()) {
+		if (j == y.end() ||
+		    (i != x.end() && less(i->first, j->first))) {
+			/* removed with null */
+			fields.insert(fields.end(),
+				      std::make_pair(i->first, Value()));
+			++i;
+		} else if (i == x.end() || less(j->first, i->first)) {
+			fields.insert(fields.end(),
+				std::make_pair(j->first, Value()))->second.share(
+					j->second, true);
+			++j;
+		} else {
+			if (!same(i->second, j->second)) {
+				Value field = merge_diff(i->second, j->second);
+				fields.insert(fields.end(),
+					std::make_pair(i->first, Value()))->second.swap(
+						field);
+			}
+			++i;
+			++j;
+		}
+	}
+	patch.swap(changes);
+	return patch;
+}
+
+Value diff(const Value &from, const Value &to)
+{
+	Value patch(JSON_ARRAY);
+	Differ differ(patch.as_array());
+	differ.diff(from, to);
+	return patch;
+}
+
+Value merge_diff(const Value &from, const Value &to)
+{
+	return Differ::merge_diff(from, to);
+}
+
+void Value::apply_patch(const Value &patch)
+{
+	if (patch.type() != JSON_ARRAY)
+		throw patch_error("JSON Patch must be an array");
+	const std::vector<Value> &ops = patch.as_array();
+	for (size_t i = 0; i < ops.size(); ++i) {
+		const Value &op = ops[i];
+		if (op.type() != JSON_OBJECT)
+			throw patch_error("Patch operation must be an object");
+		std::string name = member_string(op, "op");
+		std::string path = member_string(op, "path");
+		std::vector<std::string> tokens = parse_pointer(path);
+		Value val;
+		if (name == "add" || name == "replace") {
+			val.share(member_value(op), true);
+			Patcher::put(*this, tokens, path, val,
+				     name == "replace");
+		} else if (name == "remove") {
+			Patcher::take(*this, tokens, path, val);
+		} else if (name == "move") {
+			std::string from = member_string(op, "from");
+			if (path.size() > from.size() &&
+			    path.compare(0, from.size(), from) == 0 &&
+			    path[from.size()] == '/') {
+				throw patch_error(strf("Can't move %s into itself",
+						       from.c_str()));
+			}
+			Patcher::take(*this, parse_pointer(from), from, val);
+			Patcher::put(*this, tokens, path, val, false);
+		} else if (name == "copy") {
+			std::string from = member_string(op, "from");
+			std::vector<std::string> source = parse_pointer(from);
+			val.share(walk(*this, source, source.size(), from),
+				  true);
+			Patcher::put(*this, tokens, path, val, false);
+		} else if (name == "test") {
+			if (walk(*this, tokens, tokens.size(), path) !=
+			    member_value(op)) {
+				throw patch_error(strf("Test failed: %s",
+						       path.c_str()));
+			}
+		} else {
+			throw patch_error(strf("Unknown patch operation: %s",
+					       name.c_str()));
+		}
+	}
+}
+
+void Value::merge_patch(const Value &patch)
+{
+	if (patch.m_type != JSON_OBJECT) {
+		share(patch, true);
+		return;
+	}
+	if (m_type != JSON_OBJECT) {
+		Value obj(JSON_OBJECT);
+		swap(obj);
+	}
+	object_map_t &items = modify_object().items;
+	const object_map_t &changes = patch.m_value.object->items;
+	for (object_map_t::const_iterator i = changes.begin();
+	     i != changes.end(); ++i) {
+		if (i->second.m_type == JSON_NULL)
+			items.erase(i->first);
+		else
+			items[i->first].merge_patch(i->second);
+	}
+}
+
+}
@@ -0,0 +1,286 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Hashing values, and sharing identical objects and arrays.
+ */
+#include "internal.h"
+#include <string.h>
+
+namespace json {
+
+namespace {
+
+/* Finalizer of MurmurHash3 */
+uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t combine(uint64_t h, uint64_t x)
+{
+	return mix(h ^ (x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+/* FNV-1a */
+uint64_t hash_string(const std::string &str)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < str.size(); ++i) {
+		h ^= uint8_t(str[i]);
+		h *= 0x100000001b3ULL;
+	}
+	return mix(h);
+}
+
+/* Integers are compared to floating point numbers as doubles */
+uint64_t hash_number(double d)
+{
+	/* -0 is equal to 0 */
+	if (d == 0)
+		d = 0;
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof bits);
+	return mix(bits);
+}
+
+/* Several threads may hash the same value, and they store the same */
+template<class T>
+void keep_hash(Container<T> *container, size_t hash, uint64_t epoch)
+{
+	__atomic_store_n(&container->hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&container->hash_epoch, epoch, __ATOMIC_RELAXED);
+	__atomic_store_n(&container->has_hash, true, __ATOMIC_RELEASE);
+}
+
+}
+
+size_t Value::hash() const
+{
+	switch (m_type) {
+	case JSON_NULL:
+		return mix(JSON_NULL + 1);
+	case JSON_BOOLEAN:
+		return mix(m_value.boolean ? 2 : 3);
+	case JSON_STRING:
+		return hash_string(*m_value.string);
+	case JSON_INTEGER:
+		return hash_number(as_int64());
+	case JSON_FLOATING:
+		return hash_number(as_double());
+	case JSON_OBJECT:
+		{
+			size_t hash;
+			uint64_t epoch = OutputCache::epoch();
+			if (kept_hash(*m_value.object, &hash, epoch))
+				return hash;
+			const object_map_t &items = m_value.object->items;
+			uint64_t h = mix(JSON_OBJECT + 1);
+			for (object_map_t::const_iterator i = items.begin();
+			     i != items.end(); ++i) {
+				h = combine(h, hash_string(i->first));
+				h = combine(h, i->second.hash());
+			}
+			keep_hash(m_value.object, h, epoch);
+			return h;
+		}
+	case JSON_ARRAY:
+		{
+			size_t hash;
+			uint64_t epoch = OutputCache::epoch();
+			if (kept_hash(*m_value.array, &hash, epoch))
+				return hash;
+			const std::vector<Value> &items = m_value.array->items;
+			uint64_t h = mix(JSON_ARRAY + 1);
+			for (size_t i = 0; i < items.size(); ++i)
+				h = combine(h, items[i].hash());
+			keep_hash(m_value.array, h, epoch);
+			return h;
+		}
+	default:
+		throw type_error("Lazy arrays can't be hashed");
+	}
+}
+
+/*
+ * Copies the value, sharing its container. With 'copy_lent', a lent
+ * container is copied instead, since the references could modify it
+ * behind the other value. That's needed when the value is taken from a
+ * document of the caller.
+ */
+void Value::share(const Value &from, bool copy_lent)
+{
+	switch (from.m_type) {
+	case JSON_OBJECT:
+		if (copy_lent && from.m_value.object->lent) {
+			share_items(from, true);
+			return;
+		}
+		__atomic_add_fetch(&from.m_value.object->refs, 1,
+				   __ATOMIC_RELAXED);
+		break;
+	case JSON_ARRAY:
+		if (copy_lent && from.m_value.array->lent) {
+			share_items(from, true);
+			return;
+		}
+		__atomic_add_fetch(&from.m_value.array->refs, 1,
+				   __ATOMIC_RELAXED);
+		break;
+	default:
+		*this = from;
+		return;
+	}
+	destroy();
+	m_type = from.m_type;
+	m_flags = from.m_flags;
+	m_value = from.m_value;
+}
+
+/*
+ * Gives the value a container of its own before it's modified. The
+ * elements share their containers, and are copied when they are modified.
+ */
+void Value::unshare()
+{
+	share_items(*this);
+}
+
+/* Copies the container of an object or an array, sharing the elements */
+void Value::share_items(const Value &container, bool copy_lent)
+{
+	Value copy(container.m_type);
+	if (container.m_type == JSON_OBJECT) {
+		const object_map_t &from = container.m_value.object->items;
+		object_map_t &items = copy.m_value.object->items;
+		for (object_map_t::const_iterator i = from.begin();
+		     i != from.end(); ++i) {
+			object_map_t::iterator it = items.insert(items.end(),
+				std::make_pair(i->first, Value()));
+			it->second.share(i->second, copy_lent);
+		}
+	} else {
+		const std::vector<Value> &from = container.m_value.array->items;
+		std::vector<Value> &items = copy.m_value.array->items;
+		items.resize(from.size());
+		for (size_t i = 0; i < from.size(); ++i)
+			items[i].share(from[i], copy_lent);
+	}
+	swap(copy);
+}
+
+/*
+ * The elements have been shared already, so equal containers are the
+ * same, and other values must have the same type and representation.
+ * Equal values of other types, such as 1 and 1.0, are written out
+ * differently.
+ */
+bool ShareTable::same_element(const Value &a, const Value &b)
+{
+	if (a.m_type != b.m_type || a.m_flags != b.m_flags)
+		return false;
+	if (a.m_flags & Value::RAW_NUMBER)
+		return *a.m_value.string == *b.m_value.string;
+	switch (a.m_type) {
+	case JSON_OBJECT:
+		return a.m_value.object == b.m_value.object;
+	case JSON_ARRAY:
+		return a.m_value.array == b.m_value.array;
+	case JSON_INTEGER:
+		return a.m_value.integer == b.m_value.integer;
+	case JSON_FLOATING:
+		/* -0 is written differently */
+		return !memcmp(&a.m_value.floating, &b.m_value.floating,
+			       sizeof(double));
+	default:
+		return a == b;
+	}
+}
+
+bool ShareTable::same_container(const Value &a, const Value &b)
+{
+	if (a.m_type != b.m_type)
+		return false;
+	if (a.m_type == JSON_OBJECT) {
+		const object_map_t &x = a.m_value.object->items;
+		const object_map_t &y = b.m_value.object->items;
+		if (x.size() != y.size())
+			return false;
+		for (object_map_t::const_iterator i = x.begin(), j = y.begin();
+		     i != x.end(); ++i, ++j) {
+			if (i->first != j->first ||
+			    !same_element(i->second, j->second))
+				return false;
+		}
+	} else {
+		const std::vector<Value> &x = a.m_value.array->items;
+		const std::vector<Value> &y = b.m_value.array->items;
+		if (x.size() != y.size())
+			return false;
+		for (size_t i = 0; i < x.size(); ++i) {
+			if (!same_element(x[i], y[i]))
+				return false;
+		}
+	}
+	return true;
+}
+
+void ShareTable::grow()
+{
+	std::vector<size_t> old_hashes(std::max<size_t>(64, slots.size() * 2));
+	std::vector<Value> old_slots(old_hashes.size());
+	hashes.swap(old_hashes);
+	slots.swap(old_slots);
+	size_t mask = slots.size() - 1;
+	for (size_t i = 0; i < old_slots.size(); ++i) {
+		if (old_slots[i].m_type == JSON_NULL)
+			continue;
+		size_t j = old_hashes[i] & mask;
+		while (slots[j].m_type != JSON_NULL)
+			j = (j + 1) & mask;
+		hashes[j] = old_hashes[i];
+		slots[j].swap(old_slots[i]);
+	}
+}
+
+void ShareTable::intern(Value &val, Stats *stats)
+{
+	size_t hash;
+	try {
+		hash = val.hash();
+	} catch (const type_error &e) {
+		/* has a lazy array */
+		return;
+	}
+	/* at most half full */
+	if ((used + 1) * 2 > slots.size())
+		grow();
+	size_t mask = slots.size() - 1;
+	size_t i = hash & mask;
+	while (slots[i].m_type != JSON_NULL) {
+		if (hashes[i] == hash && same_container(slots[i], val)) {
+			val.share(slots[i]);
+#ifndef CPPJSON_NO_STATS
+			if (stats)
+				stats->shared++;
+#else
+			(void) stats;
+#endif
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+	hashes[i] = hash;
+	slots[i].share(val);
+	used++;
+}
+
+}
@@ -10,12 +10,22 @@
 
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
 #include <istream>
 #include <ostream>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdexcept>
 #include <assert.h>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+/* std::map can find keys of other types than std::string */
+#if __cplusplus >= 201402L
+#define CPPJSON_TRANSPARENT_KEYS
+#endif
 
 namespace json {
 
@@ -33,6 +43,22 @@ public:
 	{}
 };
 
+/* The input doesn't match the schema given in LoadOptions */
+class schema_error: public decode_error {
+public:
+	schema_error(const std::string &what) :
+		decode_error(what)
+	{}
+};
+
+/* A JSON Patch is malformed, or an operation of it can't be applied */
+class patch_error: public std::runtime_error {
+public:
+	patch_error(const std::string &what) :
+		std::runtime_error(what)
+	{}
+};
+
 /* Must use the same order as type_names[] */
 enum Type {
 	JSON_NULL,
@@ -45,10 +71,286 @@ enum Type {
 	JSON_LAZY_ARRAY,
 };
 
+#define JSON_NUM_TYPES (JSON_LAZY_ARRAY + 1)
+
 struct LazyArray;
+struct Decoder;
+struct SchemaNode;
+class Table;
+class Schema;
+class Source;
+
+/*
+ * Orders the keys of objects. With C++14 and later, keys can be looked up
+ * as C strings or string views without making a std::string of them.
+ */
+struct KeyLess {
+#ifdef CPPJSON_TRANSPARENT_KEYS
+	typedef void is_transparent;
+#endif
+	bool operator () (const std::string &a, const std::string &b) const
+	{
+		return a < b;
+	}
+#ifdef CPPJSON_TRANSPARENT_KEYS
+	bool operator () (const std::string &a, const char *b) const
+	{
+		return a.compare(b) < 0;
+	}
+	bool operator () (const char *a, const std::string &b) const
+	{
+		return b.compare(a) > 0;
+	}
+#endif
+#if __cplusplus >= 201703L
+	bool operator () (const std::string &a, std::string_view b) const
+	{
+		return std::string_view(a) < b;
+	}
+	bool operator () (std::string_view a, const std::string &b) const
+	{
+		return a < std::string_view(b);
+	}
+#endif
+};
+
+/*
+ * A key that is looked up from many objects, such as a field of records.
+ * The string is made once, and not for every lookup.
+ */
+class Key {
+public:
+	explicit Key(const char *name) :
+		m_name(name)
+	{}
+	explicit Key(const std::string &name) :
+		m_name(name)
+	{}
+
+	const std::string &name() const { return m_name; }
+
+private:
+	std::string m_name;
+};
 
 class Value;
-typedef std::map<std::string, Value> object_map_t;
+typedef std::map<std::string, Value, KeyLess> object_map_t;
+
+/*
+ * Output of a container kept by write(), see WriteOptions::cache, and
+ * its hash kept by Value::hash().
+ */
+struct OutputCache {
+	std::string *output;
+	int indent;
+	int depth;
+	size_t hash;
+	bool has_hash;
+	/*
+	 * References to the items have been handed out. They can modify the
+	 * items any time later without the container knowing, so the output
+	 * and the hash are only used while no value has been modified since
+	 * they were made.
+	 */
+	bool lent;
+	uint64_t output_epoch;
+	uint64_t hash_epoch;
+
+	OutputCache() :
+		output(NULL), has_hash(false), lent(false), output_epoch(0),
+		hash_epoch(0)
+	{}
+	~OutputCache()
+	{
+		delete output;
+	}
+
+	/*
+	 * Counts the modifications of all values: every value that is
+	 * constructed, assigned, swapped or destroyed, and every container
+	 * that is modified.
+	 */
+	static uint64_t modifications;
+	static void modified()
+	{
+		__atomic_add_fetch(&modifications, 1, __ATOMIC_RELAXED);
+	}
+	static uint64_t epoch()
+	{
+		return __atomic_load_n(&modifications, __ATOMIC_RELAXED);
+	}
+
+	/* Called when the container is modified */
+	void touch()
+	{
+		has_hash = false;
+		if (output) {
+			delete output;
+			output = NULL;
+		}
+	}
+
+private:
+	OutputCache(const OutputCache &);
+	void operator = (const OutputCache &);
+};
+
+/* Storage of an object or an array */
+template<class T>
+struct Container: public OutputCache {
+	T items;
+	/* values that share the container, see LoadOptions::share_subtrees */
+	int refs;
+
+	Container() :
+		refs(1)
+	{}
+	Container(const T &from) :
+		items(from), refs(1)
+	{}
+};
+
+typedef Container<object_map_t> ObjectContainer;
+typedef Container<std::vector<Value> > ArrayContainer;
+
+/*
+ * Statistics collected by load(), load_next() and write() when a Stats
+ * object is passed to them. The counters accumulate over calls, so the
+ * same object can be used for several documents. Building the library
+ * with CPPJSON_NO_STATS defined removes the accounting completely.
+ */
+struct Stats {
+	Stats();
+	void clear();
+
+	/* Returns the counters as a JSON object, for exporting */
+	Value to_json() const;
+
+	uint64_t bytes;		/* consumed or produced, if the stream can tell */
+	uint64_t nodes[JSON_NUM_TYPES];
+	uint64_t space_bytes;	/* white space and comments */
+	uint64_t string_bytes;	/* decoded string contents, keys included */
+	uint64_t escapes;
+	uint64_t number_bytes;
+	int max_depth;
+	uint64_t allocs;	/* estimated heap allocations */
+	uint64_t alloc_bytes;
+	uint64_t seeks;		/* issued by lazy arrays */
+	uint64_t cached_writes;	/* containers copied from the output cache */
+	/* object keys found in, or missing from the shape cache */
+	uint64_t shape_hits;
+	uint64_t shape_misses;
+	uint64_t shared;	/* containers replaced by an identical one */
+
+	/* Time spent in seconds */
+	double load_time;
+	double skip_time;	/* skipping over lazy arrays */
+	double load_next_time;
+	double write_time;
+};
+
+/*
+ * Heap memory held by values, from Value::memory_usage(). The sizes are
+ * what the containers request from the allocator, so the allocator's own
+ * overhead is not included. The counters accumulate like Stats.
+ */
+struct MemoryUsage {
+	MemoryUsage();
+	void clear();
+
+	/* Returns the counters as a JSON object, for exporting */
+	Value to_json() const;
+
+	uint64_t total;
+	/* by the type of the value that holds the memory, children excluded */
+	uint64_t types[JSON_NUM_TYPES];
+	uint64_t keys;		/* heap of object keys */
+	uint64_t string_slack;	/* unused capacity of strings and keys */
+	uint64_t array_slack;	/* unused capacity of arrays */
+	uint64_t map_nodes;	/* tree pointers of object members */
+	uint64_t output_cache;	/* kept by WriteOptions::cache */
+	/* total of each member, when the root is an object */
+	std::map<std::string, uint64_t> members;
+};
+
+/* Settings for write() */
+struct WriteOptions {
+	WriteOptions() :
+		indent(0), cache(false), stats(NULL)
+	{}
+
+	int indent;		/* pretty-print, 0 minifies */
+	/*
+	 * Containers keep their output, and following writes copy it as
+	 * is until the container is modified. Containers whose items have
+	 * been returned by a non-const accessor are encoded again after
+	 * any value is modified, see OutputCache::lent.
+	 */
+	bool cache;
+	Stats *stats;
+};
+
+/* Settings for load() */
+struct LoadOptions {
+	LoadOptions() :
+		lazy(false), forward_only(false), read_ahead(65536),
+		strict_utf8(false), raw_numbers(false), cache_shapes(true),
+		share_subtrees(false), schema(NULL), max_depth(10000), max_bytes(0),
+		max_string_length(0), max_elements(0), stats(NULL)
+	{}
+
+	bool lazy;		/* skip over arrays, see LazyArray */
+	/*
+	 * Lazy arrays are iterated from the current stream position without
+	 * seeking. Used automatically for streams that can't seek.
+	 */
+	bool forward_only;
+	/*
+	 * Size of the read-ahead window of each lazy array. 0 makes them
+	 * read from the shared stream directly.
+	 */
+	size_t read_ahead;
+	bool strict_utf8;	/* raise decode_error on invalid UTF-8 */
+	/*
+	 * Keep the text of numbers, and convert them only when accessed.
+	 * write() outputs the original text.
+	 */
+	bool raw_numbers;
+	/*
+	 * Compare object keys to the keys of the previous object at the same
+	 * depth before decoding them. Speeds up arrays of records.
+	 */
+	bool cache_shapes;
+	/*
+	 * Objects and arrays that are identical to an earlier one in the
+	 * same document share its storage, until either is modified. Saves
+	 * memory when the same records repeat, and makes comparing them
+	 * cheap. Elements of lazy arrays are shared within each element.
+	 */
+	bool share_subtrees;
+	/*
+	 * Validate the input while loading. Elements of lazy arrays are
+	 * validated by load_next(), and the schema must exist as long as
+	 * the arrays.
+	 */
+	const Schema *schema;
+	/*
+	 * Limits for untrusted input, 0 for no limit. Exceeding one raises
+	 * decode_error. They apply to each load() and load_next() call.
+	 *
+	 * The parser doesn't recurse, but destroying, copying and writing a
+	 * tree do, so the nesting is limited by default.
+	 */
+	int max_depth;		/* of nested objects and arrays */
+	/*
+	 * Bytes of input, counted as they are read, so any stream works and
+	 * a long string is stopped at the limit.
+	 */
+	size_t max_bytes;
+	size_t max_string_length;	/* strings, keys and numbers, in bytes */
+	size_t max_elements;	/* values in the document */
+	Stats *stats;
+};
 
 class Value {
 public:
@@ -61,6 +363,10 @@ public:
 	Value(const object_map_t &object);
 	Value(const std::vector<Value> &array);
 	Value(const Value &from);
+#if __cplusplus >= 201103L
+	Value(Value &&from) noexcept;
+	void operator = (Value &&from) noexcept;
+#endif
 	~Value();
 
 	Type type() const { return m_type; }
@@ -72,19 +378,23 @@ public:
 	}
 	int as_integer() const
 	{
-		verify_type(JSON_INTEGER);
-		if (int(m_value.integer) != m_value.integer) {
+		int64_t i = as_int64();
+		if (int(i) != i) {
 			throw type_error("Too large a integer");
 		}
-		return m_value.integer;
+		return i;
 	}
 	int64_t as_int64() const
 	{
 		verify_type(JSON_INTEGER);
+		if (m_flags & RAW_NUMBER)
+			return raw_integer();
 		return m_value.integer;
 	}
 	double as_double() const
 	{
+		if (m_flags & RAW_NUMBER)
+			return raw_floating();
 		/* treat integers as numbers too */
 		if (m_type == JSON_INTEGER)
 			return m_value.integer;
@@ -99,96 +409,751 @@ public:
 	const object_map_t &as_object() const
 	{
 		verify_type(JSON_OBJECT);
-		return *m_value.object;
+		return m_value.object->items;
 	}
 	const std::vector<Value> &as_array() const
 	{
 		verify_type(JSON_ARRAY);
-		return *m_value.array;
+		return m_value.array->items;
 	}
 	const object_map_t &as_const_object()
 	{
 		verify_type(JSON_OBJECT);
-		return *m_value.object;
+		return m_value.object->items;
 	}
 	const std::vector<Value> &as_const_array()
 	{
 		verify_type(JSON_ARRAY);
-		return *m_value.array;
+		return m_value.array->items;
 	}
 	object_map_t &as_object()
 	{
-		verify_type(JSON_OBJECT);
-		return *m_value.object;
+		return lend_object().items;
 	}
 	std::vector<Value> &as_array()
 	{
-		verify_type(JSON_ARRAY);
-		return *m_value.array;
+		return lend_array().items;
 	}
 
 	/* Used to iterate lazy-loaded arrays */
-	Value load_next(bool *eof = NULL, bool lazy = false);
+	Value load_next(bool *eof = NULL, bool lazy = false,
+			Stats *stats = NULL);
+
+	/* Returns null if the object doesn't have the key */
+	const Value &get(const std::string &s) const { return get_key(s); }
+	Value &get(const std::string &s) { return get_key(s); }
+	const Value &get(const char *s) const { return get_key(CStrKey(s)); }
+	Value &get(const char *s) { return get_key(CStrKey(s)); }
+	const Value &get(const Key &key) const { return get_key(key.name()); }
+	Value &get(const Key &key) { return get_key(key.name()); }
 
-	const Value &get(const std::string &s) const
+	/* Returns NULL if the object doesn't have the key */
+	const Value *find(const std::string &s) const { return find_key(s); }
+	Value *find(const std::string &s) { return find_key(s); }
+	const Value *find(const char *s) const { return find_key(CStrKey(s)); }
+	Value *find(const char *s) { return find_key(CStrKey(s)); }
+	const Value *find(const Key &key) const { return find_key(key.name()); }
+	Value *find(const Key &key) { return find_key(key.name()); }
+
+	bool contains(const std::string &s) const { return find_key(s) != NULL; }
+	bool contains(const char *s) const
 	{
-		static Value null;
-		verify_type(JSON_OBJECT);
-		object_map_t::iterator i = m_value.object->find(s);
-		if (i == m_value.object->end()) {
-			return null;
-		}
-		return i->second;
+		return find_key(CStrKey(s)) != NULL;
 	}
-	Value &get(const std::string &s)
+	bool contains(const Key &key) const
 	{
-		static Value null;
-		verify_type(JSON_OBJECT);
-		object_map_t::iterator i = m_value.object->find(s);
-		if (i == m_value.object->end()) {
-			return null;
-		}
-		return i->second;
+		return find_key(key.name()) != NULL;
 	}
+
+#if __cplusplus >= 201703L
+	const Value &get(std::string_view s) const { return get_key(s); }
+	Value &get(std::string_view s) { return get_key(s); }
+	const Value *find(std::string_view s) const { return find_key(s); }
+	Value *find(std::string_view s) { return find_key(s); }
+	bool contains(std::string_view s) const { return find_key(s) != NULL; }
+#endif
+
 	void set(const std::string &s, const Value &val)
 	{
-		verify_type(JSON_OBJECT);
-		m_value.object->insert(std::make_pair(s, val));
+		modify_object().items.insert(std::make_pair(s, val));
 	}
 
 	void append(const Value &val)
 	{
-		verify_type(JSON_ARRAY);
-		m_value.array->push_back(val);
+		modify_array().items.push_back(val);
 	}
 
 	void operator = (const Value &from);
 
+	/* Exchanges the contents of two values without copying */
+	void swap(Value &other);
+
 	bool operator == (const Value &other) const;
 	bool operator != (const Value &other) const;
 
-	void load(std::istream &is, bool lazy = false);
-	void load_all(std::istream &is, bool lazy = false);
+	/*
+	 * Hash that is equal for values that compare equal, so an integer
+	 * and a floating point number of the same value hash the same. The
+	 * hashes of objects and arrays are kept, and comparing two values
+	 * that both have one fails fast when they differ. As with the write
+	 * cache, a container that has lent references to its items uses its
+	 * hash only until any value is modified. Lazy arrays raise
+	 * type_error.
+	 */
+	size_t hash() const;
+
+	/*
+	 * Applies an RFC 6902 JSON Patch in place. Moved values are swapped
+	 * instead of copied, and added values share the containers of the
+	 * patch, unless they have lent references to their items. Only the
+	 * containers along the changed paths are modified. Raises
+	 * patch_error if an operation fails, and the operations before it
+	 * stay applied.
+	 */
+	void apply_patch(const Value &patch);
+
+	/* Applies an RFC 7396 merge patch in place */
+	void merge_patch(const Value &patch);
+
+	void load(std::istream &is, bool lazy = false, Stats *stats = NULL);
+	void load(std::istream &is, const LoadOptions &options);
+	void load_all(std::istream &is, bool lazy = false,
+		      Stats *stats = NULL);
+	void load_all(std::istream &is, const LoadOptions &options);
+	/*
+	 * Load a whole document from memory without copying it, or from a
+	 * Source. Lazy arrays need a stream, so options.lazy is not
+	 * supported.
+	 */
+	void load_all(const char *data, size_t len,
+		      const LoadOptions &options = LoadOptions());
+	void load_all(Source &source,
+		      const LoadOptions &options = LoadOptions());
+
+	void write(std::ostream &os, int indent=0, Stats *stats = NULL) const;
+	void write(std::ostream &os, const WriteOptions &options) const;
 
-	void write(std::ostream &os, int indent=0) const;
+	/* Heap memory held by the value and its children, in bytes */
+	size_t memory_usage() const;
+	void memory_usage(MemoryUsage *usage) const;
+
+	/*
+	 * Frees the unused capacity of arrays and strings, which is left
+	 * by loading and appending. Object keys are not reallocated, and
+	 * containers shared with other values are skipped.
+	 */
+	void shrink_to_fit();
 
 private:
+	/* the length of a C string is measured once, not in every compare */
+#if __cplusplus >= 201703L
+	typedef std::string_view CStrKey;
+#else
+	typedef const char *CStrKey;
+#endif
+
+	template<class K>
+	const Value *find_key(const K &key) const
+	{
+		verify_type(JSON_OBJECT);
+		object_map_t::const_iterator i = m_value.object->items.find(key);
+		if (i == m_value.object->items.end()) {
+			return NULL;
+		}
+		return &i->second;
+	}
+	template<class K>
+	Value *find_key(const K &key)
+	{
+		object_map_t &items = lend_object().items;
+		object_map_t::iterator i = items.find(key);
+		if (i == items.end()) {
+			return NULL;
+		}
+		return &i->second;
+	}
+	template<class K>
+	const Value &get_key(const K &key) const
+	{
+		const Value *val = find_key(key);
+		if (val)
+			return *val;
+		static Value null;
+		return null;
+	}
+	template<class K>
+	Value &get_key(const K &key)
+	{
+		Value *val = find_key(key);
+		if (val)
+			return *val;
+		static Value null;
+		return null;
+	}
+
+	enum {
+		/* the number is stored as text in m_value.string */
+		RAW_NUMBER = 1,
+	};
+
 	Type m_type;
+	uint8_t m_flags;
 	union {
 		std::string *string;
 		int64_t integer;
 		double floating;
 		bool boolean;
-		object_map_t *object;
-		std::vector<Value> *array;
+		ObjectContainer *object;
+		ArrayContainer *array;
 		LazyArray *lazy;
 	} m_value;
 
 	void destroy();
 
+	/* Return the container for modification, copied if shared */
+	ObjectContainer &modify_object()
+	{
+		verify_type(JSON_OBJECT);
+		if (__atomic_load_n(&m_value.object->refs, __ATOMIC_ACQUIRE) > 1)
+			unshare();
+		m_value.object->touch();
+		OutputCache::modified();
+		return *m_value.object;
+	}
+	ArrayContainer &modify_array()
+	{
+		verify_type(JSON_ARRAY);
+		if (__atomic_load_n(&m_value.array->refs, __ATOMIC_ACQUIRE) > 1)
+			unshare();
+		m_value.array->touch();
+		OutputCache::modified();
+		return *m_value.array;
+	}
+	/*
+	 * Return the container when references to its items are returned.
+	 * Reading through them doesn't modify anything, so the output is
+	 * kept until some value is modified.
+	 */
+	ObjectContainer &lend_object()
+	{
+		verify_type(JSON_OBJECT);
+		if (__atomic_load_n(&m_value.object->refs, __ATOMIC_ACQUIRE) > 1)
+			unshare();
+		m_value.object->lent = true;
+		return *m_value.object;
+	}
+	ArrayContainer &lend_array()
+	{
+		verify_type(JSON_ARRAY);
+		if (__atomic_load_n(&m_value.array->refs, __ATOMIC_ACQUIRE) > 1)
+			unshare();
+		m_value.array->lent = true;
+		return *m_value.array;
+	}
+	void unshare();
+	void share(const Value &from, bool copy_lent = false);
+	void share_items(const Value &container, bool copy_lent = false);
+	friend struct ShareTable;
+	friend struct Differ;
+	friend struct Patcher;
+	friend class Document;
+	friend class DocumentCache;
+
+	void load(Decoder &dec);
+	void load_document(Decoder &dec, bool all);
+	friend bool load_element(Decoder &dec, Value &val);
+	bool next(Value &val, bool lazy, Stats *stats, Table *table);
+	friend class Table;
+	static Value lazy_array(std::istream &is, std::streampos offset,
+				const LoadOptions &options);
+	friend class OffsetIndex;
+	friend class Schema;
+	void encode(std::ostream &os, const WriteOptions &options,
+		    int depth) const;
+	void encode_value(std::ostream &os, const WriteOptions &options,
+			  int depth) const;
+
 	void verify_type(Type type) const;
+	void add_memory(MemoryUsage *usage,
+			std::map<std::string, uint64_t> *members,
+			std::set<const void *> &shared) const;
+
+	int64_t raw_integer() const;
+	double raw_floating() const;
 };
 
+/*
+ * A source of input for Value::load_all(), read a block at a time. The
+ * parser scans the blocks directly, so a source costs a virtual call per
+ * block instead of per byte like a std::streambuf without a buffer.
+ */
+class Source {
+public:
+	virtual ~Source() {}
+
+	/*
+	 * Reads at most 'len' bytes. Returns 0 at the end of the input.
+	 * Errors are raised as exceptions.
+	 */
+	virtual size_t read(char *buf, size_t len) = 0;
+};
+
+/* Reads a file descriptor with large read() calls */
+class FdSource: public Source {
+public:
+	FdSource(int fd) :
+		m_fd(fd)
+	{}
+
+	size_t read(char *buf, size_t len);
+
+private:
+	int m_fd;
+};
+
+/* Reads a stdio stream */
+class FileSource: public Source {
+public:
+	FileSource(FILE *file) :
+		m_file(file)
+	{}
+
+	size_t read(char *buf, size_t len);
+
+private:
+	FILE *m_file;
+};
+
+enum Compression {
+	COMPRESS_GZIP,		/* also reads zlib streams */
+	COMPRESS_ZSTD,		/* needs configure --with-zstd */
+};
+
+struct DecompressState;
+
+/*
+ * Decompresses input for a std::istream. A thread decompresses into a
+ * ring of 'blocks' blocks ahead of the reader, so decompression and
+ * parsing overlap. With 'blocks' = 0 the reader decompresses by itself.
+ *
+ * Positions are offsets in the decompressed data, so lazy arrays work.
+ * Seeking forward decompresses up to the position and seeking backward
+ * starts over from the beginning of the input, so arrays should be
+ * iterated in order, or with LoadOptions::forward_only. A Source can't
+ * be rewound, so the stream can't seek, like a pipe.
+ */
+class DecompressBuf: public std::streambuf {
+public:
+	DecompressBuf(std::istream &input, Compression type,
+		      size_t blocks = 4, size_t block_size = 256 * 1024);
+	DecompressBuf(Source &input, Compression type,
+		      size_t blocks = 4, size_t block_size = 256 * 1024);
+	~DecompressBuf();
+
+protected:
+	int_type underflow();
+	pos_type seekoff(off_type off, std::ios::seekdir dir,
+			 std::ios::openmode mode);
+	pos_type seekpos(pos_type pos, std::ios::openmode mode);
+
+private:
+	DecompressState *m_state;
+
+	void init(Compression type, size_t blocks, size_t block_size);
+	void next_block();
+
+	DecompressBuf(const DecompressBuf &);
+	void operator = (const DecompressBuf &);
+};
+
+struct CompressState;
+
+/*
+ * Compresses the output of a std::ostream, such as Value::write(). The
+ * output is complete only after finish(), which the destructor calls
+ * too, but without reporting errors. 'level' 0 uses the default level.
+ */
+class CompressBuf: public std::streambuf {
+public:
+	CompressBuf(std::ostream &output, Compression type, int level = 0);
+	~CompressBuf();
+
+	void finish();
+
+protected:
+	int_type overflow(int_type c);
+	int sync();
+	pos_type seekoff(off_type off, std::ios::seekdir dir,
+			 std::ios::openmode mode);
+
+private:
+	CompressState *m_state;
+
+	void compress(bool end);
+
+	CompressBuf(const CompressBuf &);
+	void operator = (const CompressBuf &);
+};
+
+struct ReclaimerState;
+
+/*
+ * Frees values on a background thread, so that dropping a large tree
+ * doesn't stall the caller. Values are detached in constant time and
+ * queued; the queue is bounded, and dispose() blocks when it's full.
+ */
+class Reclaimer {
+public:
+	Reclaimer(size_t max_queue = 1024);
+	/* Frees everything that is queued */
+	~Reclaimer();
+
+	/* Takes the contents of the value, leaving it null */
+	void dispose(Value &value);
+	/* Returns false and leaves the value as it is if the queue is full */
+	bool try_dispose(Value &value);
+
+	/* Waits until all values queued so far have been freed */
+	void flush();
+	/*
+	 * Flushes the queue and stops the thread. Values disposed after this
+	 * are freed by the caller.
+	 */
+	void shutdown();
+
+	size_t pending() const;
+
+private:
+	ReclaimerState *m_state;
+
+	Reclaimer(const Reclaimer &);
+	void operator = (const Reclaimer &);
+};
+
+/*
+ * A read-only handle of a document loaded by a DocumentCache. The handle
+ * shares the containers of the cached document, so several threads can
+ * read it at the same time, and copying the handle copies nothing.
+ */
+class Document {
+public:
+	Document() {}
+	Document(const Document &from)
+	{
+		m_value.share(from.m_value);
+	}
+	void operator = (const Document &from)
+	{
+		m_value.share(from.m_value);
+	}
+
+	const Value &value() const { return m_value; }
+	const Value &operator * () const { return m_value; }
+	const Value *operator -> () const { return &m_value; }
+
+	/*
+	 * Returns a value for modifying the document. It shares the
+	 * containers too, and copies the ones that are modified.
+	 */
+	Value copy() const
+	{
+		Value val;
+		val.share(m_value);
+		return val;
+	}
+
+private:
+	Value m_value;
+	friend class DocumentCache;
+};
+
+struct DocumentCacheState;
+
+/*
+ * Loads JSON files once for all the threads of a process. A document is
+ * kept by its path, and is loaded again when the inode, size or
+ * modification time of the file changes. The least recently used
+ * documents are dropped when they hold more memory than the budget.
+ */
+class DocumentCache {
+public:
+	/*
+	 * Lazy arrays and options.stats are not used, since the documents
+	 * are read by several threads.
+	 */
+	DocumentCache(size_t max_memory = 256 << 20,
+		      const LoadOptions &options = LoadOptions());
+	/* Stops the reloads that are not done yet */
+	~DocumentCache();
+
+	/* The cache shared by the whole process */
+	static DocumentCache &global();
+
+	/*
+	 * Returns the document in the file, without copying it. Only the
+	 * first get() of a file waits for it to be loaded. When the file
+	 * changes, the old version is returned until a background thread
+	 * has loaded the new one, and kept if that fails.
+	 */
+	Document get(const std::string &path);
+
+	/* Drops the document, unless it's being loaded for the first time */
+	void remove(const std::string &path);
+	void clear();
+
+	/* Waits until the reloads started so far are done */
+	void flush();
+
+	/* Number of documents, and the memory they hold */
+	size_t size() const;
+	size_t memory() const;
+
+private:
+	DocumentCacheState *m_state;
+
+	DocumentCache(const DocumentCache &);
+	void operator = (const DocumentCache &);
+};
+
+enum ColumnType {
+	COLUMN_INT64,
+	COLUMN_DOUBLE,
+	COLUMN_STRING,
+};
+
+/*
+ * A column of a Table. Only the vector of the column's type is used. The
+ * string of row i is buffer[offsets[i] .. offsets[i + 1]). Bit i of
+ * 'valid' is cleared when the field of row i is null or missing, and the
+ * row has zero or an empty string in that case.
+ */
+struct Column {
+	std::string name;
+	ColumnType type;
+	std::vector<int64_t> ints;
+	std::vector<double> doubles;
+	std::vector<size_t> offsets;
+	std::string buffer;
+	std::vector<uint8_t> valid;
+
+	Column(const std::string &name, ColumnType type);
+
+	bool is_null(size_t row) const
+	{
+		return !(valid[row / 8] & (1 << (row % 8)));
+	}
+	std::string get_string(size_t row) const
+	{
+		return buffer.substr(offsets[row], offsets[row + 1] - offsets[row]);
+	}
+};
+
+/*
+ * Shreds an array of objects in to typed columns. The fields of a lazy
+ * array are stored directly while parsing, without loading the elements.
+ * Fields without a column are skipped. A field of a wrong type raises
+ * type_error, and the rows added before the error are kept.
+ */
+class Table {
+public:
+	Table();
+
+	void add_column(const std::string &name, ColumnType type);
+
+	/* Appends the elements of an array or a lazy array as rows */
+	void shred(Value &array);
+
+	size_t rows() const { return m_rows; }
+	const std::vector<Column> &columns() const { return m_columns; }
+	const Column &column(const std::string &name) const;
+
+	/* Removes the rows, but keeps the columns */
+	void clear();
+
+private:
+	std::vector<Column> m_columns;
+	std::map<std::string, size_t> m_index;
+	size_t m_rows;
+
+	void begin_row();
+	void end_row();
+	void truncate();
+	void set_null(Column &col);
+	void set_value(Column &col, const Value &val);
+	void shred_field(Decoder &dec, Column &col);
+	friend void shred_row(Decoder &dec, Table &table);
+};
+
+/*
+ * Offsets of the elements of the outermost array of a file. Saved in a
+ * sidecar file, the index lets a lazy array start from any element without
+ * skipping over the file first. An index is valid for the size,
+ * modification time and a hash of samples of the file. The file must not
+ * contain comments.
+ */
+class OffsetIndex {
+public:
+	OffsetIndex();
+
+	/*
+	 * Scans the file in chunks of at least 'min_chunk' bytes on
+	 * 'threads' threads, by default one for each CPU.
+	 */
+	void build(const std::string &path, int threads = 0,
+		   size_t min_chunk = 1 << 20);
+
+	void save(const std::string &index_path) const;
+	/* Returns false if the index is missing or is not for the file */
+	bool load(const std::string &index_path, const std::string &path);
+
+	/* Loads the sidecar index of the file, or builds and saves it */
+	void load_or_build(const std::string &path, int threads = 0);
+
+	static std::string sidecar_path(const std::string &path)
+	{
+		return path + ".idx";
+	}
+
+	size_t size() const
+	{
+		return m_offsets.empty() ? 0 : m_offsets.size() - 1;
+	}
+	/* The offset of element 'size()' is the closing ']' */
+	uint64_t offset(size_t i) const { return m_offsets[i]; }
+
+	/*
+	 * Returns a lazy array over the file, opened as 'is', that
+	 * continues from the element 'start'.
+	 */
+	Value open(std::istream &is, size_t start = 0,
+		   const LoadOptions &options = LoadOptions()) const;
+
+private:
+	uint64_t m_size;
+	int64_t m_mtime_sec;
+	int64_t m_mtime_nsec;
+	uint64_t m_hash;
+	std::vector<uint64_t> m_offsets;
+};
+
+/*
+ * A subset of JSON Schema, compiled for validating input while it's
+ * loaded. Supported keywords are type, properties, required, items, enum,
+ * minimum, maximum and maxLength; annotations such as title are ignored
+ * and other keywords raise std::invalid_argument. A document that doesn't
+ * match raises schema_error at the first value that violates the schema.
+ * The error gives the offset of the value for a wrong type, and the end of
+ * the value for the other checks.
+ */
+class Schema {
+public:
+	Schema(const Value &schema);
+	~Schema();
+
+	/*
+	 * Checks a document without loading it. Returns false and the
+	 * reason if the document is invalid or doesn't match.
+	 */
+	bool validate(std::istream &is, std::string *error = NULL,
+		      const LoadOptions &options = LoadOptions()) const;
+
+private:
+	SchemaNode *m_root;
+
+	void walk(Decoder &dec, const SchemaNode *node) const;
+	friend struct Decoder;
+
+	Schema(const Schema &);
+	void operator = (const Schema &);
+};
+
+struct PrefetcherState;
+
+/*
+ * Iterates a lazy array while a background thread parses up to 'depth'
+ * elements ahead, so that parsing overlaps with the processing of the
+ * elements. With depth 0, the elements are loaded by the caller. The
+ * array and its input stream must not be used by anything else while the
+ * prefetcher exists. Errors from the parser are thrown by next().
+ *
+ *	json::Prefetcher elements(doc);
+ *	for (json::Prefetcher::iterator i = elements.begin();
+ *	     i != elements.end(); ++i)
+ *		...
+ */
+class Prefetcher {
+public:
+	Prefetcher(Value &array, size_t depth = 64);
+	~Prefetcher();
+
+	/* Returns false at the end of the array */
+	bool next(Value &value);
+
+	class iterator {
+	public:
+		iterator() : m_owner(NULL) {}
+
+		Value &operator * () { return m_value; }
+		Value *operator -> () { return &m_value; }
+		iterator &operator ++ ()
+		{
+			if (!m_owner->next(m_value))
+				m_owner = NULL;
+			return *this;
+		}
+		bool operator == (const iterator &other) const
+		{
+			return m_owner == other.m_owner;
+		}
+		bool operator != (const iterator &other) const
+		{
+			return m_owner != other.m_owner;
+		}
+
+	private:
+		friend class Prefetcher;
+		Prefetcher *m_owner;
+		Value m_value;
+	};
+
+	/* The iteration can be started only once */
+	iterator begin();
+	iterator end() { return iterator(); }
+
+private:
+	PrefetcherState *m_state;
+
+	Prefetcher(const Prefetcher &);
+	void operator = (const Prefetcher &);
+};
+
+/*
+ * Minifies (indent = 0) or pretty-prints JSON from the input to the output
+ * without building a tree. The order of object keys is preserved, comments
+ * and trailing commas are removed. If the input has several values, they
+ * are written on separate lines. Memory use only depends on the nesting.
+ */
+void reformat(std::istream &is, std::ostream &os, int indent = 0);
+void reformat(const char *data, size_t len, std::ostream &os,
+	      int indent = 0);
+
+/*
+ * Returns an RFC 6902 JSON Patch that turns 'from' into 'to'. Subtrees
+ * that are shared are skipped without walking them, and the hashes kept
+ * by Value::hash() rule out the changed ones quickly. Equal hashes are
+ * confirmed with ==. Array elements are matched by their longest common
+ * subsequence, or by position when the changed part is too large. The
+ * patch shares the containers of 'to', except the ones that have lent
+ * references to their items, which are copied.
+ */
+Value diff(const Value &from, const Value &to);
+
+/*
+ * Returns an RFC 7396 merge patch that turns 'from' into 'to'. Merge
+ * patches remove keys with null, so null members of 'to' can't be added.
+ */
+Value merge_diff(const Value &from, const Value &to);
+
 }
 
 #endif
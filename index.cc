@@ -0,0 +1,508 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Sidecar index of the element offsets of the outermost array of a file.
+ */
+#include "internal.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace json {
+
+namespace {
+
+const char MAGIC[8] = {'J', 'S', 'O', 'N', 'I', 'D', 'X', '1'};
+const size_t BLOCK_SIZE = 1 << 20;
+/* the hash covers blocks of this size, one every SAMPLE_STEP bytes */
+const size_t SAMPLE_SIZE = 4096;
+const uint64_t SAMPLE_STEP = 16 << 20;
+
+class File {
+public:
+	File(const std::string &path, int flags = O_RDONLY) :
+		m_path(path), m_fd(open(path.c_str(), flags, 0644))
+	{
+		if (m_fd < 0)
+			fail();
+	}
+	~File()
+	{
+		close(m_fd);
+	}
+
+	int fd() const { return m_fd; }
+
+	/* Reads at most 'len' bytes, less only at the end of the file */
+	size_t pread(void *buf, size_t len, uint64_t offset)
+	{
+		size_t done = 0;
+		while (done < len) {
+			ssize_t got = ::pread(m_fd, (char *) buf + done,
+					      len - done, offset + done);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got < 0)
+				fail();
+			if (got == 0)
+				break;
+			done += got;
+		}
+		return done;
+	}
+
+	void fail()
+	{
+		throw std::runtime_error(strf("%s: %s", m_path.c_str(),
+					      strerror(errno)));
+	}
+
+private:
+	std::string m_path;
+	int m_fd;
+
+	File(const File &);
+	void operator = (const File &);
+};
+
+/* FNV-1a */
+uint64_t hash_bytes(uint64_t hash, const char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= uint8_t(buf[i]);
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/*
+ * Hashes samples of the file, so that checking the index doesn't read the
+ * whole file: a block every SAMPLE_STEP bytes, and the last block.
+ */
+uint64_t sample_hash(File &file, uint64_t size)
+{
+	char buf[SAMPLE_SIZE];
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (uint64_t pos = 0; pos < size; pos += SAMPLE_STEP) {
+		size_t len = file.pread(buf, SAMPLE_SIZE, pos);
+		hash = hash_bytes(hash, buf, len);
+	}
+	if (size > SAMPLE_SIZE) {
+		size_t len = file.pread(buf, SAMPLE_SIZE, size - SAMPLE_SIZE);
+		hash = hash_bytes(hash, buf, len);
+	}
+	return hash;
+}
+
+struct FileKey {
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+};
+
+FileKey file_key(File &file)
+{
+	struct stat st;
+	if (fstat(file.fd(), &st) < 0)
+		file.fail();
+	FileKey key;
+	key.size = st.st_size;
+	key.mtime_sec = st.st_mtim.tv_sec;
+	key.mtime_nsec = st.st_mtim.tv_nsec;
+	key.hash = sample_hash(file, key.size);
+	return key;
+}
+
+/*
+ * A part of the file scanned by a thread. Whether the chunk starts inside
+ * a string is not known until the chunks before it are scanned, so the
+ * first pass counts the depth change for both cases. The chunks never
+ * start after a backslash, so they can't start in the middle of an
+ * escape.
+ */
+struct Chunk {
+	const std::string *path;
+	uint64_t start, end;
+	uint64_t first;		/* offset of the opening '[' */
+
+	/* first pass */
+	bool flips;		/* odd number of quotes */
+	int64_t delta[2];	/* depth change if starting outside/inside a string */
+
+	/* second pass */
+	bool in_string;
+	int64_t depth;
+	std::vector<uint64_t> offsets;
+	uint64_t close;		/* offset of the closing ']', or 0 */
+
+	/* an error from the thread */
+	std::string error;
+	bool decode_error;
+};
+
+void scan_depth(File &file, Chunk &chunk)
+{
+	std::vector<char> block(BLOCK_SIZE);
+	bool in = false, escape = false;
+	int64_t delta[2] = {0, 0};
+	for (uint64_t pos = chunk.start; pos < chunk.end; pos += BLOCK_SIZE) {
+		size_t len = file.pread(&block[0], std::min<uint64_t>(
+					BLOCK_SIZE, chunk.end - pos), pos);
+		for (size_t i = 0; i < len; ++i) {
+			char c = block[i];
+			if (escape) {
+				escape = false;
+			} else if (c == '\\') {
+				escape = true;
+			} else if (c == '"') {
+				in = !in;
+			} else if (c == '[' || c == '{') {
+				/*
+				 * Outside a string in the case where the chunk
+				 * starts inside one, when 'in' is set.
+				 */
+				delta[in]++;
+			} else if (c == ']' || c == '}') {
+				delta[in]--;
+			}
+		}
+	}
+	chunk.flips = in;
+	chunk.delta[0] = delta[0];
+	chunk.delta[1] = delta[1];
+}
+
+/* Collects the positions after '[' and the commas of the outermost array */
+void scan_offsets(File &file, Chunk &chunk)
+{
+	std::vector<char> block(BLOCK_SIZE);
+	bool in = chunk.in_string, escape = false;
+	int64_t depth = chunk.depth;
+	chunk.close = 0;
+	for (uint64_t pos = chunk.start; pos < chunk.end; pos += BLOCK_SIZE) {
+		size_t len = file.pread(&block[0], std::min<uint64_t>(
+					BLOCK_SIZE, chunk.end - pos), pos);
+		for (size_t i = 0; i < len; ++i) {
+			char c = block[i];
+			if (in) {
+				if (escape) {
+					escape = false;
+				} else if (c == '\\') {
+					escape = true;
+				} else if (c == '"') {
+					in = false;
+				}
+				continue;
+			}
+			switch (c) {
+			case '"':
+				in = true;
+				break;
+			case '[':
+			case '{':
+				if (depth++ > 0)
+					break;
+				if (pos + i != chunk.first) {
+					throw decode_error("Left over data in input");
+				}
+				chunk.offsets.push_back(pos + i + 1);
+				break;
+			case ']':
+			case '}':
+				if (--depth == 0)
+					chunk.close = pos + i;
+				break;
+			case ',':
+				if (depth == 1)
+					chunk.offsets.push_back(pos + i + 1);
+				break;
+			}
+		}
+	}
+}
+
+void *depth_thread(void *arg)
+{
+	Chunk *chunk = (Chunk *) arg;
+	try {
+		File file(*chunk->path);
+		scan_depth(file, *chunk);
+	} catch (const decode_error &e) {
+		chunk->error = e.what();
+		chunk->decode_error = true;
+	} catch (const std::exception &e) {
+		chunk->error = e.what();
+	}
+	return NULL;
+}
+
+void *offsets_thread(void *arg)
+{
+	Chunk *chunk = (Chunk *) arg;
+	try {
+		File file(*chunk->path);
+		scan_offsets(file, *chunk);
+	} catch (const decode_error &e) {
+		chunk->error = e.what();
+		chunk->decode_error = true;
+	} catch (const std::exception &e) {
+		chunk->error = e.what();
+	}
+	return NULL;
+}
+
+/* Runs the function for every chunk on a thread of its own */
+void run_threads(std::vector<Chunk> &chunks, void *(*func)(void *))
+{
+	std::vector<pthread_t> threads(chunks.size());
+	size_t started = 0;
+	for (; started < chunks.size(); ++started) {
+		if (pthread_create(&threads[started], NULL, func,
+				   &chunks[started]))
+			break;
+	}
+	/* if a thread couldn't be created, do the rest here */
+	for (size_t i = started; i < chunks.size(); ++i)
+		func(&chunks[i]);
+	for (size_t i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		if (chunks[i].decode_error) {
+			throw decode_error(chunks[i].error);
+		} else if (!chunks[i].error.empty()) {
+			throw std::runtime_error(chunks[i].error);
+		}
+	}
+}
+
+void put_varint(std::string &out, uint64_t val)
+{
+	while (val >= 0x80) {
+		out += char(0x80 | (val & 0x7F));
+		val >>= 7;
+	}
+	out += char(val);
+}
+
+bool get_varint(const std::string &in, size_t &pos, uint64_t &val)
+{
+	val = 0;
+	for (int shift = 0; shift < 64 && pos < in.size(); shift += 7) {
+		uint8_t c = in[pos++];
+		val |= uint64_t(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+}
+
+OffsetIndex::OffsetIndex() :
+	m_size(0), m_mtime_sec(0), m_mtime_nsec(0), m_hash(0)
+{
+}
+
+void OffsetIndex::build(const std::string &path, int threads,
+			size_t min_chunk)
+{
+	File file(path);
+	FileKey key = file_key(file);
+
+	/* the file must contain an array */
+	char c = 0;
+	uint64_t first = 0;
+	while (file.pread(&c, 1, first) == 1 &&
+	       (c == ' ' || c == '\n' || (c >= '\t' && c <= '\r')))
+		first++;
+	if (c != '[') {
+		throw decode_error("Expected an array");
+	}
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (min_chunk == 0)
+		min_chunk = 1;
+	size_t count = std::max<uint64_t>(1, std::min<uint64_t>(threads,
+						key.size / min_chunk));
+
+	std::vector<Chunk> chunks(count);
+	uint64_t start = 0;
+	for (size_t i = 0; i < count; ++i) {
+		Chunk &chunk = chunks[i];
+		chunk.path = &path;
+		chunk.first = first;
+		chunk.decode_error = false;
+		chunk.start = start;
+		if (i == count - 1) {
+			chunk.end = key.size;
+		} else {
+			/* don't split after a backslash */
+			uint64_t end = std::max(start, key.size * (i + 1) / count);
+			while (end > 0 && end < key.size &&
+			       file.pread(&c, 1, end - 1) == 1 && c == '\\')
+				end++;
+			chunk.end = end;
+		}
+		start = chunk.end;
+	}
+
+	run_threads(chunks, depth_thread);
+	bool in = false;
+	int64_t depth = 0;
+	for (size_t i = 0; i < count; ++i) {
+		chunks[i].in_string = in;
+		chunks[i].depth = depth;
+		depth += chunks[i].delta[in];
+		in = in != chunks[i].flips;
+	}
+	if (in || depth != 0) {
+		throw decode_error("Unexpected end of input");
+	}
+	run_threads(chunks, offsets_thread);
+
+	m_offsets.clear();
+	uint64_t close = 0;
+	for (size_t i = 0; i < count; ++i) {
+		m_offsets.insert(m_offsets.end(), chunks[i].offsets.begin(),
+				 chunks[i].offsets.end());
+		if (chunks[i].close && !close)
+			close = chunks[i].close;
+	}
+
+	/* after an empty array or a trailing comma, there's no element */
+	uint64_t pos = m_offsets.back();
+	while (file.pread(&c, 1, pos) == 1 &&
+	       (c == ' ' || c == '\n' || (c >= '\t' && c <= '\r')))
+		pos++;
+	if (pos == close)
+		m_offsets.pop_back();
+	m_offsets.push_back(close);
+
+	m_size = key.size;
+	m_mtime_sec = key.mtime_sec;
+	m_mtime_nsec = key.mtime_nsec;
+	m_hash = key.hash;
+}
+
+void OffsetIndex::save(const std::string &index_path) const
+{
+	std::string out(MAGIC, sizeof MAGIC);
+	put_varint(out, m_size);
+	put_varint(out, m_mtime_sec);
+	put_varint(out, m_mtime_nsec);
+	put_varint(out, m_hash);
+	put_varint(out, m_offsets.size());
+	/* offsets are increasing, deltas fit in a byte or two */
+	uint64_t prev = 0;
+	for (size_t i = 0; i < m_offsets.size(); ++i) {
+		put_varint(out, m_offsets[i] - prev);
+		prev = m_offsets[i];
+	}
+
+	/* write to a temporary file, and rename it over the old index */
+	std::string tmp = index_path + ".tmp";
+	{
+		File file(tmp, O_WRONLY | O_CREAT | O_TRUNC);
+		size_t done = 0;
+		while (done < out.size()) {
+			ssize_t len = write(file.fd(), out.data() + done,
+					    out.size() - done);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0) {
+				unlink(tmp.c_str());
+				file.fail();
+			}
+			done += len;
+		}
+	}
+	if (rename(tmp.c_str(), index_path.c_str()) < 0) {
+		unlink(tmp.c_str());
+		throw std::runtime_error(strf("%s: %s", index_path.c_str(),
+					      strerror(errno)));
+	}
+}
+
+bool OffsetIndex::load(const std::string &index_path, const std::string &path)
+{
+	std::string in;
+	try {
+		File file(index_path);
+		char buf[65536];
+		size_t len;
+		uint64_t pos = 0;
+		while ((len = file.pread(buf, sizeof buf, pos)) > 0) {
+			in.append(buf, len);
+			pos += len;
+		}
+	} catch (const std::runtime_error &) {
+		return false;
+	}
+	if (in.size() < sizeof MAGIC || memcmp(in.data(), MAGIC, sizeof MAGIC))
+		return false;
+
+	size_t pos = sizeof MAGIC;
+	uint64_t size, mtime_sec, mtime_nsec, hash, count;
+	if (!get_varint(in, pos, size) || !get_varint(in, pos, mtime_sec) ||
+	    !get_varint(in, pos, mtime_nsec) || !get_varint(in, pos, hash) ||
+	    !get_varint(in, pos, count) || count == 0 || count > in.size())
+		return false;
+
+	/* is the index for this version of the file */
+	File file(path);
+	FileKey key = file_key(file);
+	if (key.size != size || uint64_t(key.mtime_sec) != mtime_sec ||
+	    uint64_t(key.mtime_nsec) != mtime_nsec || key.hash != hash)
+		return false;
+
+	std::vector<uint64_t> offsets(count);
+	uint64_t offset = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t delta;
+		if (!get_varint(in, pos, delta))
+			return false;
+		offset += delta;
+		offsets[i] = offset;
+	}
+	if (pos != in.size() || offset >= size)
+		return false;
+
+	m_offsets.swap(offsets);
+	m_size = size;
+	m_mtime_sec = mtime_sec;
+	m_mtime_nsec = mtime_nsec;
+	m_hash = hash;
+	return true;
+}
+
+void OffsetIndex::load_or_build(const std::string &path, int threads)
+{
+	std::string index_path = sidecar_path(path);
+	if (load(index_path, path))
+		return;
+	build(path, threads);
+	save(index_path);
+}
+
+Value OffsetIndex::open(std::istream &is, size_t start,
+			const LoadOptions &options) const
+{
+	if (start >= m_offsets.size()) {
+		throw std::out_of_range(strf("Element %u out of range",
+					     unsigned(start)));
+	}
+	return Value::lazy_array(is, m_offsets[start], options);
+}
+
+}
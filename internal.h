@@ -0,0 +1,390 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Helpers shared by the library sources. Not installed.
+ */
+#ifndef __cppjson_internal_h
+#define __cppjson_internal_h
+
+#include "cppjson.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace json {
+
+/* Must use the same order as enum Type */
+extern const char *type_names[];
+
+const std::string strf(const char *fmt, ...);
+size_t encode_utf8(int c, uint8_t *buffer);
+bool valid_utf8(const char *buf, size_t len);
+bool valid_number(const char *buf, size_t len, bool *is_float);
+std::streamoff stream_pos(std::streambuf *buf, std::ios::openmode mode);
+size_t lazy_array_memory(const LazyArray *lazy);
+
+/*
+ * The hash kept by Value::hash(). A lent container may have been modified
+ * through the references, so its hash is used only if no value has been
+ * modified since.
+ */
+inline bool kept_hash(const OutputCache &cache, size_t *hash, uint64_t epoch)
+{
+	if (!__atomic_load_n(&cache.has_hash, __ATOMIC_ACQUIRE))
+		return false;
+	if (cache.lent &&
+	    __atomic_load_n(&cache.hash_epoch, __ATOMIC_RELAXED) != epoch)
+		return false;
+	*hash = __atomic_load_n(&cache.hash, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Both containers have a hash kept by Value::hash(), and they differ */
+inline bool hashes_differ(const OutputCache &a, const OutputCache &b)
+{
+	uint64_t epoch = OutputCache::epoch();
+	size_t x, y;
+	return kept_hash(a, &x, epoch) && kept_hash(b, &y, epoch) && x != y;
+}
+
+/*
+ * Objects and arrays of a document by their hash, for
+ * LoadOptions::share_subtrees. The table shares the containers too, so
+ * they are kept until the end of the load.
+ */
+struct ShareTable {
+	/*
+	 * Open addressing with linear probing. A map node per container
+	 * missed the cache on most lookups of a large document.
+	 */
+	std::vector<size_t> hashes;
+	std::vector<Value> slots;	/* null if free */
+	size_t used;
+
+	ShareTable() :
+		used(0)
+	{}
+
+	/* Shares an identical earlier container, or adds this one */
+	void intern(Value &val, Stats *stats);
+	void grow();
+
+	static bool same_element(const Value &a, const Value &b);
+	static bool same_container(const Value &a, const Value &b);
+};
+
+/*
+ * Input of the decoder. The parser scans the window of buffered bytes
+ * directly, and calls refill() only when it runs out, so a source costs
+ * a virtual call per block instead of per byte.
+ */
+class Reader {
+public:
+	Reader() :
+		m_pos(NULL), m_end(NULL), m_begin(NULL), m_before(0),
+		m_limit(0), m_eof(false)
+	{}
+	virtual ~Reader() {}
+
+	/* Return EOF at the end of the input */
+	int peek()
+	{
+		if (m_pos == m_end && !fill())
+			return EOF;
+		return (uint8_t) *m_pos;
+	}
+	int get()
+	{
+		int c = peek();
+		if (c != EOF)
+			m_pos++;
+		return c;
+	}
+	/* peek() or get() has reached the end */
+	bool eof() const { return m_eof; }
+
+	/* Contents of the current window */
+	const char *pos() const { return m_pos; }
+	const char *end() const { return m_end; }
+	void advance(const char *pos) { m_pos = pos; }
+
+	/* Returns false at the end of the input */
+	bool fill()
+	{
+		m_before += m_pos - m_begin;
+		bool more = refill();
+		m_begin = m_pos;
+		check_limit();
+		if (more)
+			return true;
+		m_eof = true;
+		return false;
+	}
+
+	/* Bytes consumed from the input, counted without asking it */
+	uint64_t consumed() const { return m_before + (m_pos - m_begin); }
+
+	/*
+	 * Consuming more than 'limit' bytes in total raises decode_error,
+	 * 0 for no limit. Returns the previous limit.
+	 */
+	uint64_t set_limit(uint64_t limit)
+	{
+		uint64_t prev = m_limit;
+		m_limit = limit;
+		return prev;
+	}
+	void check_limit() const
+	{
+		if (m_limit && consumed() > m_limit) {
+			throw decode_error("Input is too large");
+		}
+	}
+	/*
+	 * End of the window, or one byte after the limit if it's in the
+	 * window, for scanning long runs of bytes
+	 */
+	const char *limit_end() const
+	{
+		if (m_limit && uint64_t(m_end - m_begin) > m_limit - m_before)
+			return m_begin + (m_limit - m_before) + 1;
+		return m_end;
+	}
+
+	/* Offset of the next byte in the input, or -1 if it's not known */
+	virtual std::streamoff tell() const = 0;
+
+protected:
+	const char *m_pos, *m_end;
+	const char *m_begin;	/* of the window */
+
+	/* Replaces the window with the next bytes of the input */
+	virtual bool refill() = 0;
+
+private:
+	uint64_t m_before;	/* consumed before the window */
+	uint64_t m_limit;
+	bool m_eof;
+
+	Reader(const Reader &);
+	void operator = (const Reader &);
+};
+
+/* Reads a buffer in memory, without copying */
+class BufferReader: public Reader {
+public:
+	BufferReader(const char *data, size_t len) :
+		m_start(data)
+	{
+		m_pos = m_begin = data;
+		m_end = data + len;
+	}
+
+	std::streamoff tell() const { return m_pos - m_start; }
+
+protected:
+	bool refill() { return false; }
+
+private:
+	const char *m_start;
+};
+
+/* Reads a Source a block at a time */
+class SourceReader: public Reader {
+public:
+	SourceReader(Source &source) :
+		m_source(source), m_block(BLOCK_SIZE), m_offset(0)
+	{}
+
+	std::streamoff tell() const { return m_offset - (m_end - m_pos); }
+
+protected:
+	bool refill();
+
+private:
+	enum { BLOCK_SIZE = 65536 };
+	Source &m_source;
+	std::vector<char> m_block;
+	std::streamoff m_offset;	/* of the end of the window */
+};
+
+/*
+ * Reads a std::istream. Only the bytes in the buffer of the streambuf are
+ * taken at a time, and the ones that were not used are put back by sync(),
+ * so that the stream is left right after the parsed input. The window
+ * starts small and grows, so that loading a small value from a large
+ * buffer doesn't copy much.
+ */
+class StreamReader: public Reader {
+public:
+	StreamReader(std::istream *is) :
+		m_is(is), m_next(sizeof m_small), m_direct(false)
+	{}
+	~StreamReader()
+	{
+		sync();
+	}
+
+	std::streamoff tell() const;
+
+	/* Returns the unused bytes to the stream */
+	void sync();
+
+protected:
+	bool refill();
+
+private:
+	enum { MAX_BLOCK = 65536 };
+	std::istream *m_is;
+	char m_small[256];
+	std::vector<char> m_block;
+	size_t m_next;		/* size of the next block */
+	/*
+	 * A streambuf without a buffer is read a byte at a time. The byte
+	 * in the window is still in the stream until the next refill.
+	 */
+	bool m_direct;
+};
+
+/*
+ * Writes to a stream a block at a time, so that writing a byte doesn't
+ * call the streambuf
+ */
+class BlockOutput {
+public:
+	BlockOutput(std::ostream &os) :
+		m_os(os), m_block(new char[BLOCK_SIZE]), m_len(0)
+	{}
+	~BlockOutput()
+	{
+		delete[] m_block;
+	}
+
+	void put(char c)
+	{
+		if (m_len == BLOCK_SIZE)
+			flush();
+		m_block[m_len++] = c;
+	}
+	void write(const char *data, size_t len)
+	{
+		if (m_len + len > BLOCK_SIZE) {
+			flush();
+			if (len > BLOCK_SIZE) {
+				write_out(data, len);
+				return;
+			}
+		}
+		memcpy(&m_block[m_len], data, len);
+		m_len += len;
+	}
+	void flush()
+	{
+		write_out(m_block, m_len);
+		m_len = 0;
+	}
+
+private:
+	enum { BLOCK_SIZE = 65536 };
+	std::ostream &m_os;
+	char *m_block;
+	size_t m_len;
+
+	void write_out(const char *data, size_t len)
+	{
+		if (m_os.rdbuf()->sputn(data, len) != std::streamsize(len))
+			m_os.setstate(std::ios::badbit);
+	}
+
+	BlockOutput(const BlockOutput &);
+	void operator = (const BlockOutput &);
+};
+
+/* A compiled schema for a value, see Schema */
+struct SchemaNode {
+	unsigned types;		/* bits of the allowed Types */
+	std::map<std::string, SchemaNode *> properties;
+	std::vector<std::string> required;
+	SchemaNode *items;
+	std::vector<Value> enumeration;
+	bool has_minimum, has_maximum;
+	double minimum, maximum;
+	size_t max_length;	/* characters, or -1 */
+
+	SchemaNode();
+	~SchemaNode();
+
+	void compile(const Value &schema);
+
+	/* the schema of a property, or NULL if any value is valid */
+	const SchemaNode *property(const std::string &key) const;
+
+	/*
+	 * Checks raise schema_error. The type is checked from the first
+	 * character of the value, after it has been consumed.
+	 */
+	void check_start(Reader &in, int c) const;
+	/* the rest of the checks, after the value has been loaded */
+	void check_value(Reader &in, const Value &val) const;
+	void check_number(Reader &in, double val, bool is_float) const;
+	void check_string(Reader &in, const std::string &str) const;
+	void check_enum(Reader &in, const Value &val) const;
+	void check_required(Reader &in, const object_map_t &obj) const;
+	void fail(Reader &in, const std::string &what,
+		  std::streamoff back = 0) const;
+
+private:
+	SchemaNode(const SchemaNode &);
+	void operator = (const SchemaNode &);
+};
+
+struct Shape;
+/* Cached object shapes by depth */
+typedef std::vector<Shape> ShapeCache;
+
+/* State of a single load() call */
+struct Decoder {
+	StreamReader stream;	/* used when loading a std::istream */
+	Reader &in;
+	/*
+	 * The stream lazy arrays refer to, or NULL if the input is not a
+	 * stream. Differs from the input when reading a window.
+	 */
+	std::istream *origin;
+	LoadOptions options;
+	Stats *stats;
+	int depth;
+	/* array elements are shredded to the table instead of loaded */
+	Table *table;
+	ShapeCache *shapes;
+	ShareTable *shares;	/* NULL unless sharing subtrees */
+	/* schema of the value being loaded, or NULL */
+	const SchemaNode *schema;
+	size_t values;		/* loaded, for LoadOptions::max_elements */
+	uint64_t saved_limit;	/* of the reader, restored at the end */
+
+	Decoder(std::istream &_is, const LoadOptions &_options);
+	Decoder(Reader &_in, const LoadOptions &_options);
+	~Decoder();
+
+	/* These raise decode_error when a limit of LoadOptions is exceeded */
+	void begin_value();
+	void begin_container();
+	void check_bytes();
+};
+
+int skip_space(Reader &in, Stats *stats = NULL);
+std::string load_string(Reader &in, bool strict, Stats *stats = NULL,
+			size_t max_length = 0);
+void skip_string(Reader &in, BlockOutput *copy = NULL);
+void skip_array(Reader &in, Stats *stats = NULL);
+void skip_value(Reader &in, Stats *stats = NULL);
+void match(Reader &in, const char *word, size_t len);
+void shred_row(Decoder &dec, Table &table);
+
+}
+
+#endif
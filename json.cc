@@ -5,23 +5,318 @@
  *
  * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
  */
-#include "cppjson.h"
+#include "internal.h"
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
 #include <sstream>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define FOR_EACH_CONST(type, i, cont)		\
 	for (type::const_iterator i = (cont).begin(); i != (cont).end(); ++i)
 
+#ifdef CPPJSON_NO_STATS
+#define STAT(stats, expr)		do { (void) (stats); } while (0)
+#define STAT_TIMER(stats, field)	do { (void) (stats); } while (0)
+#else
+/* Updates a statistics counter, if statistics are being collected */
+#define STAT(stats, expr)		\
+	do { if (stats) { (stats)->expr; } } while (0)
+/* Accounts the time spent in the current scope */
+#define STAT_TIMER(stats, field)	\
+	StatTimer stat_timer(stats, &Stats::field)
+#endif
+
 namespace json {
 
+/*
+ * Read-ahead window of a lazy array over the shared input stream. Refills
+ * seek and read a block from the stream, after which the elements are
+ * parsed from the window. Positions are those of the shared stream.
+ */
+class WindowBuf: public std::streambuf {
+public:
+	WindowBuf(std::istream *origin, size_t size) :
+		m_origin(origin), m_block(size), m_start(0), m_refills(0)
+	{
+		setg(&m_block[0], &m_block[0], &m_block[0]);
+	}
+
+	std::streampos pos() const
+	{
+		return m_start + std::streamoff(gptr() - eback());
+	}
+
+	/* Moves to the position, reusing the current block if possible */
+	void reset(std::streampos pos)
+	{
+		std::streamoff diff = pos - m_start;
+		if (diff >= 0 && diff <= egptr() - eback()) {
+			setg(eback(), eback() + diff, egptr());
+		} else {
+			m_start = pos;
+			setg(&m_block[0], &m_block[0], &m_block[0]);
+		}
+	}
+
+	size_t refills() const { return m_refills; }
+	size_t size() const { return m_block.size(); }
+
+protected:
+	int_type underflow()
+	{
+		std::streampos start = pos();
+		m_origin->clear();
+		m_origin->seekg(start);
+		m_origin->read(&m_block[0], m_block.size());
+		std::streamsize len = m_origin->gcount();
+		m_origin->clear();
+		m_refills++;
+		m_start = start;
+		setg(&m_block[0], &m_block[0], &m_block[0] + len);
+		if (len == 0)
+			return traits_type::eof();
+		return traits_type::to_int_type(m_block[0]);
+	}
+
+	pos_type seekoff(off_type off, std::ios::seekdir dir,
+			 std::ios::openmode mode)
+	{
+		if (dir == std::ios::cur) {
+			return seekpos(pos() + off, mode);
+		} else if (dir == std::ios::beg) {
+			return seekpos(off, mode);
+		}
+		return pos_type(-1);
+	}
+
+	pos_type seekpos(pos_type pos, std::ios::openmode)
+	{
+		reset(pos);
+		return pos;
+	}
+
+private:
+	std::istream *m_origin;
+	std::vector<char> m_block;
+	std::streampos m_start;		/* position of the block */
+	size_t m_refills;
+};
+
+struct Window {
+	WindowBuf buf;
+	std::istream is;
+
+	Window(std::istream *origin, size_t size) :
+		buf(origin, size), is(&buf)
+	{}
+};
+
+/*
+ * Keys of the previous object at the same depth. Arrays of records repeat
+ * the same keys in the same order, so the input is first compared to the
+ * cached keys, which is much cheaper than decoding them and searching the
+ * map for the place.
+ */
+struct Shape {
+	std::vector<std::string> keys;
+	/*
+	 * Index of the earlier key that follows the key in the map, or -1.
+	 * The iterator of that key is the insertion hint.
+	 */
+	std::vector<int> next;
+	std::vector<object_map_t::iterator> its;	/* of the current object */
+
+	void truncate(size_t len)
+	{
+		keys.resize(len);
+		next.resize(len);
+		its.resize(len);
+	}
+};
+
+/* Only short keys of plain characters are cached */
+const size_t MAX_SHAPE_KEYS = 64;
+const size_t MAX_SHAPE_KEY_LEN = 64;
+
 struct LazyArray {
 	std::istream *is;
-	std::istream::streampos offset;
+	std::streampos offset;
+	std::streampos end;	/* after the ']', or -1 if not known */
+	LoadOptions options;	/* used to load the elements */
+	Window *window;		/* allocated on the first load_next() */
+	ShapeCache *shapes;	/* of the elements */
+	const SchemaNode *schema;	/* of the elements, or NULL */
+
+	/*
+	 * A forward-only array is iterated directly from the current position
+	 * of the stream, without seeking. The array has not been skipped over,
+	 * so its elements are the next thing in the input.
+	 */
+	bool forward;
+	bool separator;		/* ',' or ']' is expected next */
+	bool done;		/* ']' has been consumed */
+	bool check_end;		/* loaded by load_all() */
+
+	LazyArray() :
+		end(-1), window(NULL), shapes(NULL)
+	{}
+	/* A copy gets a window of its own */
+	LazyArray(const LazyArray &from) :
+		is(from.is), offset(from.offset), end(from.end),
+		options(from.options), window(NULL), shapes(NULL),
+		schema(from.schema), forward(from.forward),
+		separator(from.separator), done(from.done),
+		check_end(from.check_end)
+	{}
+	~LazyArray()
+	{
+		delete window;
+		delete shapes;
+	}
+
+private:
+	void operator = (const LazyArray &);
+};
+
+size_t lazy_array_memory(const LazyArray *lazy)
+{
+	size_t size = sizeof(LazyArray);
+	if (lazy->window)
+		size += sizeof(Window) + lazy->window->buf.size();
+	if (lazy->shapes)
+		size += sizeof(ShapeCache);
+	return size;
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+class StatTimer {
+public:
+	StatTimer(Stats *stats, double Stats::*field) :
+		m_stats(stats), m_field(field), m_start(0)
+	{
+		if (m_stats)
+			m_start = now();
+	}
+	~StatTimer()
+	{
+		if (m_stats)
+			m_stats->*m_field += now() - m_start;
+	}
+
+private:
+	Stats *m_stats;
+	double Stats::*m_field;
+	double m_start;
 };
 
+/*
+ * Current position of a stream, or -1 if the stream can't tell. Unlike
+ * tellg(), doesn't touch the stream state.
+ */
+std::streamoff stream_pos(std::streambuf *buf, std::ios::openmode mode)
+{
+	return buf->pubseekoff(0, std::ios::cur, mode);
+}
+
+bool StreamReader::refill()
+{
+	std::streambuf *buf = m_is->rdbuf();
+	if (m_direct) {
+		/* the byte in the window has been used */
+		buf->sbumpc();
+		m_direct = false;
+	}
+	if (buf->sgetc() == EOF)
+		return false;
+	/* the buffer of the streambuf is not empty now */
+	std::streamsize avail = buf->in_avail();
+	if (avail <= 0) {
+		m_small[0] = buf->sgetc();
+		m_pos = m_small;
+		m_end = m_small + 1;
+		m_direct = true;
+		return true;
+	}
+
+	size_t len = std::min<size_t>(avail, m_next);
+	char *block = m_small;
+	if (len > sizeof m_small) {
+		if (m_block.size() < len)
+			m_block.resize(len);
+		block = &m_block[0];
+	}
+	len = buf->sgetn(block, len);
+	m_pos = block;
+	m_end = block + len;
+	m_next = std::min<size_t>(m_next * 2, MAX_BLOCK);
+	return len > 0;
+}
+
+void StreamReader::sync()
+{
+	if (m_is == NULL)
+		return;
+	std::streambuf *buf = m_is->rdbuf();
+	if (m_direct) {
+		if (m_pos == m_end)
+			buf->sbumpc();
+		m_direct = false;
+	} else if (m_pos < m_end) {
+		/* the bytes came from the buffer, so they fit back */
+		const char *p = m_end;
+		while (p > m_pos && buf->sputbackc(p[-1]) != EOF)
+			p--;
+		if (p > m_pos &&
+		    buf->pubseekoff(-(p - m_pos), std::ios::cur,
+				    std::ios::in) == std::streampos(-1))
+			m_is->setstate(std::ios::badbit);
+	}
+	m_pos = m_end = NULL;
+	if (eof())
+		m_is->setstate(std::ios::eofbit);
+}
+
+std::streamoff StreamReader::tell() const
+{
+	std::streamoff pos = stream_pos(m_is->rdbuf(), std::ios::in);
+	if (pos < 0)
+		return pos;
+	if (m_direct)
+		return pos + (m_pos == m_end);
+	return pos - (m_end - m_pos);
+}
+
+void count_bytes(Stats *stats, std::streamoff start, std::streamoff end)
+{
+	if (start >= 0 && end >= start) {
+		stats->bytes += end - start;
+	}
+}
+
+/* Estimates the heap usage of a string */
+void count_string(Stats *stats, const std::string &str)
+{
+	stats->string_bytes += str.size();
+	if (str.capacity() > 15) {
+		stats->allocs++;
+		stats->alloc_bytes += str.capacity() + 1;
+	}
+}
+
 /* Format a string, similar to sprintf() */
 const std::string strf(const char *fmt, ...)
 {
@@ -62,7 +357,35 @@ size_t encode_utf8(int c, uint8_t *buffer)
 	return 0;
 }
 
-static const char *type_names[] = {
+Stats::Stats()
+{
+	clear();
+}
+
+void Stats::clear()
+{
+	bytes = 0;
+	for (int i = 0; i < JSON_NUM_TYPES; ++i)
+		nodes[i] = 0;
+	space_bytes = 0;
+	string_bytes = 0;
+	escapes = 0;
+	number_bytes = 0;
+	max_depth = 0;
+	allocs = 0;
+	alloc_bytes = 0;
+	seeks = 0;
+	cached_writes = 0;
+	shape_hits = 0;
+	shape_misses = 0;
+	shared = 0;
+	load_time = 0;
+	skip_time = 0;
+	load_next_time = 0;
+	write_time = 0;
+}
+
+const char *type_names[] = {
 	"null",
 	"string",
 	"integer",
@@ -73,15 +396,49 @@ static const char *type_names[] = {
 	"lazy array",
 };
 
+Value Stats::to_json() const
+{
+	Value nodes_val(JSON_OBJECT);
+	for (int i = 0; i < JSON_NUM_TYPES; ++i)
+		nodes_val.set(type_names[i], double(nodes[i]));
+
+	Value val(JSON_OBJECT);
+	val.set("bytes", double(bytes));
+	val.set("nodes", nodes_val);
+	val.set("space_bytes", double(space_bytes));
+	val.set("string_bytes", double(string_bytes));
+	val.set("escapes", double(escapes));
+	val.set("number_bytes", double(number_bytes));
+	val.set("max_depth", max_depth);
+	val.set("allocs", double(allocs));
+	val.set("alloc_bytes", double(alloc_bytes));
+	val.set("seeks", double(seeks));
+	val.set("cached_writes", double(cached_writes));
+	val.set("shape_hits", double(shape_hits));
+	val.set("shape_misses", double(shape_misses));
+	if (shape_hits + shape_misses > 0)
+		val.set("shape_hit_rate",
+			double(shape_hits) / (shape_hits + shape_misses));
+	val.set("shared", double(shared));
+	val.set("load_time", load_time);
+	val.set("skip_time", skip_time);
+	val.set("load_next_time", load_next_time);
+	val.set("write_time", write_time);
+	return val;
+}
+
+uint64_t OutputCache::modifications = 0;
+
 Value::Value(Type type) :
-	m_type(type)
+	m_type(type), m_flags(0)
 {
+	OutputCache::modified();
 	switch (m_type) {
 	case JSON_OBJECT:
-		m_value.object = new object_map_t;
+		m_value.object = new ObjectContainer;
 		break;
 	case JSON_ARRAY:
-		m_value.array = new std::vector<Value>;
+		m_value.array = new ArrayContainer;
 		break;
 	case JSON_NULL:
 		break;
@@ -92,82 +449,125 @@ Value::Value(Type type) :
 }
 
 Value::Value(const std::string &s) :
-	m_type(JSON_STRING)
+	m_type(JSON_STRING), m_flags(0)
 {
+	OutputCache::modified();
 	m_value.string = new std::string(s);
 }
 
 Value::Value(const char *s) :
-	m_type(JSON_STRING)
+	m_type(JSON_STRING), m_flags(0)
 {
+	OutputCache::modified();
 	m_value.string = new std::string(s);
 }
 
 Value::Value(int i) :
-	m_type(JSON_INTEGER)
+	m_type(JSON_INTEGER), m_flags(0)
 {
+	OutputCache::modified();
 	m_value.integer = i;
 }
 
 Value::Value(double d) :
-	m_type(JSON_FLOATING)
+	m_type(JSON_FLOATING), m_flags(0)
 {
+	OutputCache::modified();
 	m_value.floating = d;
 }
 
 Value::Value(bool b) :
-	m_type(JSON_BOOLEAN)
+	m_type(JSON_BOOLEAN), m_flags(0)
 {
+	OutputCache::modified();
 	m_value.boolean = b;
 }
 
 Value::Value(const object_map_t &object) :
-	m_type(JSON_OBJECT)
+	m_type(JSON_OBJECT), m_flags(0)
 {
-	m_value.object = new object_map_t(object);
+	OutputCache::modified();
+	m_value.object = new ObjectContainer(object);
 }
 
 Value::Value(const std::vector<Value> &array) :
-	m_type(JSON_ARRAY)
+	m_type(JSON_ARRAY), m_flags(0)
 {
-	m_value.array = new std::vector<Value>(array);
+	OutputCache::modified();
+	m_value.array = new ArrayContainer(array);
 }
 
 Value::Value(const Value &from) :
-	m_type(JSON_NULL)
+	m_type(JSON_NULL), m_flags(0)
 {
 	*this = from;
 }
 
+#if __cplusplus >= 201103L
+Value::Value(Value &&from) noexcept :
+	m_type(JSON_NULL), m_flags(0)
+{
+	swap(from);
+}
+
+void Value::operator = (Value &&from) noexcept
+{
+	swap(from);
+}
+#endif
+
 Value::~Value()
 {
 	destroy();
 }
 
+void Value::swap(Value &other)
+{
+	OutputCache::modified();
+	std::swap(m_type, other.m_type);
+	std::swap(m_flags, other.m_flags);
+	std::swap(m_value, other.m_value);
+}
+
+/* Deletes the container when the last value that shares it is gone */
+template<class T>
+void release(Container<T> *container)
+{
+	/* nobody else can have a container that isn't shared */
+	if (__atomic_load_n(&container->refs, __ATOMIC_ACQUIRE) == 1 ||
+	    __atomic_sub_fetch(&container->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		delete container;
+}
+
 void Value::destroy()
 {
+	OutputCache::modified();
 	switch (m_type) {
 	case JSON_STRING:
 		delete m_value.string;
 		break;
 	case JSON_OBJECT:
-		delete m_value.object;
+		release(m_value.object);
 		break;
 	case JSON_ARRAY:
-		delete m_value.array;
+		release(m_value.array);
 		break;
 	case JSON_LAZY_ARRAY:
 		delete m_value.lazy;
 		break;
-	case JSON_NULL:
-	case JSON_BOOLEAN:
 	case JSON_INTEGER:
 	case JSON_FLOATING:
+		if (m_flags & RAW_NUMBER)
+			delete m_value.string;
+		break;
+	case JSON_NULL:
+	case JSON_BOOLEAN:
 		break;
 	default:
 		assert(0);
 	}
 	m_type = JSON_NULL;
+	m_flags = 0;
 }
 
 void Value::verify_type(Type expected) const
@@ -184,6 +584,11 @@ void Value::operator = (const Value &from)
 		return;
 	destroy();
 	m_type = from.m_type;
+	m_flags = from.m_flags;
+	if (m_flags & RAW_NUMBER) {
+		m_value.string = new std::string(*from.m_value.string);
+		return;
+	}
 	switch (m_type) {
 	case JSON_NULL:
 		break;
@@ -191,10 +596,10 @@ void Value::operator = (const Value &from)
 		m_value.string = new std::string(*from.m_value.string);
 		break;
 	case JSON_OBJECT:
-		m_value.object = new object_map_t(*from.m_value.object);
+		m_value.object = new ObjectContainer(from.m_value.object->items);
 		break;
 	case JSON_ARRAY:
-		m_value.array = new std::vector<Value>(*from.m_value.array);
+		m_value.array = new ArrayContainer(from.m_value.array->items);
 		break;
 	case JSON_INTEGER:
 		m_value.integer = from.m_value.integer;
@@ -213,6 +618,16 @@ void Value::operator = (const Value &from)
 	}
 }
 
+int64_t Value::raw_integer() const
+{
+	return strtoll(m_value.string->c_str(), NULL, 10);
+}
+
+double Value::raw_floating() const
+{
+	return strtod(m_value.string->c_str(), NULL);
+}
+
 Type cmp_type(Type type)
 {
 	if (type == JSON_INTEGER)
@@ -230,19 +645,27 @@ bool Value::operator == (const Value &other) const
 	case JSON_STRING:
 		return *m_value.string == *other.m_value.string;
 	case JSON_OBJECT:
-		return *m_value.object == *other.m_value.object;
+		if (m_value.object == other.m_value.object)
+			return true;
+		if (hashes_differ(*m_value.object, *other.m_value.object))
+			return false;
+		return m_value.object->items == other.m_value.object->items;
 	case JSON_ARRAY:
-		return *m_value.array == *other.m_value.array;
+		if (m_value.array == other.m_value.array)
+			return true;
+		if (hashes_differ(*m_value.array, *other.m_value.array))
+			return false;
+		return m_value.array->items == other.m_value.array->items;
 	case JSON_INTEGER:
 		if (other.m_type == JSON_INTEGER)
-			return m_value.integer == other.m_value.integer;
+			return as_int64() == other.as_int64();
 		else
-			return m_value.integer == other.m_value.floating;
+			return as_int64() == other.as_double();
 	case JSON_FLOATING:
 		if (other.m_type == JSON_INTEGER)
-			return m_value.floating == other.m_value.integer;
+			return as_double() == other.as_int64();
 		else
-			return m_value.floating == other.m_value.floating;
+			return as_double() == other.as_double();
 	case JSON_BOOLEAN:
 		return m_value.boolean == other.m_value.boolean;
 	default:
@@ -255,114 +678,377 @@ bool Value::operator != (const Value &other) const
 	return !(*this == other);
 }
 
-/* Skips over all spaces in the input. The stream can end up in EOF state. */
-int skip_space(std::istream &is)
+/*
+ * Skips over white space and comments. Returns the next character without
+ * consuming it, or EOF.
+ */
+int skip_space(Reader &in, Stats *stats)
 {
-	int c;
+	size_t count = 0;
 	while (1) {
-		c = is.peek();
-		while (isspace(c)) {
-			is.get();
-			c = is.peek();
-		}
-		if (c == '/') {
-			/* Skip over C++-style comments */
-			is.get();
-			if (is.get() != '/') {
-				throw decode_error("Expected '/'");
-			}
-			while (is.peek() != '\n' && !is.eof())
-				is.get();
-		} else
-			break;
+		const char *p = in.pos();
+		const char *end = in.end();
+		const char *start = p;
+		while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r')))
+			p++;
+		count += p - start;
+		in.advance(p);
+		if (p == end) {
+			if (!in.fill())
+				break;
+			continue;
+		}
+		if (*p != '/') {
+			STAT(stats, space_bytes += count);
+			return (uint8_t) *p;
+		}
+
+		/* Skip over C++-style comments */
+		in.get();
+		if (in.get() != '/') {
+			throw decode_error("Expected '/'");
+		}
+		count += 2;
+		int c = in.peek();
+		while (c != '\n' && c != EOF) {
+			in.get();
+			count++;
+			c = in.peek();
+		}
+	}
+	STAT(stats, space_bytes += count);
+	return EOF;
+}
+
+/* Reads the four hex digits of an \u escape */
+int load_hex4(Reader &in)
+{
+	int c = 0;
+	for (int i = 0; i < 4; ++i) {
+		int code = in.get();
+		int digit;
+		if (code >= '0' && code <= '9') {
+			digit = code - '0';
+		} else if (code >= 'a' && code <= 'f') {
+			digit = code - 'a' + 10;
+		} else if (code >= 'A' && code <= 'F') {
+			digit = code - 'A' + 10;
+		} else if (code == EOF) {
+			throw decode_error("Unexpected end of input");
+		} else {
+			throw decode_error("Invalid unicode");
+		}
+		c = c * 16 + digit;
 	}
 	return c;
 }
 
-std::string load_string(std::istream &is)
+/*
+ * Checks that the buffer is valid UTF-8: no overlong forms, surrogates,
+ * or code points above U+10FFFF. ASCII is skipped 16 bytes at a time.
+ */
+bool valid_utf8(const char *buf, size_t len)
+{
+	const uint8_t *p = (const uint8_t *) buf;
+	const uint8_t *end = p + len;
+	while (p < end) {
+#ifdef __SSE2__
+		while (end - p >= 16 &&
+		       !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p)))
+			p += 16;
+#endif
+		while (end - p >= 8) {
+			uint64_t word;
+			memcpy(&word, p, 8);
+			if (word & 0x8080808080808080ULL)
+				break;
+			p += 8;
+		}
+		while (p < end && *p < 0x80)
+			p++;
+		if (p == end)
+			break;
+
+		int len, c, min;
+		if ((*p & 0xE0) == 0xC0) {
+			len = 1;
+			c = *p & 0x1F;
+			min = 0x80;
+		} else if ((*p & 0xF0) == 0xE0) {
+			len = 2;
+			c = *p & 0x0F;
+			min = 0x800;
+		} else if ((*p & 0xF8) == 0xF0) {
+			len = 3;
+			c = *p & 0x07;
+			min = 0x10000;
+		} else {
+			return false;
+		}
+		if (end - p <= len)
+			return false;
+		for (int i = 1; i <= len; ++i) {
+			if ((p[i] & 0xC0) != 0x80)
+				return false;
+			c = (c << 6) | (p[i] & 0x3F);
+		}
+		if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+			return false;
+		p += len + 1;
+	}
+	return true;
+}
+
+/*
+ * A surrogate that is not a part of a pair can't be represented in
+ * UTF-8. It's an error in strict mode, otherwise it's passed through.
+ */
+void lone_surrogate(std::string &str, int c, bool strict)
+{
+	if (strict) {
+		throw decode_error("Invalid unicode surrogate");
+	}
+	uint8_t buffer[4];
+	size_t len = encode_utf8(c, buffer);
+	str.append((char *) buffer, len);
+}
+
+std::string load_string(Reader &in, bool strict, Stats *stats,
+			size_t max_length)
 {
 	std::string str;
-	int c = is.get();
-	while (c != '"') {
-		if (c == '\\') {
-			c = is.get();
-			if (is.eof()) {
+	int high = 0;		/* all bytes or-ed together */
+	int surrogate = 0;	/* pending high surrogate */
+	size_t limit = max_length ? max_length : size_t(-1);
+	while (1) {
+		/*
+		 * Copy plain characters directly from the window. A string
+		 * longer than LoadOptions::max_bytes is stopped at the limit.
+		 */
+		in.check_limit();
+		const char *start = in.pos();
+		const char *p = start;
+		const char *end = in.limit_end();
+		while (p < end && *p != '"' && *p != '\\' && uint8_t(*p) > 0x1F) {
+			high |= uint8_t(*p);
+			p++;
+		}
+		if (p > start) {
+			if (surrogate) {
+				lone_surrogate(str, surrogate, strict);
+				surrogate = 0;
+			}
+			str.append(start, p - start);
+			in.advance(p);
+			in.check_limit();
+			if (str.size() > limit) {
+				throw decode_error("String too long");
+			}
+		}
+		if (p == end) {
+			if (!in.fill()) {
 				throw decode_error("Unexpected end of input");
 			}
-			switch (c) {
-			case 'n':
-				c = '\n';
-				break;
-			case 'r':
-				c = '\r';
-				break;
-			case 't':
-				c = '\t';
-				break;
-			case 'f':
-				c = '\f';
-				break;
-			case 'b':
-				c = '\b';
-				break;
-			case '\\':
-			case '/':
-			case '"':
-				/* pass through */
-				break;
-			case 'u':
-				{
-					char code[5];
-					code[4] = 0;
-					is.read(code, 4);
-					if (is.eof()) {
-						throw decode_error("Unexpected end of input");
-					}
-					std::istringstream parser(code);
-					parser >> std::hex >> c;
-					if (!parser) {
-						throw decode_error("Invalid unicode");
-					}
-					parser.get();
-					if (!parser.eof()) {
-						throw decode_error("Invalid unicode");
-					}
-				}
-				break;
-			default:
-				throw decode_error("Unknown character entity");
+			continue;
+		}
+
+		int c = in.get();
+		if (c == '"') {
+			break;
+		} else if (c != '\\') {
+			throw decode_error("Control character in a string");
+		}
+		c = in.get();
+		switch (c) {
+		case 'n':
+			c = '\n';
+			break;
+		case 'r':
+			c = '\r';
+			break;
+		case 't':
+			c = '\t';
+			break;
+		case 'f':
+			c = '\f';
+			break;
+		case 'b':
+			c = '\b';
+			break;
+		case '\\':
+		case '/':
+		case '"':
+			/* pass through */
+			break;
+		case 'u':
+			c = load_hex4(in);
+			break;
+		case EOF:
+			throw decode_error("Unexpected end of input");
+		default:
+			throw decode_error("Unknown character entity");
+		}
+		STAT(stats, escapes++);
+		if (surrogate) {
+			if (c >= 0xDC00 && c <= 0xDFFF) {
+				/* combine the pair */
+				c = 0x10000 + ((surrogate - 0xD800) << 10) +
+					(c - 0xDC00);
+			} else {
+				lone_surrogate(str, surrogate, strict);
 			}
+			surrogate = 0;
+		}
+		if (c >= 0xD800 && c <= 0xDBFF) {
+			surrogate = c;
+		} else if (c >= 0xDC00 && c <= 0xDFFF) {
+			lone_surrogate(str, c, strict);
+		} else {
 			uint8_t buffer[4];
 			size_t len = encode_utf8(c, buffer);
 			str.append((char *) buffer, len);
-		} else if (is.eof()) {
-			throw decode_error("Unexpected end of input");
-		} else if (c >= 0 && c <= 0x1F) {
-			 throw decode_error("Control character in a string");
-		} else {
-			/* assume input is UTF-8 and pass through unmodified */
-			str += char(c);
 		}
-		c = is.get();
+		if (str.size() > limit) {
+			throw decode_error("String too long");
+		}
+	}
+	if (surrogate) {
+		lone_surrogate(str, surrogate, strict);
+	}
+	if (str.size() > limit) {
+		throw decode_error("String too long");
+	}
+	if (strict && (high & 0x80) && !valid_utf8(str.data(), str.size())) {
+		throw decode_error("Invalid UTF-8");
 	}
+#ifndef CPPJSON_NO_STATS
+	if (stats)
+		count_string(stats, str);
+#endif
 	return str;
 }
 
-void skip_string(std::istream &is)
+/*
+ * Checks the syntax of a number: an optional minus, digits, an optional
+ * fraction and an exponent. Integers must fit in 64 bits.
+ */
+bool valid_number(const char *buf, size_t len, bool *is_float)
+{
+	size_t i = 0;
+	if (i < len && buf[i] == '-')
+		i++;
+	size_t digits = i;
+	while (i < len && buf[i] >= '0' && buf[i] <= '9')
+		i++;
+	if (i == digits)
+		return false;
+	*is_float = false;
+	if (i < len && buf[i] == '.') {
+		*is_float = true;
+		i++;
+		while (i < len && buf[i] >= '0' && buf[i] <= '9')
+			i++;
+	}
+	if (i < len && buf[i] == 'e') {
+		*is_float = true;
+		i++;
+		if (i < len && (buf[i] == '-' || buf[i] == '+'))
+			i++;
+		digits = i;
+		while (i < len && buf[i] >= '0' && buf[i] <= '9')
+			i++;
+		if (i == digits)
+			return false;
+	}
+	if (i != len)
+		return false;
+	if (!*is_float && len > 18) {
+		std::string str(buf, len);
+		errno = 0;
+		strtoll(str.c_str(), NULL, 10);
+		if (errno == ERANGE)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Skips a string after the opening quote, validating the escapes like
+ * load_string(). The contents are written to 'copy' as they are in the
+ * input, escapes included, unless it's NULL.
+ */
+void skip_string(Reader &in, BlockOutput *copy)
 {
-	int c = is.get();
-	while (c != '"') {
-		if (c == '\\') {
-			c = is.get();
-			if (is.eof()) {
+	while (1) {
+		const char *start = in.pos();
+		const char *p = start;
+		const char *end = in.end();
+#ifdef __SSE2__
+		const __m128i quote = _mm_set1_epi8('"');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		const __m128i control = _mm_set1_epi8(0x1F);
+		while (end - p >= 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *) p);
+			__m128i special = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+					     _mm_cmpeq_epi8(v, backslash)),
+				_mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+			if (_mm_movemask_epi8(special))
+				break;
+			p += 16;
+		}
+#endif
+		while (p < end && *p != '"' && *p != '\\' && uint8_t(*p) > 0x1F)
+			p++;
+		if (copy)
+			copy->write(start, p - start);
+		in.advance(p);
+		if (p == end) {
+			if (!in.fill()) {
 				throw decode_error("Unexpected end of input");
 			}
-		} else if (is.eof()) {
+			continue;
+		}
+		int c = in.get();
+		if (c == '"') {
+			break;
+		} else if (c != '\\') {
+			throw decode_error("Control character in a string");
+		}
+		c = in.get();
+		switch (c) {
+		case 'n':
+		case 'r':
+		case 't':
+		case 'f':
+		case 'b':
+		case '\\':
+		case '/':
+		case '"':
+		case 'u':
+			break;
+		case EOF:
 			throw decode_error("Unexpected end of input");
-		} else if (c >= 0 && c <= 0x1F) {
-			 throw decode_error("Control character in a string");
+		default:
+			throw decode_error("Unknown character entity");
+		}
+		if (copy) {
+			copy->put('\\');
+			copy->put(c);
+		}
+		if (c != 'u')
+			continue;
+		for (int i = 0; i < 4; ++i) {
+			c = in.get();
+			if (c == EOF) {
+				throw decode_error("Unexpected end of input");
+			}
+			if (!isxdigit(c)) {
+				throw decode_error("Invalid unicode");
+			}
+			if (copy)
+				copy->put(c);
 		}
-		c = is.get();
 	}
 }
 
@@ -404,32 +1090,53 @@ void encode_string(std::ostream &os, const std::string &str)
 	os.put('"');
 }
 
-void match(std::istream &is, const char *word, size_t len)
+void match(Reader &in, const char *word, size_t len)
 {
-	char buf[10];
-	is.read(buf, len);
-	if (is.eof()) {
-		throw decode_error("Unexpected end of input");
+	for (size_t i = 0; i < len; ++i) {
+		int c = in.get();
+		if (c == EOF) {
+			throw decode_error("Unexpected end of input");
+		}
+		if (c != word[i]) {
+			throw decode_error("Unknown keyword in input");
+		}
 	}
-	if (memcmp(buf, word, len) != 0) {
+
+	int c = in.peek();
+	if (c >= 'a' && c <= 'z') {
 		throw decode_error("Unknown keyword in input");
 	}
+}
 
-	int c = is.peek();
-	if (!is.eof() && (c >= 'a' && c <= 'z')) {
-		throw decode_error("Unknown keyword in input");
+/* Skips the rest of a number after the first character */
+void skip_number(Reader &in)
+{
+	int c = in.peek();
+	while ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == '-' ||
+	       c == '+') {
+		in.get();
+		c = in.peek();
+	}
+}
+
+void skip_bytes(Reader &in, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (in.get() == EOF) {
+			throw decode_error("Unexpected end of input");
+		}
 	}
 }
 
 /* Quickly skips an array (with less validation) */
-void skip_array(std::istream &is)
+void skip_array(Reader &in, Stats *stats)
 {
+	STAT_TIMER(stats, skip_time);
 	int depth = 1;
-	char dummy[10];
 
 	while (depth > 0) {
-		skip_space(is);
-		int c = is.get();
+		skip_space(in, stats);
+		int c = in.get();
 		switch (c) {
 		case '{':
 		case '[':
@@ -446,44 +1153,28 @@ void skip_array(std::istream &is)
 			break;
 
 		case '"':
-			skip_string(is);
+			skip_string(in);
 			break;
 
 		case 't':
 			/* true */
-			is.read(dummy, 3);
-			if (is.eof()) {
-				throw decode_error("Unexpected end of input");
-			}
+			skip_bytes(in, 3);
 			break;
 
 		case 'f':
 			/* false */
-			is.read(dummy, 4);
-			if (is.eof()) {
-				throw decode_error("Unexpected end of input");
-			}
+			skip_bytes(in, 4);
 			break;
 
 		case 'n':
 			/* null */
-			is.read(dummy, 3);
-			if (is.eof()) {
-				throw decode_error("Unexpected end of input");
-			}
+			skip_bytes(in, 3);
 			break;
 
 		default:
 			if ((c >= '0' && c <= '9') || c == '-') {
-				/* Skip over a number */
-				c = is.peek();
-				while (!is.eof() && ((c >= '0' && c <= '9') ||
-						c == '.' || c == 'e' ||
-						c == '-' || c == '+')) {
-					is.get();
-					c = is.peek();
-				}
-			} else if (is.eof()) {
+				skip_number(in);
+			} else if (c == EOF) {
 				throw decode_error("Unexpected end of input");
 			} else {
 				throw decode_error("Unknown character in input");
@@ -492,215 +1183,916 @@ void skip_array(std::istream &is)
 	}
 }
 
-Value Value::load_next(bool *end, bool lazy)
+/* Skips over any value */
+void skip_value(Reader &in, Stats *stats)
 {
-	verify_type(JSON_LAZY_ARRAY);
-
-	std::istream *is = m_value.lazy->is;
-	/*
-	 * Avoid seek, because GNU libstdc++ discards the contents of internal
-	 * buffer when file pointer changes.
-	 */
-	if (m_value.lazy->offset != is->tellg()) {
-		/* tellg() sets the stream state to bad. Clear it */
-		is->clear();
-		is->seekg(m_value.lazy->offset);
+	int c = skip_space(in, stats);
+	in.get();
+	switch (c) {
+	case '{':
+	case '[':
+		skip_array(in, stats);
+		break;
+	case '"':
+		skip_string(in);
+		break;
+	case 't':
+		match(in, "rue", 3);
+		break;
+	case 'f':
+		match(in, "alse", 4);
+		break;
+	case 'n':
+		match(in, "ull", 3);
+		break;
+	default:
+		if ((c >= '0' && c <= '9') || c == '-') {
+			skip_number(in);
+		} else if (c == EOF) {
+			throw decode_error("Unexpected end of input");
+		} else {
+			throw decode_error("Unknown character in input");
+		}
 	}
+}
 
-	Value val;
+/*
+ * Loads an object key after the opening quote. If the cached key is next
+ * in the input, it's consumed with the closing quote and true is returned
+ * without filling 'key'.
+ */
+bool load_key(Decoder &dec, const std::string *cached, std::string &key)
+{
+	if (cached != NULL) {
+		Reader &in = dec.in;
+		size_t len = cached->size();
+		size_t i = 0;
+		if (size_t(in.end() - in.pos()) > len &&
+		    memcmp(in.pos(), cached->data(), len) == 0) {
+			/* the whole key is in the window */
+			i = len;
+			in.advance(in.pos() + len);
+		} else {
+			while (i < len && in.peek() == (uint8_t) (*cached)[i]) {
+				in.get();
+				i++;
+			}
+		}
+		if (i == len && in.peek() == '"') {
+			in.get();
+			STAT(dec.stats, shape_hits++);
+#ifndef CPPJSON_NO_STATS
+			if (dec.stats)
+				count_string(dec.stats, *cached);
+#endif
+			return true;
+		}
+		/* the bytes that matched were plain characters */
+		if (i > 0) {
+			key.assign(*cached, 0, i);
+			STAT(dec.stats, string_bytes += i);
+			key += load_string(dec.in, dec.options.strict_utf8,
+					   dec.stats, dec.options.max_string_length);
+			if (dec.options.max_string_length &&
+			    key.size() > dec.options.max_string_length) {
+				throw decode_error("String too long");
+			}
+			return false;
+		}
+	}
+	key = load_string(dec.in, dec.options.strict_utf8, dec.stats,
+			  dec.options.max_string_length);
+	return false;
+}
 
-	int c = skip_space(*is);
+bool cacheable_key(const std::string &key)
+{
+	if (key.size() > MAX_SHAPE_KEY_LEN)
+		return false;
+	for (size_t i = 0; i < key.size(); ++i) {
+		uint8_t c = key[i];
+		if (c < 0x20 || c >= 0x7F || c == '"' || c == '\\')
+			return false;
+	}
+	return true;
+}
+
+/* Appends the key to the shape, if the shape is still being recorded */
+void record_key(Shape &shape, size_t index, const std::string &key,
+		object_map_t::iterator it)
+{
+	if (shape.keys.size() != index || index >= MAX_SHAPE_KEYS ||
+	    !cacheable_key(key))
+		return;
+	int next = -1;
+	for (size_t i = 0; i < index; ++i) {
+		if (shape.keys[i] > key &&
+		    (next < 0 || shape.keys[i] < shape.keys[next]))
+			next = i;
+	}
+	shape.keys.push_back(key);
+	shape.next.push_back(next);
+	shape.its.push_back(it);
+}
+
+/*
+ * Loads the next element of an array. Returns false at the end of the
+ * array, ']' is left in the input.
+ */
+bool load_element(Decoder &dec, Value &val)
+{
+	Reader &in = dec.in;
+	int c = skip_space(in, dec.stats);
 	if (c == ']') {
-		/* End of the list, return null */
-		if (end != NULL) {
-			*end = true;
-		}
+		return false;
+	}
+	if (dec.table != NULL) {
+		shred_row(dec, *dec.table);
 	} else {
-		if (end != NULL) {
-			*end = false;
-		}
-		val.load(*is, lazy);
+		val.load(dec);
+	}
 
-		c = skip_space(*is);
-		if (c == ',') {
-			is->get();
-		} else if (c != ']') {
-			throw decode_error("Expected ',' or ']'");
-		}
+	c = skip_space(in, dec.stats);
+	if (c == ',') {
+		in.get();
+	} else if (c != ']') {
+		throw decode_error("Expected ',' or ']'");
+	}
+	return true;
+}
+
+Value Value::load_next(bool *end, bool lazy, Stats *stats)
+{
+	Value val;
+	bool found = next(val, lazy, stats, NULL);
+	if (end != NULL) {
+		*end = !found;
 	}
-	m_value.lazy->offset = is->tellg();
 	return val;
 }
 
-void Value::load(std::istream &is, bool lazy)
+/*
+ * Loads the next element of a lazy array to 'val', or passes it to the
+ * table. Returns false at the end of the array.
+ */
+bool Value::next(Value &val, bool lazy, Stats *stats, Table *table)
 {
-	destroy();
+	verify_type(JSON_LAZY_ARRAY);
+	STAT_TIMER(stats, load_next_time);
 
-	/*
-	 * Note, we take adventage of the fact that when EOF is reached,
-	 * peek() and get() returns a special value that doesn't match
-	 * anything else.
-	 */
-	skip_space(is);
-	int c = is.get();
-	switch (c) {
-	case '{':
-		m_type = JSON_OBJECT;
-		m_value.object = new object_map_t;
-		skip_space(is);
-		c = is.get();
-		while (c != '}') {
-			std::string key;
-			if (c == '"') {
-				key = load_string(is);
-			} else if (is.eof()) {
-				throw decode_error("Unexpected end of input");
-			} else {
-				throw decode_error("Expected '}' or a string");
-			}
-			skip_space(is);
-			if (is.get() != ':') {
-				throw decode_error("Expected ':'");
-			}
+	LazyArray *array = m_value.lazy;
+	std::istream *is = array->is;
+	LoadOptions options = array->options;
+	options.lazy = lazy;
+	options.stats = stats;
+	if (options.cache_shapes && array->shapes == NULL) {
+		array->shapes = new ShapeCache;
+	}
+	ShareTable shares;
+
+	if (array->forward) {
+		Decoder dec(*is, options);
+		dec.table = table;
+		dec.shapes = array->shapes;
+		if (options.share_subtrees)
+			dec.shares = &shares;
+		dec.schema = array->schema;
+		if (!array->done) {
 			/*
-			 * To avoid a copy, first insert an empty value to
-			 * the container and then load it from the input.
+			 * The separator after the previous element is consumed
+			 * only now, because the element might have been a lazy
+			 * array that was iterated after it was returned.
 			 */
-			std::pair<object_map_t::iterator, bool> res =
-				m_value.object->insert(std::make_pair(key, Value()));
-			if (!res.second) {
-				throw decode_error("Duplicate key in object");
-			}
-			res.first->second.load(is, lazy);
-
-			c = skip_space(is);
-			if (c == ',') {
-				is.get();
-				skip_space(is);
-			} else if (c != '}') {
-				throw decode_error("Expected ',' or '}'");
-			}
-			c = is.get();
-		}
-		break;
-
-	case '[':
-		if (lazy) {
-			m_type = JSON_LAZY_ARRAY;
-			m_value.lazy = new LazyArray;
-			m_value.lazy->is = &is;
-			m_value.lazy->offset = is.tellg();
-			skip_array(is);
-		} else {
-			m_type = JSON_ARRAY;
-			m_value.array = new std::vector<Value>;
-			c = skip_space(is);
-			while (c != ']') {
-				m_value.array->push_back(Value());
-				m_value.array->back().load(is, lazy);
-
-				c = skip_space(is);
+			Reader &in = dec.in;
+			int c = skip_space(in, stats);
+			if (array->separator) {
 				if (c == ',') {
-					is.get();
-					c = skip_space(is);
+					in.get();
+					c = skip_space(in, stats);
 				} else if (c != ']') {
 					throw decode_error("Expected ',' or ']'");
 				}
 			}
-			is.get();
+			if (c == ']') {
+				in.get();
+				array->done = true;
+				if (array->check_end &&
+				    skip_space(in, stats) != EOF) {
+					throw decode_error("Left over data in input");
+				}
+			} else if (table != NULL) {
+				shred_row(dec, *table);
+				array->separator = true;
+			} else {
+				val.load(dec);
+				array->separator = true;
+			}
 		}
-		break;
+		return !array->done;
+	}
 
-	case '"':
-		m_value.string = new std::string(load_string(is));
-		m_type = JSON_STRING;
-		break;
+	if (options.read_ahead > 0) {
+		/*
+		 * Every array reads through a window of its own, so that
+		 * iterating several arrays alternately doesn't need a seek
+		 * for every element.
+		 */
+		if (array->window == NULL) {
+			/* a small array doesn't need the whole window */
+			size_t size = options.read_ahead;
+			if (array->end != std::streampos(-1) &&
+			    array->end - array->offset < std::streamoff(size))
+				size = array->end - array->offset;
+			array->window = new Window(is, size);
+		}
+		array->window->buf.reset(array->offset);
+		array->window->is.clear();
+		Decoder dec(array->window->is, options);
+		dec.origin = is;
+		dec.table = table;
+		dec.shapes = array->shapes;
+		if (options.share_subtrees)
+			dec.shares = &shares;
+		dec.schema = array->schema;
 
-	case 't':
-		match(is, "rue", 3);
-		m_type = JSON_BOOLEAN;
-		m_value.boolean = true;
-		break;
+#ifndef CPPJSON_NO_STATS
+		size_t refills = array->window->buf.refills();
+#endif
+		bool found = load_element(dec, val);
+		STAT(stats, seeks += array->window->buf.refills() - refills);
+		std::streampos offset = dec.in.tell();
+#ifndef CPPJSON_NO_STATS
+		if (stats)
+			count_bytes(stats, array->offset, offset);
+#endif
+		array->offset = offset;
+		return found;
+	}
 
-	case 'f':
-		match(is, "alse", 4);
-		m_type = JSON_BOOLEAN;
-		m_value.boolean = false;
-		break;
+	/*
+	 * Avoid seek, because GNU libstdc++ discards the contents of internal
+	 * buffer when file pointer changes.
+	 */
+	if (array->offset != is->tellg()) {
+		/* tellg() sets the stream state to bad. Clear it */
+		is->clear();
+		is->seekg(array->offset);
+		STAT(stats, seeks++);
+	}
 
-	case 'n':
-		match(is, "ull", 3);
-		m_type = JSON_NULL;
-		break;
+	/* At the end of the list, return null */
+	Decoder dec(*is, options);
+	dec.table = table;
+	dec.shapes = array->shapes;
+	if (options.share_subtrees)
+		dec.shares = &shares;
+	dec.schema = array->schema;
+	bool found = load_element(dec, val);
+	std::streampos offset = dec.in.tell();
+#ifndef CPPJSON_NO_STATS
+	if (stats)
+		count_bytes(stats, array->offset, offset);
+#endif
+	array->offset = offset;
+	return found;
+}
 
-	default:
-		if ((c >= '0' && c <= '9') || c == '-') {
-			/*
-			 * We need first to parse the number to a buffer to
-			 * decide if it's a float or an intger.
-			 */
-			bool is_float = false;
-			std::string str;
-			str += char(c);
-			c = is.peek();
-			while (!is.eof() && ((c >= '0' && c <= '9') ||
-					c == '.' || c == 'e' ||
-					c == '-' || c == '+')) {
-				if (c == '.' || c == 'e') {
-					is_float = true;
+/* Creates a lazy array that continues from the offset */
+Value Value::lazy_array(std::istream &is, std::streampos offset,
+			const LoadOptions &options)
+{
+	Value val;
+	val.m_type = JSON_LAZY_ARRAY;
+	val.m_value.lazy = new LazyArray;
+	val.m_value.lazy->is = &is;
+	val.m_value.lazy->offset = offset;
+	val.m_value.lazy->options = options;
+	val.m_value.lazy->options.stats = NULL;
+	/* the elements of the outermost array */
+	const SchemaNode *root = Decoder(is, options).schema;
+	val.m_value.lazy->schema = root ? root->items : NULL;
+	val.m_value.lazy->forward = false;
+	val.m_value.lazy->separator = false;
+	val.m_value.lazy->done = false;
+	val.m_value.lazy->check_end = false;
+	return val;
+}
+
+/*
+ * Decides if an array is loaded lazily, and returns the offset of its
+ * contents. Streams that can't seek (pipes, sockets) can only be iterated
+ * forward. That works only when the array is the outermost value, so
+ * nested arrays are loaded in that case.
+ */
+bool load_lazily(Decoder &dec, std::streampos *offset)
+{
+	*offset = -1;
+	if (!dec.options.lazy)
+		return false;
+	if (dec.origin == NULL) {
+		throw std::invalid_argument("Lazy arrays need a std::istream");
+	}
+	if (!dec.options.forward_only)
+		*offset = dec.in.tell();
+	if (*offset == std::streampos(-1))
+		return dec.depth == 1;
+	return true;
+}
+
+void Value::load(std::istream &is, bool lazy, Stats *stats)
+{
+	LoadOptions options;
+	options.lazy = lazy;
+	options.stats = stats;
+	load(is, options);
+}
+
+void Value::load(std::istream &is, const LoadOptions &options)
+{
+	Decoder dec(is, options);
+	load_document(dec, false);
+}
+
+/* Loads the first value of the input, or all of it */
+void Value::load_document(Decoder &dec, bool all)
+{
+	ShapeCache shapes;
+	if (dec.options.cache_shapes)
+		dec.shapes = &shapes;
+	ShareTable shares;
+	if (dec.options.share_subtrees)
+		dec.shares = &shares;
+	Stats *stats = dec.stats;
+	STAT_TIMER(stats, load_time);
+#ifndef CPPJSON_NO_STATS
+	std::streamoff start = -1;
+	if (stats)
+		start = dec.in.tell();
+#endif
+	load(dec);
+#ifndef CPPJSON_NO_STATS
+	if (stats)
+		count_bytes(stats, start, dec.in.tell());
+#endif
+	if (!all)
+		return;
+	if (m_type == JSON_LAZY_ARRAY && m_value.lazy->forward) {
+		/* checked when the iteration reaches the end */
+		m_value.lazy->check_end = true;
+		return;
+	}
+	if (skip_space(dec.in, stats) != EOF) {
+		throw decode_error("Left over data in input");
+	}
+}
+
+Decoder::Decoder(std::istream &_is, const LoadOptions &_options) :
+	stream(&_is), in(stream), origin(&_is), options(_options),
+	stats(_options.stats), depth(0), table(NULL), shapes(NULL),
+	shares(NULL),
+	schema(_options.schema ? _options.schema->m_root : NULL), values(0)
+{
+	saved_limit = in.set_limit(options.max_bytes ?
+				   in.consumed() + options.max_bytes : 0);
+}
+
+Decoder::Decoder(Reader &_in, const LoadOptions &_options) :
+	stream(NULL), in(_in), origin(NULL), options(_options),
+	stats(_options.stats), depth(0), table(NULL), shapes(NULL),
+	shares(NULL),
+	schema(_options.schema ? _options.schema->m_root : NULL), values(0)
+{
+	saved_limit = in.set_limit(options.max_bytes ?
+				   in.consumed() + options.max_bytes : 0);
+}
+
+Decoder::~Decoder()
+{
+	in.set_limit(saved_limit);
+}
+
+void Decoder::begin_value()
+{
+	values++;
+	if (options.max_elements && values > options.max_elements) {
+		throw decode_error("Too many elements in input");
+	}
+	check_bytes();
+}
+
+void Decoder::begin_container()
+{
+	if (options.max_depth && depth > options.max_depth) {
+		throw decode_error("Input is nested too deeply");
+	}
+	check_bytes();
+}
+
+void Decoder::check_bytes()
+{
+	in.check_limit();
+}
+
+namespace {
+
+/* An object or an array that is being loaded */
+struct Frame {
+	Value *val;
+	const SchemaNode *schema;
+	int depth;
+	size_t count;		/* keys of an object so far */
+	bool on_shape;		/* the keys so far match the shape */
+};
+
+/*
+ * Open containers of Value::load(). The first levels are kept in place,
+ * so that loading a shallow value doesn't allocate.
+ */
+class FrameStack {
+public:
+	FrameStack() :
+		m_size(0)
+	{}
+
+	bool empty() const { return m_size == 0; }
+	Frame &back()
+	{
+		return m_size <= FIXED ? m_fixed[m_size - 1] :
+			m_more[m_size - FIXED - 1];
+	}
+	Frame &push()
+	{
+		m_size++;
+		if (m_size <= FIXED)
+			return m_fixed[m_size - 1];
+		if (m_more.size() < m_size - FIXED)
+			m_more.push_back(Frame());
+		return m_more[m_size - FIXED - 1];
+	}
+	void pop()
+	{
+		m_size--;
+	}
+
+private:
+	enum { FIXED = 16 };
+	Frame m_fixed[FIXED];
+	std::vector<Frame> m_more;
+	size_t m_size;
+
+	FrameStack(const FrameStack &);
+	void operator = (const FrameStack &);
+};
+
+}
+
+/*
+ * Loads a value with an explicit stack instead of recursion, so that
+ * deeply nested input can't overflow the C++ stack. Each round of the
+ * loop parses one value, and then continues the innermost open container
+ * until it has another value to parse.
+ */
+void Value::load(Decoder &dec)
+{
+	Reader &in = dec.in;
+	Stats *stats = dec.stats;
+	FrameStack stack;
+	Value *val = this;
+	const SchemaNode *schema = dec.schema;
+	std::streampos offset;
+
+	while (1) {
+		val->destroy();
+		dec.depth++;
+		STAT(stats, max_depth = std::max(stats->max_depth, dec.depth));
+		dec.begin_value();
+
+		/*
+		 * Note, we take adventage of the fact that when EOF is reached,
+		 * peek() and get() returns a special value that doesn't match
+		 * anything else.
+		 */
+		skip_space(in, stats);
+		int c = in.get();
+		if (schema != NULL)
+			schema->check_start(in, c);
+		bool opened = false;
+		switch (c) {
+		case '{':
+			dec.begin_container();
+			val->m_type = JSON_OBJECT;
+			val->m_value.object = new ObjectContainer;
+			STAT(stats, allocs++);
+			STAT(stats, alloc_bytes += sizeof(ObjectContainer));
+			if (dec.shapes != NULL && dec.shapes->size() <= size_t(dec.depth))
+				dec.shapes->resize(dec.depth + 1);
+			opened = true;
+			break;
+
+		case '[':
+			if (load_lazily(dec, &offset)) {
+				val->m_type = JSON_LAZY_ARRAY;
+				LazyArray *lazy = new LazyArray;
+				val->m_value.lazy = lazy;
+				STAT(stats, allocs++);
+				STAT(stats, alloc_bytes += sizeof(LazyArray));
+				lazy->is = dec.origin;
+				lazy->offset = offset;
+				lazy->options = dec.options;
+				lazy->options.stats = NULL;
+				lazy->forward = offset == std::streampos(-1);
+				lazy->separator = false;
+				lazy->done = false;
+				lazy->check_end = false;
+				lazy->schema = schema ? schema->items : NULL;
+				if (!lazy->forward) {
+					skip_array(in, stats);
+					lazy->end = in.tell();
 				}
-				str += char(c);
-				is.get();
-				c = is.peek();
+			} else {
+				dec.begin_container();
+				val->m_type = JSON_ARRAY;
+				val->m_value.array = new ArrayContainer;
+				STAT(stats, allocs++);
+				STAT(stats, alloc_bytes += sizeof(ArrayContainer));
+				opened = true;
 			}
-			std::istringstream parser(str);
-			if (is_float) {
-				m_type = JSON_FLOATING;
-				parser >> m_value.floating;
+			break;
+
+		case '"':
+			val->m_value.string = new std::string(load_string(in,
+					dec.options.strict_utf8, stats,
+					dec.options.max_string_length));
+			val->m_type = JSON_STRING;
+			STAT(stats, allocs++);
+			STAT(stats, alloc_bytes += sizeof(std::string));
+			break;
+
+		case 't':
+			match(in, "rue", 3);
+			val->m_type = JSON_BOOLEAN;
+			val->m_value.boolean = true;
+			break;
+
+		case 'f':
+			match(in, "alse", 4);
+			val->m_type = JSON_BOOLEAN;
+			val->m_value.boolean = false;
+			break;
+
+		case 'n':
+			match(in, "ull", 3);
+			val->m_type = JSON_NULL;
+			break;
+
+		default:
+			if ((c >= '0' && c <= '9') || c == '-') {
+				/*
+				 * We need first to parse the number to a buffer
+				 * to decide if it's a float or an intger.
+				 */
+				size_t limit = dec.options.max_string_length;
+				bool is_float = false;
+				std::string str;
+				str += char(c);
+				c = in.peek();
+				while ((c >= '0' && c <= '9') || c == '.' ||
+				       c == 'e' || c == '-' || c == '+') {
+					if (c == '.' || c == 'e') {
+						is_float = true;
+					}
+					if (limit && str.size() >= limit) {
+						throw decode_error("Number too long");
+					}
+					str += char(c);
+					in.get();
+					c = in.peek();
+				}
+				STAT(stats, number_bytes += str.size());
+				if (dec.options.raw_numbers) {
+					if (!valid_number(str.data(), str.size(),
+							  &is_float)) {
+						throw decode_error("Invalid number");
+					}
+					val->m_type = is_float ? JSON_FLOATING :
+						JSON_INTEGER;
+					val->m_flags = RAW_NUMBER;
+					val->m_value.string = new std::string;
+					val->m_value.string->swap(str);
+					STAT(stats, allocs++);
+					STAT(stats, alloc_bytes += sizeof(std::string));
+					break;
+				}
+				std::istringstream parser(str);
+				if (is_float) {
+					val->m_type = JSON_FLOATING;
+					parser >> val->m_value.floating;
+				} else {
+					val->m_type = JSON_INTEGER;
+					parser >> val->m_value.integer;
+				}
 				if (!parser) {
 					throw decode_error("Invalid number");
 				}
-			} else {
-				m_type = JSON_INTEGER;
-				parser >> m_value.integer;
-				if (!parser) {
+				parser.get();
+				if (!parser.eof()) {
 					throw decode_error("Invalid number");
 				}
+			} else if (c == EOF) {
+				throw decode_error("Unexpected end of input");
+			} else {
+				throw decode_error("Unknown character in input");
 			}
-			parser.get();
-			if (!parser.eof()) {
-				throw decode_error("Invalid number");
-			}
-		} else if (is.eof()) {
-			throw decode_error("Unexpected end of input");
+		}
+
+		if (opened) {
+			Frame &frame = stack.push();
+			frame.val = val;
+			frame.schema = schema;
+			frame.depth = dec.depth;
+			frame.count = 0;
+			frame.on_shape = true;
 		} else {
-			throw decode_error("Unknown character in input");
+			/* the value is complete */
+			if (schema != NULL)
+				schema->check_value(in, *val);
+			STAT(stats, nodes[val->m_type]++);
+			dec.depth--;
+		}
+
+		/* continue the open containers until there's a value to load */
+		while (1) {
+			if (stack.empty())
+				return;
+			Frame &frame = stack.back();
+			Value *container = frame.val;
+			if (container->m_type == JSON_OBJECT) {
+				/*
+				 * While the keys match the shape of the previous
+				 * object, they are inserted with a hint and can't
+				 * be duplicates.
+				 */
+				Shape *shape = NULL;
+				if (dec.shapes != NULL)
+					shape = &(*dec.shapes)[frame.depth];
+				if (!opened) {
+					c = skip_space(in, stats);
+					if (c == ',') {
+						in.get();
+						skip_space(in, stats);
+					} else if (c != '}') {
+						throw decode_error("Expected ',' or '}'");
+					}
+				} else {
+					skip_space(in, stats);
+				}
+				c = in.get();
+				if (c != '}') {
+					const std::string *cached = NULL;
+					if (shape != NULL && frame.on_shape &&
+					    frame.count < shape->keys.size())
+						cached = &shape->keys[frame.count];
+					std::string key;
+					bool hit = false;
+					if (c == '"') {
+						hit = load_key(dec, cached, key);
+					} else if (c == EOF) {
+						throw decode_error("Unexpected end of input");
+					} else {
+						throw decode_error("Expected '}' or a string");
+					}
+					skip_space(in, stats);
+					if (in.get() != ':') {
+						throw decode_error("Expected ':'");
+					}
+					/*
+					 * To avoid a copy, first insert an empty
+					 * value to the container and then load it
+					 * from the input.
+					 */
+					object_map_t &items =
+						container->m_value.object->items;
+					object_map_t::iterator it;
+					if (hit) {
+						int next = shape->next[frame.count];
+						it = items.insert(next < 0 ? items.end() :
+							shape->its[next],
+							std::make_pair(*cached, Value()));
+						shape->its[frame.count] = it;
+					} else {
+						std::pair<object_map_t::iterator, bool> res =
+							items.insert(std::make_pair(key, Value()));
+						if (!res.second) {
+							throw decode_error("Duplicate key in object");
+						}
+						it = res.first;
+						if (shape != NULL) {
+							STAT(stats, shape_misses++);
+							if (frame.on_shape) {
+								shape->truncate(frame.count);
+								frame.on_shape = false;
+							}
+							record_key(*shape, frame.count,
+								   key, it);
+						}
+					}
+					frame.count++;
+					/* tree node with the key and the value */
+					STAT(stats, allocs++);
+					STAT(stats, alloc_bytes += 4 * sizeof(void *) +
+					     sizeof(object_map_t::value_type));
+					val = &it->second;
+					schema = frame.schema ?
+						frame.schema->property(it->first) : NULL;
+					break;
+				}
+				/* the object had fewer keys */
+				if (shape != NULL && frame.on_shape &&
+				    frame.count < shape->keys.size())
+					shape->truncate(frame.count);
+			} else {
+				c = skip_space(in, stats);
+				if (!opened) {
+					if (c == ',') {
+						in.get();
+						c = skip_space(in, stats);
+					} else if (c != ']') {
+						throw decode_error("Expected ',' or ']'");
+					}
+				}
+				if (c != ']') {
+					std::vector<Value> &items =
+						container->m_value.array->items;
+#ifndef CPPJSON_NO_STATS
+					if (stats && items.size() == items.capacity()) {
+						/* push_back() will reallocate */
+						stats->allocs++;
+						stats->alloc_bytes += sizeof(Value) *
+							std::max<size_t>(1, items.size() * 2);
+					}
+#endif
+					items.push_back(Value());
+					val = &items.back();
+					schema = frame.schema ? frame.schema->items : NULL;
+					break;
+				}
+				in.get();
+			}
+
+			/* the container is complete */
+			if (frame.schema != NULL)
+				frame.schema->check_value(in, *container);
+			if (dec.shares != NULL)
+				dec.shares->intern(*container, stats);
+			STAT(stats, nodes[container->m_type]++);
+			dec.depth--;
+			stack.pop();
+			opened = false;
 		}
 	}
 }
 
-void Value::load_all(std::istream &is, bool lazy)
+void Value::load_all(std::istream &is, bool lazy, Stats *stats)
 {
-	load(is, lazy);
-	skip_space(is);
-	if (!is.eof()) {
-		throw decode_error("Left over data in input");
+	LoadOptions options;
+	options.lazy = lazy;
+	options.stats = stats;
+	load_all(is, options);
+}
+
+void Value::load_all(std::istream &is, const LoadOptions &options)
+{
+	Decoder dec(is, options);
+	load_document(dec, true);
+}
+
+void Value::load_all(const char *data, size_t len,
+		     const LoadOptions &options)
+{
+	BufferReader in(data, len);
+	Decoder dec(in, options);
+	load_document(dec, true);
+}
+
+void Value::load_all(Source &source, const LoadOptions &options)
+{
+	SourceReader in(source);
+	Decoder dec(in, options);
+	load_document(dec, true);
+}
+
+void Value::write(std::ostream &os, int indent, Stats *stats) const
+{
+	WriteOptions options;
+	options.indent = indent;
+	options.stats = stats;
+	write(os, options);
+}
+
+void Value::write(std::ostream &os, const WriteOptions &options) const
+{
+	Stats *stats = options.stats;
+	STAT_TIMER(stats, write_time);
+#ifndef CPPJSON_NO_STATS
+	std::streamoff start = -1;
+	if (stats)
+		start = stream_pos(os.rdbuf(), std::ios::out);
+#endif
+	encode(os, options, 0);
+#ifndef CPPJSON_NO_STATS
+	if (stats)
+		count_bytes(stats, start, stream_pos(os.rdbuf(), std::ios::out));
+#endif
+}
+
+/*
+ * Containers smaller than this are not cached, since encoding them is
+ * about as fast as copying.
+ */
+const size_t MIN_CACHED_OUTPUT = 64;
+
+void Value::encode(std::ostream &os, const WriteOptions &options,
+		   int depth) const
+{
+	if (!options.cache || (m_type != JSON_OBJECT && m_type != JSON_ARRAY)) {
+		encode_value(os, options, depth);
+		return;
 	}
+
+	OutputCache *cache;
+	int refs;
+	if (m_type == JSON_OBJECT) {
+		cache = m_value.object;
+		refs = __atomic_load_n(&m_value.object->refs, __ATOMIC_RELAXED);
+	} else {
+		cache = m_value.array;
+		refs = __atomic_load_n(&m_value.array->refs, __ATOMIC_RELAXED);
+	}
+	/*
+	 * Other threads may be writing a shared container too, and they
+	 * reach the same nested containers through it, so nothing below
+	 * is cached either.
+	 */
+	if (refs > 1) {
+		WriteOptions uncached = options;
+		uncached.cache = false;
+		encode_value(os, uncached, depth);
+		return;
+	}
+	/*
+	 * A lent one may have been modified through the references since
+	 * its output was made. If so, it's likely modified between every
+	 * write, so the output is kept only once it's written again without
+	 * modifications.
+	 */
+	uint64_t epoch = OutputCache::epoch();
+	if (cache->lent && cache->output_epoch != epoch) {
+		delete cache->output;
+		cache->output = NULL;
+		cache->output_epoch = epoch;
+		encode_value(os, options, depth);
+		return;
+	}
+	/* indentation depends on the depth */
+	if (cache->output == NULL || cache->indent != options.indent ||
+	    (options.indent && cache->depth != depth)) {
+		std::ostringstream buf;
+		encode_value(buf, options, depth);
+		/* the contents are the same, so a kept hash stays */
+		delete cache->output;
+		cache->output = NULL;
+		std::string output = buf.str();
+		os.write(output.data(), output.size());
+		if (output.size() >= MIN_CACHED_OUTPUT) {
+			cache->output = new std::string;
+			cache->output->swap(output);
+			cache->indent = options.indent;
+			cache->depth = depth;
+			cache->output_epoch = epoch;
+		}
+		return;
+	}
+	os.write(cache->output->data(), cache->output->size());
+	STAT(options.stats, cached_writes++);
 }
 
-void Value::write(std::ostream &os, int indent) const
+void Value::encode_value(std::ostream &os, const WriteOptions &options,
+			 int depth) const
 {
-	static int depth = 0;
+	int indent = options.indent;
+	Stats *stats = options.stats;
+	STAT(stats, nodes[m_type]++);
 
 	switch (m_type) {
 	case JSON_STRING:
 		encode_string(os, *m_value.string);
+		STAT(stats, string_bytes += m_value.string->size());
 		break;
 	case JSON_OBJECT:
 		os.put('{');
 		depth++;
-		FOR_EACH_CONST(object_map_t, i, *m_value.object) {
-			if (i != m_value.object->begin())
+		FOR_EACH_CONST(object_map_t, i, m_value.object->items) {
+			if (i != m_value.object->items.begin())
 				os << ", ";
 			if (indent) {
 				os.put('\n');
@@ -708,8 +2100,9 @@ void Value::write(std::ostream &os, int indent) const
 					os.put(' ');
 			}
 			encode_string(os, i->first);
+			STAT(stats, string_bytes += i->first.size());
 			os << ": ";
-			i->second.write(os, indent);
+			i->second.encode(os, options, depth);
 		}
 		depth--;
 		if (indent) {
@@ -721,18 +2114,23 @@ void Value::write(std::ostream &os, int indent) const
 		break;
 	case JSON_ARRAY:
 		os.put('[');
-		FOR_EACH_CONST(std::vector<Value>, i, *m_value.array) {
-			if (i != m_value.array->begin())
+		FOR_EACH_CONST(std::vector<Value>, i, m_value.array->items) {
+			if (i != m_value.array->items.begin())
 				os << ", ";
-			i->write(os, indent);
+			i->encode(os, options, depth);
 		}
 		os.put(']');
 		break;
 	case JSON_INTEGER:
-		os << m_value.integer;
-		break;
 	case JSON_FLOATING:
-		os << m_value.floating;
+		if (m_flags & RAW_NUMBER) {
+			/* verbatim from the input */
+			os << *m_value.string;
+		} else if (m_type == JSON_INTEGER) {
+			os << m_value.integer;
+		} else {
+			os << m_value.floating;
+		}
 		break;
 	case JSON_BOOLEAN:
 		os << (m_value.boolean ? "true" : "false");
@@ -0,0 +1,88 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Builds sidecar offset indexes for large files of an array, and prints
+ * elements using them.
+ */
+#include "cppjson.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <iostream>
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-t THREADS] FILE...\n"
+		"       %s -p INDEX FILE\n"
+		"\n"
+		"Builds FILE.idx with the offsets of the elements of the array\n"
+		"in FILE, unless it's up to date.\n"
+		"\n"
+		"  -t THREADS  number of threads for the scan (default: CPUs)\n"
+		"  -f          rebuild even if the index is up to date\n"
+		"  -p INDEX    print the element using the index\n",
+		prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	int threads = 0;
+	bool force = false;
+	long print = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:fp:h")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'f':
+			force = true;
+			break;
+		case 'p':
+			print = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind >= argc || (print >= 0 && optind + 1 != argc)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	try {
+		for (int i = optind; i < argc; ++i) {
+			std::string path = argv[i];
+			json::OffsetIndex index;
+			std::string index_path = json::OffsetIndex::sidecar_path(path);
+			if (force || !index.load(index_path, path)) {
+				index.build(path, threads);
+				index.save(index_path);
+				fprintf(stderr, "%s: %u elements\n", index_path.c_str(),
+					unsigned(index.size()));
+			}
+			if (print < 0)
+				continue;
+			if (size_t(print) >= index.size()) {
+				fprintf(stderr, "%s: no element %ld\n", path.c_str(),
+					print);
+				return 1;
+			}
+			std::ifstream is(path.c_str(), std::ios::binary);
+			json::Value array = index.open(is, print);
+			array.load_next().write(std::cout, 4);
+			std::cout << std::endl;
+		}
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,234 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Accounting and compacting the memory of values.
+ */
+#include "internal.h"
+
+namespace json {
+
+namespace {
+
+/* Color, parent, left and right of a std::map node */
+const size_t MAP_NODE_OVERHEAD = 4 * sizeof(void *);
+
+/* Short strings are stored inside the std::string object */
+bool on_heap(const std::string &str)
+{
+	const char *p = str.data();
+	if (p >= (const char *) &str && p < (const char *) (&str + 1))
+		return false;
+	return str.capacity() > 0;
+}
+
+size_t heap_size(const std::string &str)
+{
+	return on_heap(str) ? str.capacity() + 1 : 0;
+}
+
+size_t slack(const std::string &str)
+{
+	return on_heap(str) ? str.capacity() - str.size() : 0;
+}
+
+void count(MemoryUsage *usage, Type type, uint64_t bytes)
+{
+	usage->types[type] += bytes;
+	usage->total += bytes;
+}
+
+/* A string allocated by a value */
+void count_string(MemoryUsage *usage, Type type, const std::string &str)
+{
+	count(usage, type, sizeof(std::string) + heap_size(str));
+	usage->string_slack += slack(str);
+}
+
+void count_cache(MemoryUsage *usage, Type type, const OutputCache &cache)
+{
+	if (cache.output == NULL)
+		return;
+	size_t bytes = sizeof(std::string) + heap_size(*cache.output);
+	count(usage, type, bytes);
+	usage->output_cache += bytes;
+}
+
+void shrink(std::string &str)
+{
+	if (slack(str) > 0)
+		std::string(str).swap(str);
+}
+
+}
+
+MemoryUsage::MemoryUsage()
+{
+	clear();
+}
+
+void MemoryUsage::clear()
+{
+	total = 0;
+	for (int i = 0; i < JSON_NUM_TYPES; ++i)
+		types[i] = 0;
+	keys = 0;
+	string_slack = 0;
+	array_slack = 0;
+	map_nodes = 0;
+	output_cache = 0;
+	members.clear();
+}
+
+Value MemoryUsage::to_json() const
+{
+	Value types_val(JSON_OBJECT);
+	for (int i = 0; i < JSON_NUM_TYPES; ++i)
+		types_val.set(type_names[i], double(types[i]));
+	Value members_val(JSON_OBJECT);
+	for (std::map<std::string, uint64_t>::const_iterator i =
+	     members.begin(); i != members.end(); ++i)
+		members_val.set(i->first, double(i->second));
+
+	Value val(JSON_OBJECT);
+	val.set("total", double(total));
+	val.set("types", types_val);
+	val.set("keys", double(keys));
+	val.set("string_slack", double(string_slack));
+	val.set("array_slack", double(array_slack));
+	val.set("map_nodes", double(map_nodes));
+	val.set("output_cache", double(output_cache));
+	val.set("members", members_val);
+	return val;
+}
+
+size_t Value::memory_usage() const
+{
+	MemoryUsage usage;
+	std::set<const void *> shared;
+	add_memory(&usage, NULL, shared);
+	return usage.total;
+}
+
+void Value::memory_usage(MemoryUsage *usage) const
+{
+	std::set<const void *> shared;
+	add_memory(usage, &usage->members, shared);
+}
+
+/*
+ * Also adds the total of each member to 'members', if not NULL. Shared
+ * containers are counted once, and remembered in 'shared'.
+ */
+void Value::add_memory(MemoryUsage *usage,
+		       std::map<std::string, uint64_t> *members,
+		       std::set<const void *> &shared) const
+{
+	if ((m_type == JSON_OBJECT && m_value.object->refs > 1 &&
+	     !shared.insert(m_value.object).second) ||
+	    (m_type == JSON_ARRAY && m_value.array->refs > 1 &&
+	     !shared.insert(m_value.array).second))
+		return;
+
+	switch (m_type) {
+	case JSON_STRING:
+		count_string(usage, m_type, *m_value.string);
+		break;
+	case JSON_INTEGER:
+	case JSON_FLOATING:
+		if (m_flags & RAW_NUMBER)
+			count_string(usage, m_type, *m_value.string);
+		break;
+	case JSON_OBJECT:
+		{
+			count(usage, m_type, sizeof(ObjectContainer));
+			count_cache(usage, m_type, *m_value.object);
+			const object_map_t &items = m_value.object->items;
+			for (object_map_t::const_iterator i = items.begin();
+			     i != items.end(); ++i) {
+				uint64_t start = usage->total;
+				size_t key = heap_size(i->first);
+				count(usage, m_type, MAP_NODE_OVERHEAD +
+				      sizeof(object_map_t::value_type) + key);
+				usage->map_nodes += MAP_NODE_OVERHEAD;
+				usage->keys += key;
+				usage->string_slack += slack(i->first);
+				i->second.add_memory(usage, NULL, shared);
+				if (members)
+					(*members)[i->first] += usage->total - start;
+			}
+		}
+		break;
+	case JSON_ARRAY:
+		{
+			const std::vector<Value> &items = m_value.array->items;
+			count(usage, m_type, sizeof(ArrayContainer) +
+			      items.capacity() * sizeof(Value));
+			count_cache(usage, m_type, *m_value.array);
+			usage->array_slack += (items.capacity() - items.size()) *
+					      sizeof(Value);
+			for (size_t i = 0; i < items.size(); ++i)
+				items[i].add_memory(usage, NULL, shared);
+		}
+		break;
+	case JSON_LAZY_ARRAY:
+		count(usage, m_type, lazy_array_memory(m_value.lazy));
+		break;
+	default:
+		break;
+	}
+}
+
+/* The contents don't change, so the output caches stay valid */
+void Value::shrink_to_fit()
+{
+	switch (m_type) {
+	case JSON_STRING:
+		shrink(*m_value.string);
+		break;
+	case JSON_INTEGER:
+	case JSON_FLOATING:
+		if (m_flags & RAW_NUMBER)
+			shrink(*m_value.string);
+		break;
+	case JSON_OBJECT:
+		{
+			/* other values may be reading the elements */
+			if (__atomic_load_n(&m_value.object->refs,
+					    __ATOMIC_ACQUIRE) > 1)
+				break;
+			object_map_t &items = m_value.object->items;
+			for (object_map_t::iterator i = items.begin();
+			     i != items.end(); ++i)
+				i->second.shrink_to_fit();
+		}
+		break;
+	case JSON_ARRAY:
+		{
+			if (__atomic_load_n(&m_value.array->refs,
+					    __ATOMIC_ACQUIRE) > 1)
+				break;
+			std::vector<Value> &items = m_value.array->items;
+			if (items.capacity() > items.size()) {
+				/* move the elements without copying them */
+				std::vector<Value> fitted;
+				fitted.reserve(items.size());
+				for (size_t i = 0; i < items.size(); ++i) {
+					fitted.push_back(Value());
+					fitted.back().swap(items[i]);
+				}
+				items.swap(fitted);
+			}
+			for (size_t i = 0; i < items.size(); ++i)
+				items[i].shrink_to_fit();
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+}
@@ -0,0 +1,227 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Background prefetching of lazy array elements.
+ */
+#include "internal.h"
+#include <pthread.h>
+#include <sched.h>
+
+namespace json {
+
+/*
+ * The elements are passed in a single-producer, single-consumer ring.
+ * 'head' is only written by the consumer and 'tail' by the producer, so
+ * the fast path needs no locking. The mutex and the condition are only
+ * used to sleep when the ring is empty or full.
+ */
+struct PrefetcherState {
+	Value *array;
+	std::vector<Value> ring;
+	size_t head;		/* next element to consume */
+	size_t tail;		/* next free slot */
+	int finished;		/* the producer has stopped */
+	int stop;		/* the consumer wants the producer to stop */
+	int consumer_waiting;
+	int producer_waiting;
+
+	/* an error from the parser, set before 'finished' */
+	enum { NO_ERROR, DECODE_ERROR, TYPE_ERROR, OTHER_ERROR } error;
+	std::string error_what;
+
+	bool threaded;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+namespace {
+
+const int SPIN_COUNT = 100;
+
+inline size_t load_acquire(const size_t *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+inline void store_release(size_t *ptr, size_t val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+inline int load_flag(const int *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+inline void store_flag(int *ptr, int val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+/* Wakes up the other side, if it's sleeping */
+void wake(PrefetcherState *state, int *waiting)
+{
+	if (load_flag(waiting)) {
+		pthread_mutex_lock(&state->mutex);
+		pthread_cond_broadcast(&state->cond);
+		pthread_mutex_unlock(&state->mutex);
+	}
+}
+
+bool ring_full(PrefetcherState *state)
+{
+	return state->tail - load_acquire(&state->head) == state->ring.size() &&
+		!load_flag(&state->stop);
+}
+
+bool ring_empty(PrefetcherState *state)
+{
+	return load_acquire(&state->tail) == state->head &&
+		!load_flag(&state->finished);
+}
+
+/*
+ * Waits until the condition is false. Spins for a while before going to
+ * sleep, because the other side is usually quick.
+ */
+void wait_while(PrefetcherState *state, bool (*cond)(PrefetcherState *),
+		int *waiting)
+{
+	for (int i = 0; i < SPIN_COUNT; ++i) {
+		if (!cond(state))
+			return;
+		sched_yield();
+	}
+	pthread_mutex_lock(&state->mutex);
+	store_flag(waiting, 1);
+	while (cond(state))
+		pthread_cond_wait(&state->cond, &state->mutex);
+	store_flag(waiting, 0);
+	pthread_mutex_unlock(&state->mutex);
+}
+
+void *prefetch_thread(void *arg)
+{
+	PrefetcherState *state = (PrefetcherState *) arg;
+	try {
+		while (!load_flag(&state->stop)) {
+			bool end = false;
+			Value val = state->array->load_next(&end);
+			if (end)
+				break;
+			wait_while(state, ring_full, &state->producer_waiting);
+			if (load_flag(&state->stop))
+				break;
+			state->ring[state->tail % state->ring.size()].swap(val);
+			store_release(&state->tail, state->tail + 1);
+			wake(state, &state->consumer_waiting);
+		}
+	} catch (const decode_error &e) {
+		state->error = PrefetcherState::DECODE_ERROR;
+		state->error_what = e.what();
+	} catch (const type_error &e) {
+		state->error = PrefetcherState::TYPE_ERROR;
+		state->error_what = e.what();
+	} catch (const std::exception &e) {
+		state->error = PrefetcherState::OTHER_ERROR;
+		state->error_what = e.what();
+	}
+	store_flag(&state->finished, 1);
+	wake(state, &state->consumer_waiting);
+	return NULL;
+}
+
+}
+
+Prefetcher::Prefetcher(Value &array, size_t depth) :
+	m_state(new PrefetcherState)
+{
+	if (array.type() != JSON_LAZY_ARRAY) {
+		delete m_state;
+		throw type_error(strf("Expected type %s, but got %s",
+				      type_names[JSON_LAZY_ARRAY],
+				      type_names[array.type()]));
+	}
+	m_state->array = &array;
+	m_state->ring.resize(depth);
+	m_state->head = 0;
+	m_state->tail = 0;
+	m_state->finished = 0;
+	m_state->stop = 0;
+	m_state->consumer_waiting = 0;
+	m_state->producer_waiting = 0;
+	m_state->error = PrefetcherState::NO_ERROR;
+	m_state->threaded = false;
+	pthread_mutex_init(&m_state->mutex, NULL);
+	pthread_cond_init(&m_state->cond, NULL);
+	if (depth > 0) {
+		if (pthread_create(&m_state->thread, NULL, prefetch_thread,
+				   m_state)) {
+			pthread_cond_destroy(&m_state->cond);
+			pthread_mutex_destroy(&m_state->mutex);
+			delete m_state;
+			throw std::runtime_error("Unable to create a thread");
+		}
+		m_state->threaded = true;
+	}
+}
+
+Prefetcher::~Prefetcher()
+{
+	if (m_state->threaded) {
+		store_flag(&m_state->stop, 1);
+		wake(m_state, &m_state->producer_waiting);
+		pthread_join(m_state->thread, NULL);
+	}
+	pthread_cond_destroy(&m_state->cond);
+	pthread_mutex_destroy(&m_state->mutex);
+	delete m_state;
+}
+
+bool Prefetcher::next(Value &value)
+{
+	if (!m_state->threaded) {
+		bool end = false;
+		value = m_state->array->load_next(&end);
+		return !end;
+	}
+
+	wait_while(m_state, ring_empty, &m_state->consumer_waiting);
+	size_t head = m_state->head;
+	if (head == load_acquire(&m_state->tail)) {
+		/* the producer has finished, and everything is consumed */
+		switch (m_state->error) {
+		case PrefetcherState::NO_ERROR:
+			break;
+		case PrefetcherState::DECODE_ERROR:
+			throw decode_error(m_state->error_what);
+		case PrefetcherState::TYPE_ERROR:
+			throw type_error(m_state->error_what);
+		case PrefetcherState::OTHER_ERROR:
+			throw std::runtime_error(m_state->error_what);
+		}
+		value = Value();
+		return false;
+	}
+	Value &slot = m_state->ring[head % m_state->ring.size()];
+	value.swap(slot);
+	slot = Value();
+	store_release(&m_state->head, head + 1);
+	wake(m_state, &m_state->producer_waiting);
+	return true;
+}
+
+Prefetcher::iterator Prefetcher::begin()
+{
+	iterator i;
+	i.m_owner = this;
+	++i;
+	return i;
+}
+
+}
@@ -0,0 +1,186 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Background freeing of values.
+ */
+#include "internal.h"
+#include <pthread.h>
+
+namespace json {
+
+struct ReclaimerState {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* signaled when the queue changes */
+	pthread_t thread;
+	bool running;
+
+	/* ring buffer of values to free */
+	std::vector<Value> queue;
+	size_t head, count;
+	/* number of values taken by the thread, but not yet freed */
+	size_t busy;
+};
+
+namespace {
+
+class Lock {
+public:
+	Lock(pthread_mutex_t *mutex) :
+		m_mutex(mutex)
+	{
+		pthread_mutex_lock(m_mutex);
+	}
+	~Lock()
+	{
+		pthread_mutex_unlock(m_mutex);
+	}
+
+private:
+	pthread_mutex_t *m_mutex;
+};
+
+void *reclaim_thread(void *arg)
+{
+	ReclaimerState *state = (ReclaimerState *) arg;
+	Lock lock(&state->mutex);
+	while (1) {
+		while (state->running && state->count == 0)
+			pthread_cond_wait(&state->cond, &state->mutex);
+		if (state->count == 0)
+			break;
+
+		/* take the value, and free it without holding the lock */
+		Value val;
+		val.swap(state->queue[state->head]);
+		state->head = (state->head + 1) % state->queue.size();
+		state->count--;
+		state->busy++;
+		pthread_cond_broadcast(&state->cond);
+
+		pthread_mutex_unlock(&state->mutex);
+		val = Value();
+		pthread_mutex_lock(&state->mutex);
+
+		state->busy--;
+		pthread_cond_broadcast(&state->cond);
+	}
+	return NULL;
+}
+
+/* Scalars are cheap to free, and are not worth queuing */
+bool is_trivial(const Value &value)
+{
+	switch (value.type()) {
+	case JSON_NULL:
+	case JSON_INTEGER:
+	case JSON_FLOATING:
+	case JSON_BOOLEAN:
+		return true;
+	default:
+		return false;
+	}
+}
+
+}
+
+Reclaimer::Reclaimer(size_t max_queue) :
+	m_state(new ReclaimerState)
+{
+	pthread_mutex_init(&m_state->mutex, NULL);
+	pthread_cond_init(&m_state->cond, NULL);
+	m_state->queue.resize(max_queue ? max_queue : 1);
+	m_state->head = 0;
+	m_state->count = 0;
+	m_state->busy = 0;
+	m_state->running = true;
+	if (pthread_create(&m_state->thread, NULL, reclaim_thread, m_state)) {
+		pthread_cond_destroy(&m_state->cond);
+		pthread_mutex_destroy(&m_state->mutex);
+		delete m_state;
+		throw std::runtime_error("Unable to create a thread");
+	}
+}
+
+Reclaimer::~Reclaimer()
+{
+	shutdown();
+	pthread_cond_destroy(&m_state->cond);
+	pthread_mutex_destroy(&m_state->mutex);
+	delete m_state;
+}
+
+void Reclaimer::dispose(Value &value)
+{
+	if (is_trivial(value)) {
+		value = Value();
+		return;
+	}
+	Lock lock(&m_state->mutex);
+	while (m_state->running && m_state->count == m_state->queue.size())
+		pthread_cond_wait(&m_state->cond, &m_state->mutex);
+	if (!m_state->running) {
+		pthread_mutex_unlock(&m_state->mutex);
+		value = Value();
+		pthread_mutex_lock(&m_state->mutex);
+		return;
+	}
+	size_t tail = (m_state->head + m_state->count) % m_state->queue.size();
+	m_state->queue[tail].swap(value);
+	m_state->count++;
+	pthread_cond_broadcast(&m_state->cond);
+}
+
+bool Reclaimer::try_dispose(Value &value)
+{
+	if (is_trivial(value)) {
+		value = Value();
+		return true;
+	}
+	{
+		Lock lock(&m_state->mutex);
+		if (m_state->running) {
+			if (m_state->count == m_state->queue.size())
+				return false;
+			size_t tail = (m_state->head + m_state->count) %
+				m_state->queue.size();
+			m_state->queue[tail].swap(value);
+			m_state->count++;
+			pthread_cond_broadcast(&m_state->cond);
+			return true;
+		}
+	}
+	value = Value();
+	return true;
+}
+
+void Reclaimer::flush()
+{
+	Lock lock(&m_state->mutex);
+	while (m_state->count > 0 || m_state->busy > 0)
+		pthread_cond_wait(&m_state->cond, &m_state->mutex);
+}
+
+void Reclaimer::shutdown()
+{
+	{
+		Lock lock(&m_state->mutex);
+		if (!m_state->running)
+			return;
+		m_state->running = false;
+		pthread_cond_broadcast(&m_state->cond);
+	}
+	/* the thread empties the queue before it exits */
+	pthread_join(m_state->thread, NULL);
+}
+
+size_t Reclaimer::pending() const
+{
+	Lock lock(&m_state->mutex);
+	return m_state->count + m_state->busy;
+}
+
+}
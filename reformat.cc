@@ -0,0 +1,301 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Streaming reformatter: minifies or pretty-prints JSON token by token,
+ * without building a tree.
+ */
+#include "internal.h"
+
+namespace json {
+
+namespace {
+
+/* An open container */
+struct Level {
+	char close;
+	bool empty;
+};
+
+class Reformatter {
+public:
+	Reformatter(Reader &in, BlockOutput &out, int indent) :
+		m_in(in), m_out(out), m_indent(indent)
+	{}
+
+	void run();
+
+private:
+	Reader &m_in;
+	BlockOutput &m_out;
+	int m_indent;
+	std::vector<Level> m_stack;
+
+	void copy_string();
+	void copy_number(int c);
+	void copy_keyword(const char *word, size_t len);
+	void begin_element();
+	void newline(size_t depth);
+	void format_value();
+};
+
+/* Copies a string verbatim, escapes included. The quote is consumed. */
+void Reformatter::copy_string()
+{
+	m_out.put('"');
+	skip_string(m_in, &m_out);
+	m_out.put('"');
+}
+
+enum NumberState {
+	NUMBER_SIGN,		/* after the minus */
+	NUMBER_INTEGER,
+	NUMBER_FRACTION,
+	NUMBER_EXPONENT,	/* after the 'e' */
+	NUMBER_EXPONENT_SIGN,
+	NUMBER_EXPONENT_DIGITS,
+	NUMBER_INVALID,
+};
+
+NumberState next_number_state(NumberState state, char c)
+{
+	bool digit = c >= '0' && c <= '9';
+	switch (state) {
+	case NUMBER_SIGN:
+		return digit ? NUMBER_INTEGER : NUMBER_INVALID;
+	case NUMBER_INTEGER:
+		if (c == '.')
+			return NUMBER_FRACTION;
+		/* fall through */
+	case NUMBER_FRACTION:
+		if (c == 'e')
+			return NUMBER_EXPONENT;
+		return digit ? state : NUMBER_INVALID;
+	case NUMBER_EXPONENT:
+		if (c == '-' || c == '+')
+			return NUMBER_EXPONENT_SIGN;
+		/* fall through */
+	case NUMBER_EXPONENT_SIGN:
+	case NUMBER_EXPONENT_DIGITS:
+		return digit ? NUMBER_EXPONENT_DIGITS : NUMBER_INVALID;
+	default:
+		return NUMBER_INVALID;
+	}
+}
+
+/*
+ * Copies a number verbatim, validating it on the way. Accepts the same
+ * numbers as Value::load(): an optional minus, digits, optional fraction
+ * and an exponent. Integers must fit in 64 bits.
+ */
+void Reformatter::copy_number(int c)
+{
+	NumberState state = c == '-' ? NUMBER_SIGN : next_number_state(
+		NUMBER_INTEGER, c);
+	/* the text of an integer, for the range check */
+	char integer[24];
+	size_t len = 0;
+	integer[len++] = c;
+	m_out.put(c);
+	while (state != NUMBER_INVALID) {
+		const char *start = m_in.pos();
+		const char *p = start;
+		const char *end = m_in.end();
+		while (p < end && ((*p >= '0' && *p <= '9') || *p == '.' ||
+				   *p == 'e' || *p == '-' || *p == '+')) {
+			state = next_number_state(state, *p);
+			if (state == NUMBER_INVALID)
+				break;
+			if (state == NUMBER_INTEGER) {
+				/* more digits than in the largest integer */
+				if (len == sizeof integer) {
+					state = NUMBER_INVALID;
+					break;
+				}
+				integer[len++] = *p;
+			}
+			p++;
+		}
+		m_out.write(start, p - start);
+		m_in.advance(p);
+		if (p < end || !m_in.fill())
+			break;
+	}
+
+	bool is_float;
+	if ((state != NUMBER_INTEGER && state != NUMBER_FRACTION &&
+	     state != NUMBER_EXPONENT_DIGITS) ||
+	    (state == NUMBER_INTEGER && !valid_number(integer, len, &is_float))) {
+		throw decode_error("Invalid number");
+	}
+}
+
+/* Copies true, false or null, after the first letter */
+void Reformatter::copy_keyword(const char *word, size_t len)
+{
+	match(m_in, word + 1, len - 1);
+	m_out.write(word, len);
+}
+
+void Reformatter::newline(size_t depth)
+{
+	m_out.put('\n');
+	for (size_t i = 0; i < depth * m_indent; ++i)
+		m_out.put(' ');
+}
+
+/* Outputs a separator before an element of the innermost container */
+void Reformatter::begin_element()
+{
+	Level &level = m_stack.back();
+	if (!level.empty)
+		m_out.put(',');
+	level.empty = false;
+	if (m_indent)
+		newline(m_stack.size());
+}
+
+/* Formats one value. An explicit stack is used instead of recursion. */
+void Reformatter::format_value()
+{
+	enum {
+		VALUE,
+		VALUE_OR_END,	/* array element or ']' */
+		KEY_OR_END,	/* object key or '}' */
+		NEXT,		/* ',' or the end of the container */
+	} state = VALUE;
+
+	while (1) {
+		int c = skip_space(m_in);
+		switch (state) {
+		case VALUE_OR_END:
+			if (c == ']')
+				break;
+			begin_element();
+			/* fall through */
+		case VALUE:
+			m_in.get();
+			switch (c) {
+			case '{':
+			case '[':
+				{
+					m_out.put(c);
+					Level level;
+					level.close = c == '{' ? '}' : ']';
+					level.empty = true;
+					m_stack.push_back(level);
+					state = c == '{' ? KEY_OR_END : VALUE_OR_END;
+					continue;
+				}
+			case '"':
+				copy_string();
+				break;
+			case 't':
+				copy_keyword("true", 4);
+				break;
+			case 'f':
+				copy_keyword("false", 5);
+				break;
+			case 'n':
+				copy_keyword("null", 4);
+				break;
+			default:
+				if ((c >= '0' && c <= '9') || c == '-') {
+					copy_number(c);
+				} else if (c == EOF) {
+					throw decode_error("Unexpected end of input");
+				} else {
+					throw decode_error("Unknown character in input");
+				}
+			}
+			if (m_stack.empty())
+				return;
+			state = NEXT;
+			continue;
+
+		case KEY_OR_END:
+			if (c == '}')
+				break;
+			if (c == '"') {
+				m_in.get();
+				begin_element();
+				copy_string();
+			} else if (c == EOF) {
+				throw decode_error("Unexpected end of input");
+			} else {
+				throw decode_error("Expected '}' or a string");
+			}
+			if (skip_space(m_in) != ':') {
+				throw decode_error("Expected ':'");
+			}
+			m_in.get();
+			m_out.put(':');
+			if (m_indent)
+				m_out.put(' ');
+			state = VALUE;
+			continue;
+
+		case NEXT:
+			if (c == ',') {
+				m_in.get();
+				state = m_stack.back().close == '}' ?
+					KEY_OR_END : VALUE_OR_END;
+				continue;
+			}
+			if (c != m_stack.back().close) {
+				throw decode_error(m_stack.back().close == '}' ?
+						   "Expected ',' or '}'" :
+						   "Expected ',' or ']'");
+			}
+			break;
+		}
+
+		/* end of a container */
+		m_in.get();
+		Level level = m_stack.back();
+		m_stack.pop_back();
+		if (m_indent && !level.empty)
+			newline(m_stack.size());
+		m_out.put(level.close);
+		if (m_stack.empty())
+			return;
+		state = NEXT;
+	}
+}
+
+void Reformatter::run()
+{
+	bool first = true;
+	while (skip_space(m_in) != EOF) {
+		if (!first)
+			m_out.put('\n');
+		first = false;
+		format_value();
+	}
+	if (first) {
+		throw decode_error("Unexpected end of input");
+	}
+	m_out.flush();
+}
+
+}
+
+void reformat(std::istream &is, std::ostream &os, int indent)
+{
+	/* sets eofbit when the whole input has been consumed */
+	StreamReader in(&is);
+	BlockOutput out(os);
+	Reformatter(in, out, indent).run();
+}
+
+void reformat(const char *data, size_t len, std::ostream &os, int indent)
+{
+	BufferReader in(data, len);
+	BlockOutput out(os);
+	Reformatter(in, out, indent).run();
+}
+
+}
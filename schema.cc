@@ -0,0 +1,422 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Validation against a subset of JSON Schema, while loading.
+ */
+#include "internal.h"
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+namespace json {
+
+namespace {
+
+struct TypeName {
+	const char *name;
+	unsigned types;
+};
+
+const TypeName type_keywords[] = {
+	{"null", 1 << JSON_NULL},
+	{"boolean", 1 << JSON_BOOLEAN},
+	{"integer", 1 << JSON_INTEGER},
+	{"number", (1 << JSON_INTEGER) | (1 << JSON_FLOATING)},
+	{"string", 1 << JSON_STRING},
+	{"object", 1 << JSON_OBJECT},
+	/* lazy arrays are arrays too */
+	{"array", (1 << JSON_ARRAY) | (1 << JSON_LAZY_ARRAY)},
+};
+
+#define NUM_TYPE_KEYWORDS (sizeof(type_keywords) / sizeof(type_keywords[0]))
+
+/* Keywords that don't affect validation */
+const char *annotations[] = {
+	"$schema", "$id", "$comment", "title", "description", "default",
+	"examples",
+};
+
+#define NUM_ANNOTATIONS (sizeof(annotations) / sizeof(annotations[0]))
+
+unsigned parse_type(const std::string &name)
+{
+	for (size_t i = 0; i < NUM_TYPE_KEYWORDS; ++i) {
+		if (name == type_keywords[i].name)
+			return type_keywords[i].types;
+	}
+	throw std::invalid_argument(strf("Unknown type in schema: %s",
+					 name.c_str()));
+}
+
+/* Returns the type of the value from its first character */
+Type start_type(int c)
+{
+	switch (c) {
+	case '{':
+		return JSON_OBJECT;
+	case '[':
+		return JSON_ARRAY;
+	case '"':
+		return JSON_STRING;
+	case 't':
+	case 'f':
+		return JSON_BOOLEAN;
+	case 'n':
+		return JSON_NULL;
+	default:
+		return JSON_INTEGER;
+	}
+}
+
+bool number_start(int c)
+{
+	return (c >= '0' && c <= '9') || c == '-';
+}
+
+/* Number of characters in UTF-8 */
+size_t utf8_length(const std::string &str)
+{
+	size_t len = 0;
+	for (size_t i = 0; i < str.size(); ++i) {
+		if ((uint8_t(str[i]) & 0xC0) != 0x80)
+			len++;
+	}
+	return len;
+}
+
+std::string type_list(unsigned types)
+{
+	std::string list;
+	for (size_t i = 0; i < NUM_TYPE_KEYWORDS; ++i) {
+		unsigned bits = type_keywords[i].types;
+		if ((types & bits) != bits)
+			continue;
+		/* "number" includes integers */
+		if (bits == (1 << JSON_INTEGER) &&
+		    (types & (1 << JSON_FLOATING)))
+			continue;
+		if (!list.empty())
+			list += " or ";
+		list += type_keywords[i].name;
+	}
+	return list;
+}
+
+}
+
+SchemaNode::SchemaNode() :
+	types(~0U), items(NULL), has_minimum(false), has_maximum(false),
+	minimum(0), maximum(0), max_length(-1)
+{
+}
+
+SchemaNode::~SchemaNode()
+{
+	for (std::map<std::string, SchemaNode *>::iterator i =
+	     properties.begin(); i != properties.end(); ++i)
+		delete i->second;
+	delete items;
+}
+
+void SchemaNode::compile(const Value &schema)
+{
+	const object_map_t &obj = schema.as_object();
+	for (object_map_t::const_iterator i = obj.begin(); i != obj.end(); ++i) {
+		const std::string &key = i->first;
+		const Value &val = i->second;
+		if (key == "type") {
+			if (val.type() == JSON_STRING) {
+				types = parse_type(val.as_string());
+			} else {
+				types = 0;
+				const std::vector<Value> &list = val.as_array();
+				for (size_t j = 0; j < list.size(); ++j)
+					types |= parse_type(list[j].as_string());
+			}
+		} else if (key == "properties") {
+			const object_map_t &props = val.as_object();
+			for (object_map_t::const_iterator j = props.begin();
+			     j != props.end(); ++j) {
+				SchemaNode *node = new SchemaNode;
+				properties[j->first] = node;
+				node->compile(j->second);
+			}
+		} else if (key == "required") {
+			const std::vector<Value> &list = val.as_array();
+			for (size_t j = 0; j < list.size(); ++j)
+				required.push_back(list[j].as_string());
+		} else if (key == "items") {
+			items = new SchemaNode;
+			items->compile(val);
+		} else if (key == "enum") {
+			enumeration = val.as_array();
+		} else if (key == "minimum") {
+			has_minimum = true;
+			minimum = val.as_double();
+		} else if (key == "maximum") {
+			has_maximum = true;
+			maximum = val.as_double();
+		} else if (key == "maxLength") {
+			max_length = val.as_int64();
+		} else {
+			size_t j = 0;
+			while (j < NUM_ANNOTATIONS && key != annotations[j])
+				j++;
+			if (j == NUM_ANNOTATIONS) {
+				throw std::invalid_argument(strf(
+					"Unsupported schema keyword: %s",
+					key.c_str()));
+			}
+		}
+	}
+}
+
+/* Raises the error at the current position of the input */
+void SchemaNode::fail(Reader &in, const std::string &what,
+		      std::streamoff back) const
+{
+	std::streamoff pos = in.tell();
+	if (pos < 0) {
+		throw schema_error(strf("Schema violation: %s", what.c_str()));
+	}
+	throw schema_error(strf("Schema violation at byte %lld: %s",
+				(long long) (pos - back), what.c_str()));
+}
+
+void SchemaNode::check_start(Reader &in, int c) const
+{
+	Type type = start_type(c);
+	/* the parser reports the errors in the input */
+	if (type == JSON_INTEGER && !number_start(c))
+		return;
+	/* a float can be valid as an integer, so numbers are checked later */
+	unsigned numbers = (1 << JSON_INTEGER) | (1 << JSON_FLOATING);
+	if (type == JSON_INTEGER ? !(types & numbers) : !(types & (1 << type))) {
+		fail(in, strf("expected %s, but got %s",
+			      type_list(types).c_str(),
+			      type == JSON_INTEGER ? "number" : type_names[type]),
+		     1);
+	}
+}
+
+void SchemaNode::check_value(Reader &in, const Value &val) const
+{
+	switch (val.type()) {
+	case JSON_OBJECT:
+		check_required(in, val.as_object());
+		break;
+	case JSON_INTEGER:
+	case JSON_FLOATING:
+		check_number(in, val.as_double(), val.type() == JSON_FLOATING);
+		break;
+	case JSON_STRING:
+		check_string(in, val.as_string());
+		break;
+	case JSON_LAZY_ARRAY:
+		/* the elements are checked by load_next() */
+		return;
+	default:
+		break;
+	}
+	check_enum(in, val);
+}
+
+void SchemaNode::check_number(Reader &in, double val,
+			      bool is_float) const
+{
+	if (is_float && !(types & (1 << JSON_FLOATING)) && val != floor(val))
+		fail(in, strf("expected %s, but got floating",
+			      type_list(types).c_str()));
+	if (has_minimum && val < minimum)
+		fail(in, strf("%g is less than the minimum %g", val, minimum));
+	if (has_maximum && val > maximum)
+		fail(in, strf("%g is more than the maximum %g", val, maximum));
+}
+
+void SchemaNode::check_string(Reader &in, const std::string &str) const
+{
+	if (max_length != size_t(-1) && str.size() > max_length &&
+	    utf8_length(str) > max_length)
+		fail(in, strf("string is longer than %u characters",
+			      unsigned(max_length)));
+}
+
+void SchemaNode::check_enum(Reader &in, const Value &val) const
+{
+	if (enumeration.empty())
+		return;
+	for (size_t i = 0; i < enumeration.size(); ++i) {
+		if (val == enumeration[i])
+			return;
+	}
+	fail(in, "value is not one of the enumerated values");
+}
+
+void SchemaNode::check_required(Reader &in,
+				const object_map_t &obj) const
+{
+	for (size_t i = 0; i < required.size(); ++i) {
+		if (obj.find(required[i]) == obj.end())
+			fail(in, strf("missing required key %s",
+				      required[i].c_str()), 1);
+	}
+}
+
+const SchemaNode *SchemaNode::property(const std::string &key) const
+{
+	std::map<std::string, SchemaNode *>::const_iterator i =
+		properties.find(key);
+	if (i == properties.end())
+		return NULL;
+	return i->second;
+}
+
+Schema::Schema(const Value &schema) :
+	m_root(new SchemaNode)
+{
+	try {
+		m_root->compile(schema);
+	} catch (...) {
+		delete m_root;
+		throw;
+	}
+}
+
+Schema::~Schema()
+{
+	delete m_root;
+}
+
+/*
+ * Checks the value in the input without loading it, except for strings
+ * and numbers that have constraints, and values that must be one of an
+ * enumeration.
+ */
+void Schema::walk(Decoder &dec, const SchemaNode *node) const
+{
+	Reader &in = dec.in;
+	if (node == NULL) {
+		skip_value(in, dec.stats);
+		return;
+	}
+	int c = skip_space(in, dec.stats);
+	if (!node->enumeration.empty() || number_start(c)) {
+		/* the loader does the checks */
+		Value val;
+		const SchemaNode *prev = dec.schema;
+		dec.schema = node;
+		val.load(dec);
+		dec.schema = prev;
+		return;
+	}
+
+	in.get();
+	node->check_start(in, c);
+	switch (c) {
+	case '{':
+		{
+			std::vector<char> seen(node->required.size());
+			skip_space(in, dec.stats);
+			c = in.get();
+			while (c != '}') {
+				if (c != '"') {
+					if (c == EOF) {
+						throw decode_error("Unexpected end of input");
+					}
+					throw decode_error("Expected '}' or a string");
+				}
+				std::string key = load_string(in,
+					dec.options.strict_utf8, dec.stats,
+					dec.options.max_string_length);
+				for (size_t i = 0; i < seen.size(); ++i) {
+					if (node->required[i] == key)
+						seen[i] = 1;
+				}
+				skip_space(in, dec.stats);
+				if (in.get() != ':') {
+					throw decode_error("Expected ':'");
+				}
+				walk(dec, node->property(key));
+				c = skip_space(in, dec.stats);
+				if (c == ',') {
+					in.get();
+					skip_space(in, dec.stats);
+				} else if (c != '}') {
+					throw decode_error("Expected ',' or '}'");
+				}
+				c = in.get();
+			}
+			for (size_t i = 0; i < seen.size(); ++i) {
+				if (!seen[i])
+					node->fail(in, strf("missing required key %s",
+						node->required[i].c_str()), 1);
+			}
+		}
+		break;
+
+	case '[':
+		c = skip_space(in, dec.stats);
+		while (c != ']') {
+			walk(dec, node->items);
+			c = skip_space(in, dec.stats);
+			if (c == ',') {
+				in.get();
+				c = skip_space(in, dec.stats);
+			} else if (c != ']') {
+				throw decode_error("Expected ',' or ']'");
+			}
+		}
+		in.get();
+		break;
+
+	case '"':
+		if (node->max_length != size_t(-1)) {
+			node->check_string(in, load_string(in,
+				dec.options.strict_utf8, dec.stats,
+				dec.options.max_string_length));
+		} else {
+			skip_string(in);
+		}
+		break;
+
+	case 't':
+		match(in, "rue", 3);
+		break;
+	case 'f':
+		match(in, "alse", 4);
+		break;
+	case 'n':
+		match(in, "ull", 3);
+		break;
+	default:
+		if (c == EOF) {
+			throw decode_error("Unexpected end of input");
+		}
+		throw decode_error("Unknown character in input");
+	}
+}
+
+bool Schema::validate(std::istream &is, std::string *error,
+		      const LoadOptions &options) const
+{
+	LoadOptions opts = options;
+	opts.schema = this;
+	Decoder dec(is, opts);
+	try {
+		walk(dec, m_root);
+		if (skip_space(dec.in, dec.stats) != EOF) {
+			throw decode_error("Left over data in input");
+		}
+	} catch (const decode_error &e) {
+		if (error != NULL)
+			*error = e.what();
+		return false;
+	}
+	return true;
+}
+
+}
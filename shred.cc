@@ -0,0 +1,335 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Shredding arrays of objects in to typed columns.
+ */
+#include "internal.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <set>
+
+namespace json {
+
+namespace {
+
+const Type column_types[] = {
+	JSON_INTEGER,
+	JSON_FLOATING,
+	JSON_STRING,
+};
+
+/* Type of the value starting with the character, for error messages */
+Type token_type(int c, bool is_float)
+{
+	switch (c) {
+	case 'n':
+		return JSON_NULL;
+	case '"':
+		return JSON_STRING;
+	case 't':
+	case 'f':
+		return JSON_BOOLEAN;
+	case '{':
+		return JSON_OBJECT;
+	case '[':
+		return JSON_ARRAY;
+	default:
+		return is_float ? JSON_FLOATING : JSON_INTEGER;
+	}
+}
+
+void wrong_type(const Column &col, Type type)
+{
+	throw type_error(strf("Expected type %s, but got %s in column %s",
+			 type_names[column_types[col.type]],
+			 type_names[type], col.name.c_str()));
+}
+
+void wrong_type(const Column &col, int c, bool is_float = false)
+{
+	wrong_type(col, token_type(c, is_float));
+}
+
+}
+
+Column::Column(const std::string &_name, ColumnType _type) :
+	name(_name), type(_type)
+{
+	offsets.push_back(0);
+}
+
+Table::Table() :
+	m_rows(0)
+{
+}
+
+void Table::add_column(const std::string &name, ColumnType type)
+{
+	if (m_rows > 0) {
+		throw std::logic_error("Columns must be added before rows");
+	}
+	if (!m_index.insert(std::make_pair(name, m_columns.size())).second) {
+		throw std::logic_error(strf("Duplicate column %s",
+					    name.c_str()));
+	}
+	m_columns.push_back(Column(name, type));
+}
+
+const Column &Table::column(const std::string &name) const
+{
+	std::map<std::string, size_t>::const_iterator i = m_index.find(name);
+	if (i == m_index.end()) {
+		throw std::out_of_range(strf("No column %s", name.c_str()));
+	}
+	return m_columns[i->second];
+}
+
+void Table::clear()
+{
+	m_rows = 0;
+	truncate();
+}
+
+/* Adds a row of nulls, which is then filled by the fields */
+void Table::begin_row()
+{
+	for (size_t i = 0; i < m_columns.size(); ++i) {
+		Column &col = m_columns[i];
+		switch (col.type) {
+		case COLUMN_INT64:
+			col.ints.push_back(0);
+			break;
+		case COLUMN_DOUBLE:
+			col.doubles.push_back(0);
+			break;
+		case COLUMN_STRING:
+			break;
+		}
+		if (m_rows % 8 == 0)
+			col.valid.push_back(0);
+	}
+}
+
+void Table::end_row()
+{
+	for (size_t i = 0; i < m_columns.size(); ++i) {
+		Column &col = m_columns[i];
+		if (col.type == COLUMN_STRING)
+			col.offsets.push_back(col.buffer.size());
+	}
+	m_rows++;
+}
+
+/* Drops a partial row after an error */
+void Table::truncate()
+{
+	for (size_t i = 0; i < m_columns.size(); ++i) {
+		Column &col = m_columns[i];
+		col.ints.resize(col.type == COLUMN_INT64 ? m_rows : 0);
+		col.doubles.resize(col.type == COLUMN_DOUBLE ? m_rows : 0);
+		col.offsets.resize(m_rows + 1);
+		col.buffer.resize(col.offsets[m_rows]);
+		col.valid.resize((m_rows + 7) / 8);
+		if (m_rows % 8)
+			col.valid.back() &= (1 << (m_rows % 8)) - 1;
+	}
+}
+
+void Table::set_null(Column &col)
+{
+	switch (col.type) {
+	case COLUMN_INT64:
+		col.ints.back() = 0;
+		break;
+	case COLUMN_DOUBLE:
+		col.doubles.back() = 0;
+		break;
+	case COLUMN_STRING:
+		col.buffer.resize(col.offsets.back());
+		break;
+	}
+	col.valid.back() &= ~(1 << (m_rows % 8));
+}
+
+void Table::set_value(Column &col, const Value &val)
+{
+	if (val.type() == JSON_NULL) {
+		set_null(col);
+		return;
+	}
+	switch (col.type) {
+	case COLUMN_INT64:
+		if (val.type() != JSON_INTEGER)
+			wrong_type(col, val.type());
+		col.ints.back() = val.as_int64();
+		break;
+	case COLUMN_DOUBLE:
+		if (val.type() != JSON_INTEGER && val.type() != JSON_FLOATING)
+			wrong_type(col, val.type());
+		col.doubles.back() = val.as_double();
+		break;
+	case COLUMN_STRING:
+		if (val.type() != JSON_STRING)
+			wrong_type(col, val.type());
+		col.buffer.resize(col.offsets.back());
+		col.buffer += val.as_string();
+		break;
+	}
+	col.valid.back() |= 1 << (m_rows % 8);
+}
+
+void Table::shred(Value &array)
+{
+	if (array.type() == JSON_LAZY_ARRAY) {
+		Value dummy;
+		while (array.next(dummy, false, NULL, this))
+			;
+		return;
+	}
+
+	const std::vector<Value> &elems = array.as_array();
+	for (size_t i = 0; i < elems.size(); ++i) {
+		const object_map_t &obj = elems[i].as_object();
+		begin_row();
+		try {
+			for (size_t j = 0; j < m_columns.size(); ++j) {
+				Column &col = m_columns[j];
+				object_map_t::const_iterator field =
+					obj.find(col.name);
+				if (field == obj.end()) {
+					set_null(col);
+				} else {
+					set_value(col, field->second);
+				}
+			}
+		} catch (...) {
+			truncate();
+			throw;
+		}
+		end_row();
+	}
+}
+
+/* Parses a field straight in to the column */
+void Table::shred_field(Decoder &dec, Column &col)
+{
+	Reader &in = dec.in;
+	int c = skip_space(in, dec.stats);
+	if (c == 'n') {
+		in.get();
+		match(in, "ull", 3);
+		set_null(col);
+		return;
+	}
+
+	if (c == '"') {
+		if (col.type != COLUMN_STRING)
+			wrong_type(col, c);
+		in.get();
+		std::string str = load_string(in, dec.options.strict_utf8,
+					      dec.stats,
+					      dec.options.max_string_length);
+		col.buffer.resize(col.offsets.back());
+		col.buffer += str;
+	} else if ((c >= '0' && c <= '9') || c == '-') {
+		std::string buf;
+		while ((c >= '0' && c <= '9') || c == '.' || c == 'e' ||
+		       c == '-' || c == '+') {
+			buf += c;
+			in.get();
+			c = in.peek();
+		}
+		bool is_float;
+		if (!valid_number(buf.data(), buf.size(), &is_float)) {
+			throw decode_error("Invalid number");
+		}
+		errno = 0;
+		if (col.type == COLUMN_INT64 && !is_float) {
+			col.ints.back() = strtoll(buf.c_str(), NULL, 10);
+		} else if (col.type == COLUMN_DOUBLE) {
+			col.doubles.back() = strtod(buf.c_str(), NULL);
+		} else {
+			wrong_type(col, '0', is_float);
+		}
+		if (errno == ERANGE) {
+			throw decode_error("Invalid number");
+		}
+	} else if (c == EOF) {
+		throw decode_error("Unexpected end of input");
+	} else {
+		wrong_type(col, c);
+	}
+	col.valid.back() |= 1 << (m_rows % 8);
+}
+
+/*
+ * Parses an object from the input and stores its fields as a new row.
+ * Called by load_element() in place of loading the element.
+ */
+void shred_row(Decoder &dec, Table &table)
+{
+	Reader &in = dec.in;
+	Stats *stats = dec.stats;
+	int c = skip_space(in, stats);
+	if (c != '{') {
+		if (c == EOF) {
+			throw decode_error("Unexpected end of input");
+		}
+		throw type_error(strf("Expected type object, but got %s",
+				 type_names[token_type(c, false)]));
+	}
+	in.get();
+
+	/* the keys of the row, to reject duplicates like load() does */
+	std::set<std::string> keys;
+	table.begin_row();
+	try {
+		c = skip_space(in, stats);
+		while (c != '}') {
+			if (c != '"') {
+				if (c == EOF) {
+					throw decode_error("Unexpected end of input");
+				}
+				throw decode_error("Expected '}' or a string");
+			}
+			in.get();
+			std::string key = load_string(in, dec.options.strict_utf8,
+						      stats,
+						      dec.options.max_string_length);
+			skip_space(in, stats);
+			if (in.get() != ':') {
+				throw decode_error("Expected ':'");
+			}
+			if (!keys.insert(key).second) {
+				throw decode_error("Duplicate key in object");
+			}
+			std::map<std::string, size_t>::iterator i =
+				table.m_index.find(key);
+			if (i == table.m_index.end()) {
+				skip_value(dec.in, dec.stats);
+			} else {
+				table.shred_field(dec,
+						  table.m_columns[i->second]);
+			}
+
+			c = skip_space(in, stats);
+			if (c == ',') {
+				in.get();
+				c = skip_space(in, stats);
+			} else if (c != '}') {
+				throw decode_error("Expected ',' or '}'");
+			}
+		}
+		in.get();
+	} catch (...) {
+		table.truncate();
+		throw;
+	}
+	table.end_row();
+}
+
+}
@@ -0,0 +1,48 @@
+/*
+ * cppjson - JSON (de)serialization library for C++ and STL
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ *
+ * Sources of input that are read a block at a time.
+ */
+#include "internal.h"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace json {
+
+bool SourceReader::refill()
+{
+	size_t len = m_source.read(&m_block[0], m_block.size());
+	m_offset += len;
+	m_pos = &m_block[0];
+	m_end = m_pos + len;
+	return len > 0;
+}
+
+size_t FdSource::read(char *buf, size_t len)
+{
+	while (1) {
+		ssize_t got = ::read(m_fd, buf, len);
+		if (got >= 0)
+			return got;
+		if (errno != EINTR) {
+			throw std::runtime_error(strf("read: %s",
+						      strerror(errno)));
+		}
+	}
+}
+
+size_t FileSource::read(char *buf, size_t len)
+{
+	size_t got = fread(buf, 1, len, m_file);
+	if (got == 0 && ferror(m_file)) {
+		throw std::runtime_error(strf("fread: %s", strerror(errno)));
+	}
+	return got;
+}
+
+}
@@ -1,6 +1,16 @@
 #include "cppjson.h"
 #include <stdio.h>
+#include <string.h>
 #include <sstream>
+#include <fstream>
+#include <pthread.h>
+
+/* The counters stay zero with ./configure --disable-stats */
+#ifndef CPPJSON_NO_STATS
+#define assert_stat(expr) assert(expr)
+#else
+#define assert_stat(expr)
+#endif
 
 void verify(const json::Value &value, const char *encoded)
 {
@@ -40,6 +50,282 @@ void verify_error(const char *s, const char *error)
 	}
 }
 
+void verify_strict_error(const char *s, const char *error)
+{
+	json::LoadOptions options;
+	options.strict_utf8 = true;
+	json::Value val;
+	std::istringstream ss(s);
+	try {
+		val.load_all(ss, options);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string(error));
+	}
+	/* passed through in the default mode */
+	ss.str(s);
+	ss.clear();
+	val.load_all(ss);
+}
+
+void test_utf8()
+{
+	json::LoadOptions options;
+	options.strict_utf8 = true;
+	json::Value val;
+	std::istringstream ss("[\"\\ud83d\\ude00\", \"\xF0\x9F\x98\x80 \xC3\xA4 snow\xE2\x98\x83man\"]");
+	val.load_all(ss, options);
+	assert(val.as_array()[0].as_string() == "\xF0\x9F\x98\x80");
+	assert(val.as_array()[1].as_string() == "\xF0\x9F\x98\x80 \xC3\xA4 snow\xE2\x98\x83man");
+
+	verify_strict_error("\"foo\xFF" "bar\"", "Invalid UTF-8");
+	verify_strict_error("\"\xC0\xAF\"", "Invalid UTF-8");
+	verify_strict_error("\"\xE2\x98\"", "Invalid UTF-8");
+	verify_strict_error("\"\xED\xA0\x80\"", "Invalid UTF-8");
+	verify_strict_error("\"\xF4\x90\x80\x80\"", "Invalid UTF-8");
+	verify_strict_error("\"\\ud83d\"", "Invalid unicode surrogate");
+	verify_strict_error("\"\\ude00x\"", "Invalid unicode surrogate");
+	verify_strict_error("\"\\ud83d\\n\"", "Invalid unicode surrogate");
+}
+
+std::string reformat(const char *s, int indent = 0)
+{
+	std::istringstream is(s);
+	std::ostringstream os;
+	json::reformat(is, os, indent);
+
+	/* the buffer version must give the same result */
+	std::ostringstream os2;
+	json::reformat(s, strlen(s), os2, indent);
+	assert(os.str() == os2.str());
+	return os.str();
+}
+
+void verify_reformat_error(const char *s, const char *error)
+{
+	try {
+		reformat(s);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string(error));
+	}
+}
+
+void test_reformat()
+{
+	assert(reformat(" { \"b\" : [1, 2.5e-3 ,],// comment\n \"a\": {},\n}") ==
+	       "{\"b\":[1,2.5e-3],\"a\":{}}");
+	assert(reformat("[\"\\u2603\\n\", true, false, null, -0.5, []]") ==
+	       "[\"\\u2603\\n\",true,false,null,-0.5,[]]");
+	assert(reformat("{\"b\": [1, {\"c\": null}], \"a\": 2}", 2) ==
+	       "{\n  \"b\": [\n    1,\n    {\n      \"c\": null\n    }\n  ],\n  \"a\": 2\n}");
+	assert(reformat("1 \"x\"\n[]") == "1\n\"x\"\n[]");
+
+	/* values cross the windows of the stream */
+	std::string input = "[", expected = "[";
+	for (int i = 0; i < 20000; ++i) {
+		input += "\"abc\\n\", 12345, true, ";
+		expected += "\"abc\\n\",12345,true,";
+	}
+	input += "null]";
+	expected += "null]";
+	assert(reformat(input.c_str()) == expected);
+	std::istringstream input_is(input);
+	std::ostringstream output;
+	json::reformat(input_is, output);
+	assert(input_is.eof());
+
+	/* pretty-printed output loads to the same value */
+	std::string pretty = reformat("{\"a\": [1, \"x\", {\"b\": true}], \"c\": -1.5}", 4);
+	std::istringstream is(pretty);
+	json::Value val;
+	val.load_all(is);
+	assert(val.get("a").as_array()[2].get("b").as_boolean());
+	assert(val.get("c").as_double() == -1.5);
+
+	verify_reformat_error("", "Unexpected end of input");
+	verify_reformat_error("[1 2]", "Expected ',' or ']'");
+	verify_reformat_error("{\"a\": 1 \"b\"}", "Expected ',' or '}'");
+	verify_reformat_error("{1234.56}", "Expected '}' or a string");
+	verify_reformat_error("{\"a\" 5", "Expected ':'");
+	verify_reformat_error("[,]", "Unknown character in input");
+	verify_reformat_error("[1, ", "Unexpected end of input");
+	/* numbers have no length limit */
+	std::string digits(72, '7');
+	assert(reformat(("[0." + digits + "e-5]").c_str()) == "[0." + digits + "e-5]");
+	assert(reformat("-9223372036854775808") == "-9223372036854775808");
+	verify_reformat_error("9223372036854775808", "Invalid number");
+	verify_reformat_error(("1" + digits).c_str(), "Invalid number");
+	verify_reformat_error("1-e2", "Invalid number");
+	verify_reformat_error("1.5e", "Invalid number");
+	verify_reformat_error("-", "Invalid number");
+	verify_reformat_error("trueorfalse", "Unknown keyword in input");
+	verify_reformat_error("\"foo", "Unexpected end of input");
+	verify_reformat_error("\"foo\\x\"", "Unknown character entity");
+	verify_reformat_error("\"foo\\ubarz\"", "Invalid unicode");
+	verify_reformat_error("\"foo\nbar\"", "Control character in a string");
+	verify_reformat_error(" /x", "Expected '/'");
+}
+
+void test_raw_numbers()
+{
+	json::LoadOptions options;
+	options.raw_numbers = true;
+	std::istringstream parser("[12, -3.50, 1e2, 12345678901234567, 0.1000000000000000055511151231257827]");
+	json::Value value;
+	value.load_all(parser, options);
+	const std::vector<json::Value> &arr = value.as_array();
+	assert(arr[0].type() == json::JSON_INTEGER);
+	assert(arr[0].as_integer() == 12);
+	assert(arr[1].type() == json::JSON_FLOATING);
+	assert(arr[1].as_double() == -3.5);
+	assert(arr[2].as_double() == 100);
+	assert(arr[3].as_int64() == 12345678901234567LL);
+
+	/* integers and floats still compare equal */
+	assert(arr[0] == json::Value(12.0));
+	assert(arr[2] == json::Value(100));
+	assert(json::Value(-3.5) == arr[1]);
+	json::Value copy = value;
+	assert(copy == value);
+
+	/* the original text is written back */
+	std::ostringstream ss;
+	value.write(ss);
+	assert(ss.str() == parser.str());
+
+	parser.str("1-e2");
+	parser.clear();
+	try {
+		value.load_all(parser, options);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Invalid number"));
+	}
+	parser.str("11111111111111111111");
+	parser.clear();
+	try {
+		value.load_all(parser, options);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Invalid number"));
+	}
+}
+
+void test_reclaimer()
+{
+	json::Value a("foo"), b(1234);
+	a.swap(b);
+	assert(a.as_integer() == 1234);
+	assert(b.as_string() == "foo");
+
+	json::Reclaimer reclaimer(2);
+	for (int i = 0; i < 10; ++i) {
+		json::Value doc(json::JSON_OBJECT);
+		std::vector<json::Value> arr(1000, json::Value("foobar"));
+		doc.set("arr", arr);
+		reclaimer.dispose(doc);
+		assert(doc.type() == json::JSON_NULL);
+	}
+	json::Value val("foobar");
+	while (!reclaimer.try_dispose(val))
+		;
+	assert(val.type() == json::JSON_NULL);
+	reclaimer.flush();
+	assert(reclaimer.pending() == 0);
+
+	/* after shutdown, values are freed by the caller */
+	reclaimer.shutdown();
+	val = json::Value("foobar");
+	reclaimer.dispose(val);
+	assert(val.type() == json::JSON_NULL);
+}
+
+/* A stream buffer that can't seek, like a pipe */
+class PipeBuf: public std::streambuf {
+public:
+	PipeBuf(const std::string &data) :
+		m_data(data)
+	{
+		char *p = &m_data[0];
+		setg(p, p, p + m_data.size());
+	}
+
+private:
+	std::string m_data;
+};
+
+void test_forward_array()
+{
+	PipeBuf buf("[1, [2, 3], {\"a\": [4]}, ] ");
+	std::istream is(&buf);
+	json::Value value;
+	value.load_all(is, true);
+	assert(value.type() == json::JSON_LAZY_ARRAY);
+	bool end = false;
+	assert(value.load_next(&end).as_integer() == 1);
+	assert(value.load_next(&end).as_array().size() == 2);
+	assert(value.load_next(&end).get("a").as_array()[0].as_integer() == 4);
+	assert(!end);
+	value.load_next(&end);
+	assert(end);
+	value.load_next(&end);
+	assert(end);
+
+	/* elements can be iterated lazily too */
+	std::istringstream parser("[[1, 2], [3]] x");
+	json::LoadOptions options;
+	options.lazy = true;
+	options.forward_only = true;
+	value.load_all(parser, options);
+	json::Value inner = value.load_next(&end, true);
+	assert(inner.type() == json::JSON_LAZY_ARRAY);
+	assert(inner.load_next().as_integer() == 1);
+	assert(inner.load_next().as_integer() == 2);
+	inner.load_next(&end);
+	assert(end);
+	inner = value.load_next(&end, true);
+	assert(inner.load_next().as_integer() == 3);
+	inner.load_next(&end);
+	assert(end);
+	try {
+		value.load_next(&end);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Left over data in input"));
+	}
+}
+
+void test_read_ahead()
+{
+	/* tiny windows, so that tokens are split between refills */
+	std::istringstream parser("{\"a\": [\"foobar\", [1, [2]], 1234567], \"b\": [{\"x\": true}, -1.5e3, null]}");
+	json::LoadOptions options;
+	options.lazy = true;
+	options.read_ahead = 3;
+	json::Value value;
+	value.load_all(parser, options);
+	json::Value &a = value.get("a");
+	json::Value &b = value.get("b");
+	assert(a.load_next().as_string() == "foobar");
+	assert(b.load_next().get("x").as_boolean());
+
+	/* nested lazy arrays refer to the original stream */
+	json::Value inner = a.load_next(NULL, true);
+	assert(b.load_next().as_double() == -1500);
+	assert(inner.load_next().as_integer() == 1);
+	assert(a.load_next().as_integer() == 1234567);
+	json::Value copy = inner;
+	assert(copy.load_next(NULL, true).load_next().as_integer() == 2);
+	bool end = false;
+	a.load_next(&end);
+	assert(end);
+	assert(b.load_next(&end).type() == json::JSON_NULL);
+	assert(!end);
+	b.load_next(&end);
+	assert(end);
+}
+
 void test_lazy_array()
 {
 	std::istringstream parser("{\"a\": [1, \"foo\"], \"b\": [2, \"bar\"]}");
@@ -56,6 +342,1336 @@ void test_lazy_array()
 	assert(b.load_next().as_string() == "bar");
 	b.load_next(&end);
 	assert(end);
+
+	/* the read-ahead window of a small array is only as large as it */
+	assert(a.memory_usage() < 1024);
+}
+
+void test_stats()
+{
+	std::istringstream parser("{\"a\": [1, 2.5, \"x\\n\"], \"b\": [true, null]}");
+	json::Stats stats;
+	json::Value value;
+	value.load_all(parser, false, &stats);
+	assert_stat(stats.nodes[json::JSON_OBJECT] == 1);
+	assert_stat(stats.nodes[json::JSON_ARRAY] == 2);
+	assert_stat(stats.nodes[json::JSON_INTEGER] == 1);
+	assert_stat(stats.nodes[json::JSON_FLOATING] == 1);
+	assert_stat(stats.escapes == 1);
+	assert_stat(stats.string_bytes == 4);
+	assert_stat(stats.max_depth == 3);
+	assert_stat(stats.bytes == parser.str().size());
+
+	/* lazy arrays seek when they are iterated out of order */
+	parser.str("{\"a\": [1, 2], \"b\": [3]}");
+	parser.clear();
+	stats.clear();
+	json::LoadOptions options;
+	options.lazy = true;
+	options.read_ahead = 0;
+	options.stats = &stats;
+	value.load_all(parser, options);
+	assert_stat(stats.nodes[json::JSON_LAZY_ARRAY] == 2);
+	value.get("a").load_next(NULL, false, &stats);
+	value.get("b").load_next(NULL, false, &stats);
+	value.get("a").load_next(NULL, false, &stats);
+	assert_stat(stats.seeks == 3);
+
+	/* unless they have read-ahead windows */
+	parser.str(parser.str());
+	parser.clear();
+	stats.clear();
+	value.load_all(parser, true, &stats);
+	value.get("a").load_next(NULL, false, &stats);
+	value.get("b").load_next(NULL, false, &stats);
+	value.get("a").load_next(NULL, false, &stats);
+	assert_stat(stats.seeks == 2);
+
+	json::Value elem(std::vector<json::Value>(1, 5));
+	std::ostringstream ss;
+	stats.clear();
+	elem.write(ss, 0, &stats);
+	assert_stat(stats.bytes == ss.str().size());
+	assert_stat(stats.nodes[json::JSON_INTEGER] == 1);
+	assert_stat(stats.to_json().get("seeks").as_double() == 0);
+}
+
+void test_prefetcher()
+{
+	std::string input = "[";
+	for (int i = 0; i < 1000; ++i) {
+		if (i)
+			input += ", ";
+		char buf[32];
+		snprintf(buf, sizeof buf, "[%d, \"%d\"]", i, i);
+		input += buf;
+	}
+	input += "]";
+
+	for (size_t depth = 0; depth <= 16; depth += 4) {
+		std::istringstream parser(input);
+		json::Value value;
+		value.load_all(parser, true);
+		json::Prefetcher elements(value, depth);
+		int count = 0;
+		for (json::Prefetcher::iterator i = elements.begin();
+		     i != elements.end(); ++i) {
+			char buf[16];
+			snprintf(buf, sizeof buf, "%d", count);
+			assert((*i).as_array()[0].as_integer() == count);
+			assert(i->as_array()[1].as_string() == buf);
+			count++;
+		}
+		assert(count == 1000);
+	}
+
+	/* stopping early */
+	{
+		std::istringstream parser(input);
+		json::Value value;
+		value.load_all(parser, true);
+		json::Prefetcher elements(value, 2);
+		json::Value elem;
+		assert(elements.next(elem));
+		assert(elem.as_array()[0].as_integer() == 0);
+	}
+
+	/* errors are passed to the consumer */
+	PipeBuf buf("[1, 2, x]");
+	std::istream is(&buf);
+	json::Value value;
+	value.load_all(is, true);
+	json::Prefetcher elements(value, 4);
+	json::Value elem;
+	assert(elements.next(elem) && elem.as_integer() == 1);
+	assert(elements.next(elem) && elem.as_integer() == 2);
+	try {
+		elements.next(elem);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Unknown character in input"));
+	}
+
+	json::Value loaded(json::JSON_ARRAY);
+	try {
+		json::Prefetcher prefetcher(loaded);
+		assert(0);
+	} catch (const json::type_error &e) {
+		assert(e.what() == std::string("Expected type lazy array, but got array"));
+	}
+}
+
+void verify_table(const json::Table &table)
+{
+	assert(table.rows() == 3);
+	const json::Column &id = table.column("id");
+	assert(id.ints.size() == 3);
+	assert(id.ints[0] == 1 && id.ints[1] == 2 && id.ints[2] == 3);
+	assert(!id.is_null(0) && !id.is_null(1) && !id.is_null(2));
+
+	const json::Column &score = table.column("score");
+	assert(score.doubles[0] == 1.5 && score.doubles[1] == 2);
+	assert(score.is_null(2));
+
+	const json::Column &name = table.column("name");
+	assert(name.get_string(0) == "foo");
+	assert(name.is_null(1) && name.get_string(1) == "");
+	assert(name.get_string(2) == "b\u00e4r");
+	assert(name.buffer == "foob\u00e4r");
+}
+
+void test_table()
+{
+	const char *input =
+		"[{\"id\": 1, \"score\": 1.5, \"name\": \"foo\", \"x\": [{}]},"
+		" {\"score\": 2, \"id\": 2, \"name\": null},"
+		" {\"id\": 3, \"name\": \"b\\u00e4r\", \"y\": true}]";
+
+	for (int lazy = 0; lazy < 2; ++lazy) {
+		json::Table table;
+		table.add_column("id", json::COLUMN_INT64);
+		table.add_column("score", json::COLUMN_DOUBLE);
+		table.add_column("name", json::COLUMN_STRING);
+		std::istringstream parser(input);
+		json::Value value;
+		value.load_all(parser, lazy);
+		table.shred(value);
+		verify_table(table);
+	}
+
+	/* forward-only arrays are shredded straight from the stream */
+	PipeBuf buf(input);
+	std::istream is(&buf);
+	json::Value value;
+	value.load_all(is, true);
+	json::Table table;
+	table.add_column("id", json::COLUMN_INT64);
+	table.add_column("score", json::COLUMN_DOUBLE);
+	table.add_column("name", json::COLUMN_STRING);
+	table.shred(value);
+	verify_table(table);
+
+	/* a row with a wrong type is dropped */
+	std::istringstream parser("[{\"id\": 4, \"name\": \"a\"}, "
+				  "{\"name\": \"b\", \"id\": 1.5}]");
+	value.load_all(parser, true);
+	try {
+		table.shred(value);
+		assert(0);
+	} catch (const json::type_error &e) {
+		assert(e.what() == std::string("Expected type integer, but "
+			"got floating in column id"));
+	}
+	assert(table.rows() == 4);
+	assert(table.column("id").ints.size() == 4);
+	assert(table.column("name").buffer == "foob\u00e4ra");
+	assert(table.column("score").is_null(3));
+
+	/* loaded arrays report the column too */
+	parser.str("[{\"id\": 5, \"score\": \"x\"}]");
+	parser.clear();
+	value.load_all(parser);
+	try {
+		table.shred(value);
+		assert(0);
+	} catch (const json::type_error &e) {
+		assert(e.what() == std::string("Expected type floating, but "
+			"got string in column score"));
+	}
+	assert(table.rows() == 4);
+
+	/* duplicate keys are rejected like load() does */
+	parser.str("[{\"id\": 5, \"x\": 1, \"x\": 2}]");
+	parser.clear();
+	value.load_all(parser, true);
+	try {
+		table.shred(value);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Duplicate key in object"));
+	}
+	assert(table.rows() == 4);
+
+	/* numbers of any length */
+	std::string digits = "[{\"score\": 0." + std::string(100, '5') + "}]";
+	parser.str(digits);
+	parser.clear();
+	value.load_all(parser, true);
+	table.shred(value);
+	assert(table.rows() == 5);
+	assert(table.column("score").doubles[4] == 0.5555555555555556);
+
+	table.clear();
+	assert(table.rows() == 0 && table.column("name").buffer.empty());
+}
+
+void test_shapes()
+{
+	const char *input =
+		"[{\"b\": 1, \"a\": {\"x\": 1}, \"c\": 2},"
+		" {\"b\": 3, \"a\": {\"x\": 2}, \"c\": 4},"
+		" {\"b\": 5, \"a\": {\"y\": 3}},"
+		" {\"bb\": 6, \"b\": 7, \"a\": null},"
+		" {\"\\u0062b\": 8, \"\\u0062\": 9, \"a\": [], \"d\": 0},"
+		" {\"bb\": 10, \"b\": 11, \"a\": 1, \"d\": 0}, {}]";
+
+	json::LoadOptions options;
+	options.cache_shapes = false;
+	std::istringstream parser(input);
+	json::Value expected;
+	expected.load_all(parser, options);
+
+	json::Stats stats;
+	options.cache_shapes = true;
+	options.stats = &stats;
+	parser.str(input);
+	parser.clear();
+	json::Value value;
+	value.load_all(parser, options);
+	assert(value == expected);
+	assert(value.as_array()[5].as_object().size() == 4);
+	assert_stat(stats.shape_hits == 10);
+	assert_stat(stats.shape_misses == 12);
+
+	/* lazy arrays cache the shapes of their elements */
+	stats.clear();
+	options.lazy = true;
+	parser.str(input);
+	parser.clear();
+	value.load_all(parser, options);
+	for (size_t i = 0; i < expected.as_array().size(); ++i)
+		assert(value.load_next(NULL, false, &stats) ==
+		       expected.as_array()[i]);
+	assert_stat(stats.shape_hits == 10);
+
+	verify_error("[{\"a\": 1, \"b\": 2}, {\"a\": 1, \"a\": 2}]",
+		     "Duplicate key in object");
+	verify_error("[{\"a\": 1}, {\"a\": 1, \"a\": 2}]",
+		     "Duplicate key in object");
+}
+
+void test_offset_index()
+{
+	/* strings with brackets, commas, quotes and backslashes */
+	const char *path = "test-index.json";
+	const char *input =
+		" [{\"a\": \"[,\\\"]\"}, [1, [2, 3]], \"\\\\\", \"x\\\\\\\"{,\","
+		"  4, {\"b\": {\"c\": [5, 6]}}, \"]\", null ,] \n";
+	{
+		std::ofstream os(path);
+		os << input;
+	}
+	std::istringstream parser(input);
+	json::Value expected;
+	expected.load_all(parser);
+	size_t count = expected.as_array().size();
+	assert(count == 8);
+
+	/* chunks split the input at every place */
+	for (size_t chunk = 1; chunk <= strlen(input); ++chunk) {
+		json::OffsetIndex index;
+		index.build(path, 1000, chunk);
+		assert(index.size() == count);
+		std::ifstream is(path, std::ios::binary);
+		for (size_t i = 0; i <= count; ++i) {
+			json::Value array = index.open(is, i);
+			bool end = false;
+			for (size_t j = i; j < count; ++j)
+				assert(array.load_next(&end) ==
+				       expected.as_array()[j]);
+			array.load_next(&end);
+			assert(end);
+		}
+	}
+
+	json::OffsetIndex index;
+	std::string index_path = json::OffsetIndex::sidecar_path(path);
+	assert(!index.load(index_path, path));
+	index.load_or_build(path);
+	json::OffsetIndex loaded;
+	assert(loaded.load(index_path, path));
+	assert(loaded.size() == count);
+	for (size_t i = 0; i <= count; ++i)
+		assert(loaded.offset(i) == index.offset(i));
+
+	/* the index is stale after the file changes */
+	{
+		std::ofstream os(path);
+		os << "[1]";
+	}
+	assert(!loaded.load(index_path, path));
+	remove(index_path.c_str());
+
+	{
+		std::ofstream os(path);
+		os << "[1, \"]\"] [2]";
+	}
+	try {
+		index.build(path, 2, 1);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Left over data in input"));
+	}
+	remove(path);
+}
+
+std::string write_cached(const json::Value &value, int indent,
+			 json::Stats *stats)
+{
+	json::WriteOptions options;
+	options.indent = indent;
+	options.cache = true;
+	options.stats = stats;
+	std::ostringstream ss;
+	value.write(ss, options);
+
+	/* must be the same as without the cache */
+	std::ostringstream expected;
+	value.write(expected, indent);
+	assert(ss.str() == expected.str());
+	return ss.str();
+}
+
+void test_write_cache()
+{
+	std::istringstream parser(
+		"{\"status\": {\"count\": 1, \"name\": \"a name that is long enough for the cache\"},"
+		" \"items\": [{\"id\": 1, \"tags\": [\"first tag\", \"second tag\", \"third tag\", \"fourth tag\"]},"
+		"             {\"id\": 2, \"tags\": [\"fifth tag\", \"sixth tag\"]}],"
+		" \"static\": {\"list\": [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16]}}");
+	json::Value doc;
+	doc.load_all(parser);
+
+	json::Stats stats;
+	write_cached(doc, 0, &stats);
+	assert_stat(stats.cached_writes == 0);
+
+	/* nothing changed, the root is copied */
+	stats.clear();
+	write_cached(doc, 0, &stats);
+	assert_stat(stats.cached_writes == 1);
+
+	/* reading through a const reference keeps the caches */
+	const json::Value &const_doc = doc;
+	assert(const_doc.get("status").get("count").as_integer() == 1);
+	stats.clear();
+	write_cached(doc, 0, &stats);
+	assert_stat(stats.cached_writes == 1);
+
+	/* and so does reading through a non-const one */
+	assert(doc.get("status").get("count").as_integer() == 1);
+	stats.clear();
+	write_cached(doc, 0, &stats);
+	assert_stat(stats.cached_writes == 1);
+	stats.clear();
+	write_cached(doc, 0, &stats);
+	assert_stat(stats.cached_writes == 1);
+
+	/* a lent container that was modified is kept on the next write */
+	json::Value lent_doc = doc;
+	lent_doc.get("static").get("list").as_array()[0] = json::Value(0);
+	write_cached(lent_doc, 0, NULL);
+	stats.clear();
+	write_cached(lent_doc, 0, &stats);
+	assert_stat(stats.cached_writes == 2);	/* status and items */
+	stats.clear();
+	write_cached(lent_doc, 0, &stats);
+	assert_stat(stats.cached_writes == 1);
+
+	/* only the path to the changed leaf is encoded again */
+	doc.get("status").get("count") = json::Value(2);
+	stats.clear();
+	std::string out = write_cached(doc, 0, &stats);
+	assert(out.find("\"count\": 2") != std::string::npos);
+	assert_stat(stats.cached_writes == 2);	/* items and static */
+
+	doc.get("items").as_array()[1].get("tags").append("seven");
+	doc.set("new", json::Value(true));
+	stats.clear();
+	out = write_cached(doc, 0, &stats);
+	assert(out.find("\"seven\"") != std::string::npos);
+	/* status was modified through references, which leaves items[0] and static */
+	assert_stat(stats.cached_writes == 2);
+
+	/* references kept across writes modify the output too */
+	std::vector<json::Value> &list =
+		doc.get("static").get("list").as_array();
+	json::Value &count = doc.get("status").get("count");
+	write_cached(doc, 0, NULL);
+	list.push_back(17);
+	count = json::Value(3);
+	out = write_cached(doc, 0, NULL);
+	assert(out.find("16, 17]") != std::string::npos);
+	assert(out.find("\"count\": 3") != std::string::npos);
+
+	/* pretty-printing doesn't use the minified output */
+	stats.clear();
+	write_cached(doc, 4, &stats);
+	assert_stat(stats.cached_writes == 0);
+	stats.clear();
+	write_cached(doc, 4, &stats);
+	assert_stat(stats.cached_writes == 1);	/* items[0] */
+
+	/* a copy doesn't share the cache */
+	json::Value copy = doc;
+	copy.get("static").get("list").append(13);
+	write_cached(copy, 4, NULL);
+	write_cached(doc, 4, NULL);
+}
+
+void verify_limit(const std::string &input, const json::LoadOptions &options,
+		  const char *error)
+{
+	json::Value val;
+	std::istringstream ss(input);
+	try {
+		val.load_all(ss, options);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string(error));
+	}
+}
+
+void test_limits()
+{
+	/* nesting far beyond the size of the C++ stack */
+	json::LoadOptions options;
+	verify_limit(std::string(1000000, '['), options,
+		     "Input is nested too deeply");
+	options.max_depth = 0;
+	std::istringstream deep(std::string(20000, '[') +
+				std::string(20000, ']'));
+	json::Value deep_val;
+	deep_val.load_all(deep, options);
+	options = json::LoadOptions();
+
+	std::string nested;
+	for (int i = 0; i < 50; ++i)
+		nested += i % 2 ? "{\"a\": " : "[";
+	nested += "1";
+	for (int i = 49; i >= 0; --i)
+		nested += i % 2 ? "}" : "]";
+	json::Value val;
+	std::istringstream parser(nested);
+	val.load_all(parser);
+	options.max_depth = 50;
+	parser.str(nested);
+	parser.clear();
+	val.load_all(parser, options);
+	options.max_depth = 49;
+	verify_limit(nested, options, "Input is nested too deeply");
+
+	options = json::LoadOptions();
+	options.max_string_length = 5;
+	parser.str("[\"abcde\", {\"abcde\": -12.5}]");
+	parser.clear();
+	val.load_all(parser, options);
+	verify_limit("[\"abcdef\"]", options, "String too long");
+	verify_limit("{\"abcdef\": 1}", options, "String too long");
+	verify_limit("[\"abcd\\u00e4\"]", options, "String too long");
+	verify_limit("[123456]", options, "Number too long");
+
+	/* also when the key shape was cached from the previous object */
+	options.max_string_length = 8;
+	verify_limit("[{\"abcd\": 1}, {\"abcdefghi\": 2}]", options,
+		     "String too long");
+
+	options = json::LoadOptions();
+	options.max_elements = 5;
+	parser.str("{\"a\": [1, 2], \"b\": null}");
+	parser.clear();
+	val.load_all(parser, options);
+	verify_limit("{\"a\": [1, 2, 3], \"b\": null}", options,
+		     "Too many elements in input");
+
+	/* checked as values are parsed */
+	std::string big = "[";
+	for (int i = 0; i < 1000; ++i)
+		big += "[1, 2, 3], ";
+	big += "[]]";
+	options = json::LoadOptions();
+	options.max_bytes = big.size();
+	parser.str(big);
+	parser.clear();
+	val.load_all(parser, options);
+	options.max_bytes = 1000;
+	verify_limit(big, options, "Input is too large");
+
+	/* also when the stream can't tell its position */
+	PipeBuf pipe(big);
+	std::istream is(&pipe);
+	try {
+		val.load_all(is, options);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Input is too large"));
+	}
+
+	/* a single long string */
+	std::string str = "[\"" + std::string(100000, 'a') + "\"]";
+	verify_limit(str, options, "Input is too large");
+	try {
+		val.load_all(str.data(), str.size(), options);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Input is too large"));
+	}
+
+	/* the limits apply to each element of a lazy array */
+	options = json::LoadOptions();
+	options.lazy = true;
+	options.max_elements = 3;
+	parser.str("[[1, 2], [3, 4], [5, 6, 7]]");
+	parser.clear();
+	val.load_all(parser, options);
+	assert(val.load_next().as_array().size() == 2);
+	assert(val.load_next().as_array().size() == 2);
+	try {
+		val.load_next();
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Too many elements in input"));
+	}
+}
+
+void test_keys()
+{
+	std::istringstream parser("{\"id\": 1, \"name\": \"foo\", \"a key that "
+				  "is too long for a short string\": true}");
+	json::Value value;
+	value.load_all(parser);
+	const json::Value &const_value = value;
+
+	const json::Key id("id");
+	const json::Key missing(std::string("missing"));
+	assert(value.get("id") == json::Value(1));
+	assert(value.get(std::string("name")).as_string() == "foo");
+	assert(value.get(id) == json::Value(1));
+	assert(const_value.get(id) == json::Value(1));
+	assert(value.get(missing).type() == json::JSON_NULL);
+	assert(value.get("a key that is too long for a short string") ==
+	       json::Value(true));
+#if __cplusplus >= 201703L
+	std::string_view view("name and more", 4);
+	assert(value.get(view).as_string() == "foo");
+	assert(value.contains(view));
+	assert(!value.contains(std::string_view("id", 1)));
+#endif
+
+	assert(value.contains("name") && value.contains(id));
+	assert(!value.contains("nam") && !value.contains(missing));
+	assert(const_value.find("name")->as_string() == "foo");
+	assert(const_value.find(missing) == NULL);
+	assert(value.find(std::string("missing")) == NULL);
+
+	value.find(id)->as_int64();
+	*value.find("id") = json::Value(2);
+	assert(value.get(id) == json::Value(2));
+
+	/* lookups from a non-object */
+	try {
+		json::Value(1).contains(id);
+		assert(0);
+	} catch (const json::type_error &e) {
+	}
+}
+
+/* Loads and validates the input, returns the error or "" */
+std::string schema_check(const json::Schema &schema, const char *input,
+			 bool lazy = false)
+{
+	json::LoadOptions options;
+	options.schema = &schema;
+	options.lazy = lazy;
+	std::string load_error;
+	try {
+		std::istringstream parser(input);
+		json::Value value;
+		value.load_all(parser, options);
+		if (value.type() == json::JSON_LAZY_ARRAY) {
+			bool end = false;
+			while (!end)
+				value.load_next(&end);
+		}
+	} catch (const json::schema_error &e) {
+		load_error = e.what();
+	}
+	/* validating without loading gives the same result */
+	std::istringstream parser(input);
+	std::string error;
+	bool valid = schema.validate(parser, &error);
+	assert(valid == load_error.empty());
+	assert(error == load_error);
+	return error;
+}
+
+void test_schema()
+{
+	std::istringstream parser(
+		"{\"type\": \"object\", \"title\": \"A record\","
+		" \"required\": [\"id\", \"name\"],"
+		" \"properties\": {"
+		"  \"id\": {\"type\": \"integer\", \"minimum\": 1},"
+		"  \"name\": {\"type\": \"string\", \"maxLength\": 4},"
+		"  \"kind\": {\"enum\": [\"a\", \"b\", null]},"
+		"  \"score\": {\"type\": [\"number\", \"null\"], \"maximum\": 10},"
+		"  \"tags\": {\"type\": \"array\", \"items\": {\"type\": \"string\"}}}}");
+	json::Value value;
+	value.load_all(parser);
+	json::Schema schema(value);
+
+	assert(schema_check(schema, "{\"id\": 1, \"name\": \"b\u00e4r\", "
+			    "\"kind\": null, \"score\": 2.5, \"x\": [{}], "
+			    "\"tags\": []}") == "");
+	/* an integral float is a valid integer */
+	assert(schema_check(schema, "{\"id\": 2.0, \"name\": \"\"}") == "");
+
+	assert(schema_check(schema, "[]") ==
+	       "Schema violation at byte 0: expected object, but got array");
+	assert(schema_check(schema, "{\"id\": \"1\", \"name\": \"a\"}") ==
+	       "Schema violation at byte 7: expected integer, but got string");
+	assert(schema_check(schema, "{\"id\": 1.5, \"name\": \"a\"}") ==
+	       "Schema violation at byte 10: expected integer, but got floating");
+	assert(schema_check(schema, "{\"id\": 0, \"name\": \"a\"}") ==
+	       "Schema violation at byte 8: 0 is less than the minimum 1");
+	assert(schema_check(schema, "{\"id\": 1, \"name\": \"a\", \"score\": 11}") ==
+	       "Schema violation at byte 34: 11 is more than the maximum 10");
+	assert(schema_check(schema, "{\"id\": 1, \"name\": \"abcde\"}") ==
+	       "Schema violation at byte 25: string is longer than 4 characters");
+	assert(schema_check(schema, "{\"id\": 1, \"name\": \"a\", \"kind\": \"c\"}") ==
+	       "Schema violation at byte 34: value is not one of the enumerated values");
+	assert(schema_check(schema, "{\"id\": 1}") ==
+	       "Schema violation at byte 8: missing required key name");
+	assert(schema_check(schema, "{\"id\": 1, \"name\": \"a\", \"tags\": [\"a\", 1]}") ==
+	       "Schema violation at byte 37: expected string, but got number");
+
+	/* errors in the input are reported as usual */
+	std::istringstream bad("{\"id\": 1, \"name\": x}");
+	std::string error;
+	assert(!schema.validate(bad, &error));
+	assert(error == "Unknown character in input");
+
+	/* elements of lazy arrays are checked when they are loaded */
+	parser.str("{\"items\": {\"type\": \"object\", \"required\": [\"id\"]}}");
+	parser.clear();
+	value.load_all(parser);
+	json::Schema list(value);
+	assert(schema_check(list, "[{\"id\": 1}, {\"id\": 2}]", true) == "");
+	assert(schema_check(list, "[{\"id\": 1}, {\"ID\": 2}]", true) ==
+	       "Schema violation at byte 20: missing required key id");
+
+	/* unsupported keywords are rejected */
+	const char *unsupported[] = {
+		"{\"pattern\": \"a*\"}",
+		"{\"type\": \"decimal\"}",
+		"{\"properties\": {\"a\": {\"oneOf\": []}}}",
+	};
+	for (size_t i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); ++i) {
+		parser.str(unsupported[i]);
+		parser.clear();
+		value.load_all(parser);
+		try {
+			json::Schema schema(value);
+			assert(0);
+		} catch (const std::invalid_argument &e) {
+		}
+	}
+}
+
+/* Returns the input a byte at a time, so that every token is split */
+class ByteSource: public json::Source {
+public:
+	ByteSource(const std::string &data) :
+		m_data(data), m_pos(0)
+	{}
+
+	size_t read(char *buf, size_t len)
+	{
+		if (m_pos == m_data.size() || len == 0)
+			return 0;
+		*buf = m_data[m_pos++];
+		return 1;
+	}
+
+private:
+	std::string m_data;
+	size_t m_pos;
+};
+
+void test_sources()
+{
+	const char *doc = "{\"a\": [1, -2.5e3, \"x\\u00e4y\"], \"b\": [true, null]}";
+	json::Value expected;
+	std::istringstream parser(doc);
+	expected.load_all(parser);
+
+	json::Value val;
+	val.load_all(doc, strlen(doc));
+	assert(val == expected);
+
+	ByteSource bytes(doc);
+	val.load_all(bytes);
+	assert(val == expected);
+
+	FILE *file = tmpfile();
+	assert(file != NULL);
+	fputs(doc, file);
+	rewind(file);
+	json::FileSource file_source(file);
+	val.load_all(file_source);
+	assert(val == expected);
+	rewind(file);
+	json::FdSource fd_source(fileno(file));
+	val.load_all(fd_source);
+	assert(val == expected);
+	fclose(file);
+
+	/* errors are the same as from a stream */
+	try {
+		val.load_all("[1, 2] 3", 8);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Left over data in input"));
+	}
+	ByteSource truncated("[1, \"ab");
+	try {
+		val.load_all(truncated);
+		assert(0);
+	} catch (const json::decode_error &e) {
+	}
+
+	json::LoadOptions options;
+	options.lazy = true;
+	try {
+		val.load_all("[1]", 3, options);
+		assert(0);
+	} catch (const std::invalid_argument &e) {
+	}
+
+	/* the stream is left right after each value */
+	parser.str("1 [2, 3]{\"a\": 4} \"b\" x");
+	parser.clear();
+	val.load(parser);
+	assert(val.as_integer() == 1);
+	val.load(parser);
+	assert(val.as_array().size() == 2);
+	assert(parser.peek() == '{');
+	val.load(parser);
+	assert(val.get("a").as_integer() == 4);
+	val.load(parser);
+	assert(val.as_string() == "b");
+	std::string rest;
+	parser >> rest;
+	assert(rest == "x");
+
+	PipeBuf buf("[1] [2] 3");
+	std::istream pipe(&buf);
+	val.load(pipe);
+	assert(val.as_array()[0].as_integer() == 1);
+	val.load(pipe);
+	assert(val.as_array()[0].as_integer() == 2);
+	val.load(pipe);
+	assert(val.as_integer() == 3);
+	assert(pipe.eof());
+}
+
+/* Returns false if the build doesn't support the compression */
+bool compress_doc(const json::Value &value, json::Compression type,
+		  std::string *out)
+{
+	std::ostringstream os, plain;
+	value.write(plain);
+	try {
+		json::CompressBuf buf(os, type, 1);
+		std::ostream compressed(&buf);
+		value.write(compressed);
+		assert(compressed.tellp() == std::streampos(plain.str().size()));
+		buf.finish();
+	} catch (const std::invalid_argument &e) {
+		return false;
+	}
+	*out = os.str();
+	return true;
+}
+
+void test_compression(json::Compression type)
+{
+	json::Value value(json::JSON_ARRAY);
+	for (int i = 0; i < 2000; ++i) {
+		json::Value record(json::JSON_OBJECT);
+		record.set("id", i);
+		char name[32];
+		sprintf(name, "record %d", i);
+		record.set("name", name);
+		record.set("tags", json::Value(std::vector<json::Value>(i % 5, i)));
+		value.append(record);
+	}
+	std::string data;
+	if (!compress_doc(value, type, &data))
+		return;
+	std::ostringstream plain;
+	value.write(plain);
+	assert(data.size() < plain.str().size() / 4);
+
+	/* tiny blocks, so that values are split between them */
+	for (size_t blocks = 0; blocks < 3; ++blocks) {
+		std::istringstream input(data);
+		json::DecompressBuf buf(input, type, blocks, 100);
+		std::istream is(&buf);
+		json::Value loaded;
+		loaded.load_all(is);
+		assert(loaded == value);
+	}
+
+	/* lazy arrays seek back to the array */
+	std::istringstream input(data);
+	json::DecompressBuf buf(input, type, 2, 1000);
+	std::istream is(&buf);
+	json::Value lazy;
+	json::LoadOptions options;
+	options.lazy = true;
+	options.read_ahead = 300;
+	lazy.load_all(is, options);
+	for (int i = 0; i < 2000; ++i)
+		assert(lazy.load_next() == value.as_array()[i]);
+	bool end = false;
+	lazy.load_next(&end);
+	assert(end);
+
+	/* a Source can't rewind, so the array is iterated forward */
+	ByteSource bytes(data);
+	json::DecompressBuf source_buf(bytes, type);
+	std::istream source_is(&source_buf);
+	lazy.load_all(source_is, true);
+	for (int i = 0; i < 2000; ++i)
+		assert(lazy.load_next() == value.as_array()[i]);
+	lazy.load_next(&end);
+	assert(end);
+
+	std::istringstream truncated(data.substr(0, data.size() / 2));
+	json::DecompressBuf truncated_buf(truncated, type);
+	std::istream truncated_is(&truncated_buf);
+	try {
+		json::Value(0).load_all(truncated_is);
+		assert(0);
+	} catch (const json::decode_error &e) {
+		assert(e.what() == std::string("Truncated compressed input"));
+	}
+
+	std::string corrupt = data;
+	for (size_t i = 20; i < 40; ++i)
+		corrupt[i] ^= 0x55;
+	std::istringstream corrupt_input(corrupt);
+	json::DecompressBuf corrupt_buf(corrupt_input, type, 0);
+	std::istream corrupt_is(&corrupt_buf);
+	try {
+		json::Value(0).load_all(corrupt_is);
+		assert(0);
+	} catch (const json::decode_error &e) {
+	}
+
+	/* streams can be concatenated */
+	std::string first, second;
+	assert(compress_doc(json::Value("foo"), type, &first));
+	assert(compress_doc(json::Value("bar"), type, &second));
+	std::istringstream joined(first + second);
+	json::DecompressBuf joined_buf(joined, type);
+	std::istream joined_is(&joined_buf);
+	std::string text;
+	std::getline(joined_is, text);
+	assert(text == "\"foo\"\"bar\"");
+}
+
+void test_memory()
+{
+	std::string doc = "{\"list\": [";
+	for (int i = 0; i < 100; ++i) {
+		char buf[128];
+		sprintf(buf, "%s{\"id\": %d, \"text\": \"a string that is long enough for the heap\"}",
+			i ? ", " : "", i);
+		doc += buf;
+	}
+	doc += "], \"name\": \"x\", \"n\": 1}";
+	json::Value value;
+	std::istringstream parser(doc);
+	value.load_all(parser);
+	json::Value copy = value;
+
+	json::MemoryUsage usage;
+	value.memory_usage(&usage);
+	assert(usage.total == value.memory_usage());
+	uint64_t sum = 0;
+	for (int i = 0; i <= json::JSON_LAZY_ARRAY; ++i)
+		sum += usage.types[i];
+	assert(sum == usage.total);
+	assert(usage.types[json::JSON_STRING] >= 100 * 40);
+	assert(usage.types[json::JSON_INTEGER] == 0);
+	assert(usage.map_nodes == 203 * 4 * sizeof(void *));
+	assert(usage.members.size() == 3);
+	assert(usage.members["list"] + usage.members["name"] +
+	       usage.members["n"] < usage.total);
+	assert(usage.members["list"] > 100 * usage.members["n"]);
+	/* the array has grown by push_back */
+	assert(usage.array_slack > 0);
+	assert(usage.to_json().get("members").get("n").as_double() ==
+	       usage.members["n"]);
+
+	value.shrink_to_fit();
+	assert(value == copy);
+	json::MemoryUsage shrunk;
+	value.memory_usage(&shrunk);
+	assert(shrunk.array_slack == 0);
+	assert(shrunk.total == usage.total - usage.array_slack -
+	       usage.string_slack);
+
+	assert(json::Value(std::string(1000, 'x')).memory_usage() > 1000);
+
+	/* cached output is counted too */
+	std::ostringstream os;
+	json::WriteOptions options;
+	options.cache = true;
+	value.write(os, options);
+	json::MemoryUsage cached;
+	value.memory_usage(&cached);
+	assert(cached.output_cache >= os.str().size());
+	assert(cached.total == shrunk.total + cached.output_cache);
+}
+
+void test_hash()
+{
+	assert(json::Value(1).hash() == json::Value(1.0).hash());
+	assert(json::Value(0.0).hash() == json::Value(-0.0).hash());
+	assert(json::Value(1).hash() != json::Value(2).hash());
+	assert(json::Value("1").hash() != json::Value(1).hash());
+	assert(json::Value(json::JSON_ARRAY).hash() !=
+	       json::Value(json::JSON_OBJECT).hash());
+
+	std::istringstream parser("{\"a\": [1, 2.5, \"x\"], \"b\": {\"c\": null}}");
+	json::Value a;
+	a.load_all(parser);
+	json::Value b(json::JSON_OBJECT);
+	json::Value list(json::JSON_ARRAY);
+	list.append(1.0);
+	list.append(2.5);
+	list.append("x");
+	json::Value inner(json::JSON_OBJECT);
+	inner.set("c", json::Value());
+	b.set("b", inner);
+	b.set("a", list);
+	assert(a == b);
+	size_t hash = a.hash();
+	assert(b.hash() == hash);
+
+	/* the kept hash is dropped when a nested value is modified */
+	b.get("b").set("d", true);
+	assert(b.hash() != hash);
+	assert(a != b);
+	b.get("b").as_object().erase("d");
+	assert(b.hash() == hash);
+	assert(a == b);
+
+	/* also through a reference taken before the hashes were kept */
+	json::Value &nested = a.get("b");
+	a.hash();
+	b.hash();
+	nested.as_object()["y"] = 2;
+	assert(a.hash() != hash);
+	assert(a != b);
+	b.get("b").set("y", 2);
+	assert(a == b);
+
+	/* reading through the reference keeps the hash until a change */
+	hash = a.hash();
+	assert(nested.get("y").as_integer() == 2);
+	assert(a.hash() == hash);
+	assert(a == b);
+	nested.get("y") = json::Value(3);
+	assert(a.hash() != hash);
+	assert(a != b);
+	nested.get("y") = json::Value(2);
+	assert(a.hash() == hash);
+
+	/* sharing identical records */
+	std::string doc = "[";
+	for (int i = 0; i < 100; ++i) {
+		char buf[128];
+		sprintf(buf, "%s{\"id\": %d, \"user\": {\"name\": \"%s\", \"tags\": [1, 2]}}",
+			i ? ", " : "", i, i % 2 ? "alice" : "bob");
+		doc += buf;
+	}
+	doc += ", [1], [1.0], [1]]";
+	json::Stats stats;
+	json::LoadOptions options;
+	options.share_subtrees = true;
+	options.stats = &stats;
+	json::Value shared;
+	parser.str(doc);
+	parser.clear();
+	shared.load_all(parser, options);
+	json::Value plain;
+	parser.str(doc);
+	parser.clear();
+	plain.load_all(parser);
+	assert(shared == plain);
+	assert(shared.hash() == plain.hash());
+	/* two users and one list of tags, [1] once */
+	assert_stat(stats.shared == 98 + 99 + 1);
+	assert(shared.memory_usage() < plain.memory_usage() / 2);
+
+	/* 1 and 1.0 are equal, but written differently */
+	std::ostringstream os, expected;
+	shared.write(os);
+	plain.write(expected);
+	assert(os.str() == expected.str());
+
+	/* modifying a shared value copies it */
+	json::Value &user = shared.as_array()[2].get("user");
+	user.set("admin", true);
+	user.get("tags").append(3);
+	assert(shared.as_array()[0].get("user") ==
+	       plain.as_array()[0].get("user"));
+	assert(shared.as_array()[2].get("user").get("tags").as_array().size() == 3);
+	assert(shared.as_array()[4].get("user").get("tags").as_array().size() == 2);
+	assert(!shared.as_array()[4].get("user").contains("admin"));
+	assert(shared != plain);
+
+	options.lazy = true;
+	parser.str("{\"a\": [1], \"b\": [1], \"c\": [[1], [1]]}");
+	parser.clear();
+	shared.load_all(parser, options);
+	assert(shared.get("c").load_next() == shared.get("c").load_next());
+	try {
+		shared.hash();
+		assert(0);
+	} catch (const json::type_error &e) {
+	}
+}
+
+json::Value parse(const char *s)
+{
+	std::istringstream parser(s);
+	json::Value val;
+	val.load_all(parser);
+	return val;
+}
+
+std::string encode(const json::Value &val)
+{
+	std::ostringstream os;
+	val.write(os);
+	return os.str();
+}
+
+void verify_diff(const char *from, const char *to)
+{
+	json::Value a = parse(from), b = parse(to);
+	json::Value patched = a;
+	patched.apply_patch(json::diff(a, b));
+	assert(patched == b);
+	patched = a;
+	patched.merge_patch(json::merge_diff(a, b));
+	assert(patched == b);
+}
+
+void verify_patch_error(const char *doc, const char *patch, const char *error)
+{
+	json::Value val = parse(doc);
+	try {
+		val.apply_patch(parse(patch));
+		assert(0);
+	} catch (const json::patch_error &e) {
+		assert(e.what() == std::string(error));
+	}
+}
+
+void test_patch()
+{
+	json::Value a = parse("{\"a\": 1, \"b\": [1, 2, 3, 4, 5], \"c/d\": {\"e\": true}}");
+	json::Value b = parse("{\"a\": 1.0, \"b\": [1, 3, 4, 6, 5], \"c/d\": {\"e\": false}, \"f\": null}");
+	json::Value patch = json::diff(a, b);
+	assert(encode(patch) == encode(parse("["
+		"{\"op\": \"remove\", \"path\": \"/b/1\"},"
+		"{\"op\": \"add\", \"path\": \"/b/3\", \"value\": 6},"
+		"{\"op\": \"replace\", \"path\": \"/c~1d/e\", \"value\": false},"
+		"{\"op\": \"add\", \"path\": \"/f\", \"value\": null}]")));
+	json::Value patched = a;
+	patched.apply_patch(patch);
+	assert(patched == b);
+	assert(json::diff(a, a).as_array().empty());
+
+	verify_diff("[]", "[1, 2, 3]");
+	verify_diff("[1, 2, 3]", "[]");
+	verify_diff("[1, 2, 3]", "[3, 2, 1]");
+	verify_diff("[{\"a\": 1}, {\"b\": 2}]", "[{\"b\": 2}, {\"a\": 1}, {\"a\": 2}]");
+	verify_diff("[[1, 2], [3]]", "[[1, 2, 3], [3], 4]");
+	verify_diff("{\"a\": {\"b\": {\"c\": 1}}}", "{\"a\": {\"b\": [1]}}");
+	verify_diff("{\"a\": 1}", "[1]");
+	verify_diff("1", "\"x\"");
+
+	/* arrays too large for LCS are diffed by position */
+	json::Value big(json::JSON_ARRAY);
+	for (int i = 0; i < 2000; ++i)
+		big.append(i);
+	json::Value reversed(json::JSON_ARRAY);
+	for (int i = 2000; i-- > 0;)
+		reversed.append(i);
+	patched = big;
+	patched.apply_patch(json::diff(big, reversed));
+	assert(patched == reversed);
+
+	/* shared and unchanged subtrees are skipped */
+	json::LoadOptions options;
+	options.share_subtrees = true;
+	std::istringstream parser("[{\"x\": [1, 2]}, {\"x\": [1, 2]}, {\"x\": [1, 3]}]");
+	json::Value doc;
+	doc.load_all(parser, options);
+	json::Value changed = doc;
+	changed.as_array()[2].get("x").as_array()[1] = 2;
+	assert(encode(json::diff(doc, changed)) == encode(parse(
+		"[{\"op\": \"replace\", \"path\": \"/2/x/1\", \"value\": 2}]")));
+
+	/* equal hashes are confirmed */
+	json::Value stale = parse("{\"a\": {\"b\": 1}}");
+	json::Value fresh = stale;
+	json::Value &inner = stale.get("a");
+	stale.hash();
+	fresh.hash();
+	inner.set("c", 2);
+	assert(encode(json::diff(fresh, stale)) == encode(parse(
+		"[{\"op\": \"add\", \"path\": \"/a/c\", \"value\": 2}]")));
+
+	/* a reference to the new value can't modify the patch */
+	json::Value from = parse("{}");
+	json::Value to = parse("{\"new\": [1, 2]}");
+	std::vector<json::Value> &items = to.get("new").as_array();
+	patch = json::diff(from, to);
+	items.push_back(3);
+	assert(encode(patch) == encode(parse(
+		"[{\"op\": \"add\", \"path\": \"/new\", \"value\": [1, 2]}]")));
+	json::Value merge_to = parse("{\"new\": [1, 2]}");
+	std::vector<json::Value> &merge_items = merge_to.get("new").as_array();
+	json::Value merge_patch = json::merge_diff(from, merge_to);
+	merge_items.push_back(3);
+	assert(merge_patch == parse("{\"new\": [1, 2]}"));
+
+	/* the examples of RFC 6902 */
+	patched = parse("{\"foo\": [\"bar\", \"baz\"]}");
+	patched.apply_patch(parse("[{\"op\": \"add\", \"path\": \"/foo/1\", \"value\": \"qux\"},"
+		"{\"op\": \"add\", \"path\": \"/foo/-\", \"value\": \"end\"},"
+		"{\"op\": \"test\", \"path\": \"/foo/0\", \"value\": \"bar\"}]"));
+	assert(patched == parse("{\"foo\": [\"bar\", \"qux\", \"baz\", \"end\"]}"));
+	patched = parse("{\"foo\": {\"bar\": \"baz\", \"waldo\": \"fred\"}, \"qux\": {\"corge\": \"grault\"}}");
+	patched.apply_patch(parse("[{\"op\": \"move\", \"from\": \"/foo/waldo\", \"path\": \"/qux/thud\"},"
+		"{\"op\": \"copy\", \"from\": \"/qux\", \"path\": \"/foo/copy\"},"
+		"{\"op\": \"remove\", \"path\": \"/foo/bar\"}]"));
+	assert(patched == parse("{\"foo\": {\"copy\": {\"corge\": \"grault\", \"thud\": \"fred\"}},"
+		"\"qux\": {\"corge\": \"grault\", \"thud\": \"fred\"}}"));
+	patched = parse("{\"a/b\": 0, \"m~n\": 8}");
+	patched.apply_patch(parse("[{\"op\": \"test\", \"path\": \"/a~1b\", \"value\": 0.0},"
+		"{\"op\": \"replace\", \"path\": \"/m~0n\", \"value\": 9}]"));
+	assert(patched == parse("{\"a/b\": 0, \"m~n\": 9}"));
+	patched.apply_patch(parse("[{\"op\": \"replace\", \"path\": \"\", \"value\": [1]}]"));
+	assert(patched == parse("[1]"));
+
+	/* only the containers along the patched path are encoded again */
+	json::Value cached = parse("{\"a\": {\"b\": [\"a string that makes the output long enough\", 1]},"
+		"\"c\": [\"another string that makes the output long enough for the cache\"],"
+		"\"d\": [\"and a third one that makes the output long enough for the cache\"]}");
+	write_cached(cached, 0, NULL);
+	cached.apply_patch(parse("[{\"op\": \"replace\", \"path\": \"/a/b/1\", \"value\": 2}]"));
+	json::Stats stats;
+	write_cached(cached, 0, &stats);
+	assert_stat(stats.cached_writes == 2);	/* c and d */
+	stats.clear();
+	write_cached(cached, 0, &stats);
+	assert_stat(stats.cached_writes == 1);
+
+	verify_patch_error("{}", "{}", "JSON Patch must be an array");
+	verify_patch_error("{}", "[{\"path\": \"\"}]", "Patch operation needs a string 'op'");
+	verify_patch_error("{}", "[{\"op\": \"add\", \"path\": \"/a\"}]", "Patch operation needs a 'value'");
+	verify_patch_error("{}", "[{\"op\": \"swap\", \"path\": \"\"}]", "Unknown patch operation: swap");
+	verify_patch_error("{\"a\": 1}", "[{\"op\": \"test\", \"path\": \"/a\", \"value\": 2}]", "Test failed: /a");
+	verify_patch_error("{}", "[{\"op\": \"remove\", \"path\": \"/a\"}]", "Path not found: /a");
+	verify_patch_error("{}", "[{\"op\": \"replace\", \"path\": \"/a\", \"value\": 1}]", "Path not found: /a");
+	verify_patch_error("[1]", "[{\"op\": \"add\", \"path\": \"/2\", \"value\": 1}]", "Path not found: /2");
+	verify_patch_error("[1]", "[{\"op\": \"remove\", \"path\": \"/01\"}]", "Path not found: /01");
+	verify_patch_error("[1]", "[{\"op\": \"remove\", \"path\": \"/-\"}]", "Path not found: /-");
+	verify_patch_error("{}", "[{\"op\": \"remove\", \"path\": \"a\"}]", "Invalid JSON pointer: a");
+	verify_patch_error("{}", "[{\"op\": \"remove\", \"path\": \"/a~2\"}]", "Invalid JSON pointer: /a~2");
+	verify_patch_error("{\"a\": {}}", "[{\"op\": \"move\", \"from\": \"/a\", \"path\": \"/a/b\"}]",
+			   "Can't move /a into itself");
+
+	/* the example of RFC 7396 */
+	patched = parse("{\"title\": \"Goodbye!\", \"author\": {\"givenName\": \"John\", \"familyName\": \"Doe\"},"
+		"\"tags\": [\"example\", \"sample\"], \"content\": \"This will be unchanged\"}");
+	json::Value merge = parse("{\"title\": \"Hello!\", \"phoneNumber\": \"+01-123-456-7890\","
+		"\"author\": {\"familyName\": null}, \"tags\": [\"example\"]}");
+	json::Value merged = parse("{\"title\": \"Hello!\", \"author\": {\"givenName\": \"John\"},"
+		"\"tags\": [\"example\"], \"content\": \"This will be unchanged\","
+		"\"phoneNumber\": \"+01-123-456-7890\"}");
+	json::Value original = patched;
+	patched.merge_patch(merge);
+	assert(patched == merged);
+	assert(json::merge_diff(original, merged) == merge);
+}
+
+void write_file(const char *path, const char *data)
+{
+	std::ofstream os(path);
+	os << data;
+}
+
+void *get_cached(void *arg)
+{
+	json::DocumentCache *cache = (json::DocumentCache *) arg;
+	json::WriteOptions options;
+	options.cache = true;
+	for (int i = 0; i < 100; ++i) {
+		json::Document doc = cache->get("test-cache.json");
+		assert(doc->get("a").as_array().size() >= 2);
+		/* the output of shared documents is not cached */
+		std::ostringstream os;
+		doc->write(os, options);
+		assert(os.str()[0] == '{');
+	}
+	return NULL;
+}
+
+void test_document_cache()
+{
+	const char *path = "test-cache.json";
+	write_file(path, "{\"a\": [1, 2]}");
+	json::DocumentCache cache;
+	json::Document doc = cache.get(path);
+	assert(*doc == parse("{\"a\": [1, 2]}"));
+	assert(cache.size() == 1);
+	size_t memory = cache.memory();
+	assert(memory == doc->memory_usage());
+
+	/* modifying a copy copies the modified containers */
+	json::Value copy = doc.copy();
+	copy.get("a").append(3);
+	copy.shrink_to_fit();
+	assert(*cache.get(path) == parse("{\"a\": [1, 2]}"));
+	assert(copy == parse("{\"a\": [1, 2, 3]}"));
+
+	/* the old version is returned until the new one is loaded */
+	write_file(path, "{\"a\": [1, 2, 3, 4]}");
+	assert(*cache.get(path) == parse("{\"a\": [1, 2]}"));
+	cache.flush();
+	assert(*cache.get(path) == parse("{\"a\": [1, 2, 3, 4]}"));
+	assert(cache.memory() > memory);
+	assert(*doc == parse("{\"a\": [1, 2]}"));
+
+	/* a version that fails to load is not used */
+	write_file(path, "{\"a\": [1, 2, 3");
+	assert(cache.get(path)->get("a").as_array().size() == 4);
+	cache.flush();
+	assert(cache.get(path)->get("a").as_array().size() == 4);
+	cache.flush();
+
+	/* threads share the document */
+	const char *nested = "{\"a\": [1, 2, 3], \"b\": {\"c\": \"long enough for the output cache\"}}";
+	write_file(path, nested);
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i)
+		pthread_create(&threads[i], NULL, get_cached, &cache);
+	for (int i = 0; i < 4; ++i)
+		pthread_join(threads[i], NULL);
+	cache.flush();
+	assert(*cache.get(path) == parse(nested));
+
+	cache.remove(path);
+	assert(cache.size() == 0 && cache.memory() == 0);
+
+	/* a reload that is pending when the path is dropped and added again */
+	for (int i = 0; i < 20; ++i) {
+		write_file(path, i % 2 ? "[1]" : "[1, 2, 3, 4, 5, 6, 7, 8]");
+		cache.get(path);
+		write_file(path, i % 2 ? "[1, 2, 3, 4, 5, 6, 7, 8]" : "[1]");
+		cache.get(path);
+		cache.remove(path);
+		json::Document again = cache.get(path);
+		cache.flush();
+		assert(cache.size() == 1);
+		assert(cache.memory() == cache.get(path)->memory_usage());
+		cache.remove(path);
+		assert(cache.memory() == 0);
+	}
+	write_file(path, nested);
+
+	/* documents over the budget are not kept */
+	json::DocumentCache small(16);
+	assert(*small.get(path) == parse(nested));
+	assert(small.size() == 0 && small.memory() == 0);
+
+	remove(path);
+	try {
+		cache.get(path);
+		assert(0);
+	} catch (const std::runtime_error &e) {
+		assert(e.what() == std::string("test-cache.json: No such file or directory"));
+	}
 }
 
 int main()
@@ -167,6 +1783,28 @@ int main()
 	}
 
 	test_lazy_array();
+	test_read_ahead();
+	test_stats();
+	test_utf8();
+	test_reformat();
+	test_raw_numbers();
+	test_reclaimer();
+	test_forward_array();
+	test_prefetcher();
+	test_table();
+	test_shapes();
+	test_offset_index();
+	test_write_cache();
+	test_schema();
+	test_keys();
+	test_limits();
+	test_sources();
+	test_compression(json::COMPRESS_GZIP);
+	test_compression(json::COMPRESS_ZSTD);
+	test_memory();
+	test_hash();
+	test_patch();
+	test_document_cache();
 
 	printf("ok\n");
 	return 0;